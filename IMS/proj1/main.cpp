@@ -1,19 +1,47 @@
 #include <iostream>
 #include <iomanip>
+#include <cstdio>
 #include <locale>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <assert.h>
+#include <unistd.h>
 #include "simlib.h"
 
-#ifdef IMS_DEBUG
-    #define dbgout std::cout
-#else
-    std::ostream nullsink(0);
-    #define dbgout nullsink
+// Log levels
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+
+// Highest log level compiled into the binary
+#ifndef IMS_LOG_LEVEL
+    #ifdef IMS_DEBUG
+        #define IMS_LOG_LEVEL LOG_DEBUG
+    #else
+        #define IMS_LOG_LEVEL -1
+    #endif
 #endif
 
+// Log line length and number of lines in the log ring buffer
+#define LOG_LINE 128
+#define LOG_SLOTS 4096
+
+/**
+ * @brief Write a log line with given level
+ * @details Arguments of the << chain are evaluated only if the level is
+ *          both compiled in (IMS_LOG_LEVEL) and enabled at runtime (-v), so
+ *          disabled log statements cost at most one integer comparison
+ */
+#define dbglog(level) \
+    !((level) <= IMS_LOG_LEVEL && (level) <= logLevel) ? (void)0 : \
+        LogVoidify() & LogLine()
+
 #define SIMULATION_MINUTE 60.0
 #define SIMULATION_HOUR (SIMULATION_MINUTE * 60.0)
 #define SIMULATION_DAY (SIMULATION_HOUR * 24.0)
@@ -29,6 +57,19 @@
 #define GARBAGE_TRUCKS 2
 // Garbage truck capacity (kg)
 #define GARBAGE_TRUCK_CAP 4000.0
+// Part of the truck capacity a planned tour may use, the rest is a reserve
+// for forecast errors
+#define ROUTE_FILL 0.9
+// Number of nearest buildings considered for each building by the planner
+#define ROUTE_NEIGHBOURS 8
+// Largest amount of waste processed by one depot line at once (kg)
+#define DEPOT_BATCH 8000.0
+// Trace buffer size and sampling interval of queue lengths
+#define TRACE_BUFFER (1 << 20)
+#define TRACE_ROW_MAX 128
+#define TRACE_INTERVAL SIMULATION_HOUR
+// Working time of one truck per week
+#define TRUCK_WEEK_TIME (SIMULATION_HOUR * 8.0 * 5.0)
 
 typedef struct
 {
@@ -46,15 +87,28 @@ typedef struct
     unsigned int next;
     double time;
     double move_time;
+    double week_time;
     float waste;
+    std::vector<unsigned int> route;    // Building indices in visiting order
+    std::vector<unsigned int> tours;    // End offsets of tours in route
+    unsigned int depot;                 // Depot the truck starts from
     Facility taken;
 } TruckData;
 
-// Forward declaration for following std::vector
-class Building;
+typedef struct
+{
+    std::string name;
+    double travel_out;      // Mean travel time from the depot to the map
+    double travel_back;     // Mean travel time from the map to the depot
+    float capacity;         // Storage capacity (kg)
+    float throughput;       // Processing rate of one line (kg per hour)
+    float stored;           // Waste waiting for processing
+    float reserved;         // Waste of trucks heading to the depot
+    float processed;        // Total processed waste
+    Store lines;            // Processing lines
+} Depot;
 
 Facility workingHours("Working hours");
-Facility wasteProcessing("Waste processing");
 Store garbageTrucks("Gargbage trucks", GARBAGE_TRUCKS);
 Histogram histCollectionTime("Collection time per building (minutes)", 0,
         1.5, 15);
@@ -63,11 +117,14 @@ Histogram histCollectionPerWeek("Total collection time per week (hours)",
 Histogram histWastePerWeek("Waste per week (kilograms)", 27500, 2500, 8);
 TruckData truckData[GARBAGE_TRUCKS];
 WasteStatistics wasteStats;
-std::vector<Building*> buildings;
+std::vector<Depot*> depots;
 float wasteCollected = 0;
 float weekWaste = 0;
 double weekCollection = 0;
+double mapPosition = 0;
+double depotTravel = 0;
 int failedCollections = 0;
+int logLevel = IMS_LOG_LEVEL;
 
 int current_week()
 {
@@ -80,11 +137,240 @@ int current_day()
 }
 
 /**
- * @brief Building object
- * @details An object simulating a building (house, factory, ...) and its
- *          waste production
+ * @brief Asynchronous log writer
+ * @details Single-producer single-consumer lock-free ring buffer of
+ *          fixed-size log lines. The simulation only copies finished lines
+ *          into the ring, a background thread writes them to the standard
+ *          output.
+ */
+class AsyncLog
+{
+public:
+    AsyncLog() : head(0), tail(0), running(false) {}
+
+    ~AsyncLog() {
+        Stop();
+    }
+
+    void Start() {
+        running = true;
+        writer = std::thread(&AsyncLog::Flush, this);
+    }
+
+    void Stop() {
+        if(!running)
+            return;
+
+        running = false;
+        writer.join();
+    }
+
+    void Push(const char *text, size_t len) {
+        size_t h = head.load(std::memory_order_relaxed);
+
+        // Ring is full, wait for the writer
+        while(h - tail.load(std::memory_order_acquire) >= LOG_SLOTS)
+            std::this_thread::yield();
+
+        Slot &slot = slots[h % LOG_SLOTS];
+        memcpy(slot.text, text, len);
+        slot.len = len;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+private:
+    typedef struct {
+        char text[LOG_LINE];
+        size_t len;
+    } Slot;
+
+    Slot slots[LOG_SLOTS];
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<bool> running;
+    std::thread writer;
+
+    void Flush() {
+        bool last = false;
+
+        while(!last) {
+            last = !running.load(std::memory_order_acquire);
+            size_t t = tail.load(std::memory_order_relaxed);
+            size_t h = head.load(std::memory_order_acquire);
+            if(t == h) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            for(; t != h; t++) {
+                Slot &slot = slots[t % LOG_SLOTS];
+                fwrite(slot.text, 1, slot.len, stdout);
+            }
+
+            tail.store(t, std::memory_order_release);
+            fflush(stdout);
+            // Drain everything written before Stop()
+            last = false;
+        }
+    }
+};
+
+AsyncLog asyncLog;
+
+/**
+ * @brief One log line, formatted into a fixed buffer and pushed into
+ *        the log ring buffer when destroyed
+ */
+class LogLine
+{
+public:
+    LogLine() : len(0) {}
+
+    ~LogLine() {
+        text[len++] = '\n';
+        asyncLog.Push(text, len);
+    }
+
+    LogLine &operator<<(const char *str) {
+        return Append(str, strlen(str));
+    }
+
+    LogLine &operator<<(const std::string &str) {
+        return Append(str.c_str(), str.size());
+    }
+
+    LogLine &operator<<(int value) {
+        return Format("%d", value);
+    }
+
+    LogLine &operator<<(unsigned int value) {
+        return Format("%u", value);
+    }
+
+    LogLine &operator<<(long value) {
+        return Format("%ld", value);
+    }
+
+    LogLine &operator<<(unsigned long value) {
+        return Format("%lu", value);
+    }
+
+    LogLine &operator<<(double value) {
+        return Format("%g", value);
+    }
+
+private:
+    char text[LOG_LINE];
+    size_t len;
+
+    LogLine &Append(const char *str, size_t n) {
+        // Keep space for the line terminator
+        n = std::min(n, LOG_LINE - 1 - len);
+        memcpy(text + len, str, n);
+        len += n;
+        return *this;
+    }
+
+    template<typename T>
+    LogLine &Format(const char *fmt, T value) {
+        char buf[32];
+        int rc = snprintf(buf, sizeof(buf), fmt, value);
+        return Append(buf, (rc > 0) ? std::min((size_t)rc, sizeof(buf) - 1)
+                                    : 0);
+    }
+};
+
+/**
+ * @brief Turns the dbglog() expression into void, so it can be used as
+ *        a branch of the conditional operator
+ */
+class LogVoidify
+{
+public:
+    void operator&(const LogLine &) {}
+};
+
+/**
+ * @brief Time series output of the simulation
+ * @details Rows (run, time in hours, series name, series ID, value) are
+ *          formatted into a large in-memory buffer, which is written into
+ *          the CSV file only when it's full, so one row costs roughly
+ *          one snprintf() call
+ */
+class TraceSink
+{
+public:
+    TraceSink() : out(NULL), used(0), run(0) {}
+
+    ~TraceSink() {
+        Close();
+    }
+
+    bool Open(const std::string &file, long seed) {
+        out = fopen(file.c_str(), "w");
+        if(out == NULL)
+            return false;
+
+        run = seed;
+        buffer.resize(TRACE_BUFFER);
+        used = snprintf(buffer.data(), TRACE_BUFFER,
+                        "run,time,series,id,value\n");
+        return true;
+    }
+
+    bool Enabled() {
+        return out != NULL;
+    }
+
+    void Record(const char *series, int id, double value) {
+        int rc;
+
+        if(out == NULL)
+            return;
+
+        if(TRACE_BUFFER - used < TRACE_ROW_MAX)
+            Flush();
+
+        rc = snprintf(buffer.data() + used, TRACE_BUFFER - used,
+                      "%ld,%.4f,%s,%d,%.4f\n", run, Time / SIMULATION_HOUR,
+                      series, id, value);
+        if(rc > 0)
+            used += rc;
+    }
+
+    void Flush() {
+        if(out != NULL && used > 0)
+            fwrite(buffer.data(), 1, used, out);
+        used = 0;
+    }
+
+    void Close() {
+        if(out == NULL)
+            return;
+
+        Flush();
+        fclose(out);
+        out = NULL;
+    }
+
+private:
+    FILE *out;
+    std::vector<char> buffer;
+    size_t used;
+    long run;
+};
+
+TraceSink trace;
+
+/**
+ * @brief Building storage
+ * @details Buildings (houses, factories, ...) are stored as a structure of
+ *          arrays. Their waste production is not driven by weekly events,
+ *          waste is accrued lazily from the number of weeks elapsed since
+ *          the last access to the building instead, so the event count
+ *          doesn't depend on the number of buildings.
  */
-class Building : public Event
+class BuildingStore
 {
 public:
     typedef enum {
@@ -94,31 +380,62 @@ public:
         LARGE_FACT = 3,
     } TYPE;
 
-    Building(TYPE t, double ttn, const std::string &n, unsigned int inh = 0) :
-        type(t), time_to_next(ttn), name(n), inhabitants(inh),
-        waste_produced(0) {}
+    void Add(TYPE t, double pos, unsigned int inh = 0) {
+        type.push_back(t);
+        position.push_back(pos);
+        inhabitants.push_back(inh);
+        waste_produced.push_back(0);
+        waste_week.push_back(-1);
+        collected_week.push_back(-1);
+    }
+
+    unsigned int Size() {
+        return type.size();
+    }
+
+    float GetWaste(unsigned int b) {
+        AddWaste(b);
+        return waste_produced[b];
+    }
+
+    /**
+     * @brief Expected amount of waste at the beginning of given week
+     * @details Follows AddWaste(): medium and large factories don't produce
+     *          any waste in this model, so only what they already hold is
+     *          expected there
+     */
+    float ForecastWaste(unsigned int b, int week) {
+        int weeks = std::max(week - waste_week[b], 0);
 
-    float GetWaste() {
-        return waste_produced;
+        switch(type[b]) {
+        case HOUSE:
+            return waste_produced[b] +
+                   weeks * inhabitants[b] * WASTE_PER_PERSON;
+        case SMALL_FACT:
+            return (weeks > 0) ? (500 + 999) / 2.0 : waste_produced[b];
+        default:
+            return waste_produced[b];
+        }
     }
 
-    float CollectWaste() {
-        float w = waste_produced;
-        waste_produced = 0;
-        waste_collected = true;
+    float CollectWaste(unsigned int b) {
+        AddWaste(b);
+        float w = waste_produced[b];
+        waste_produced[b] = 0;
+        collected_week[b] = current_week();
         return w;
     }
 
-    bool WasteCollected() {
-        return waste_collected;
+    bool WasteCollected(unsigned int b) {
+        return collected_week[b] == current_week();
     }
 
-    double CollectionTime() {
+    double CollectionTime(unsigned int b) {
         double t;
 
-        switch(type) {
+        switch(type[b]) {
         case HOUSE:
-            t = SIMULATION_MINUTE * (inhabitants / 10 + 1);
+            t = SIMULATION_MINUTE * (inhabitants[b] / 10 + 1);
             break;
         case SMALL_FACT:
             t = SIMULATION_MINUTE * 10;
@@ -137,41 +454,236 @@ public:
         return t;
     }
 
-    double TimeToNext() {
-        return time_to_next;
+    /**
+     * @brief Position of the building on the map (travel time from the
+     *        first building)
+     */
+    double Position(unsigned int b) {
+        return position[b];
     }
 
 private:
-    TYPE type;
-    double time_to_next;
-    std::string name;
-    unsigned int inhabitants;
-    float waste_produced;
-    bool waste_collected = false;
-
-    void Behavior() {
-        AddWaste();
-        dbgout << "[WEEK " << current_week() << "] Object '" << name
-                  << "' produced " << waste_produced
-                  << " kilograms of waste" << std::endl;
-        Activate(Time+SIMULATION_WEEK);
-    }
+    std::vector<TYPE> type;
+    std::vector<double> position;
+    std::vector<unsigned int> inhabitants;
+    std::vector<float> waste_produced;
+    std::vector<int> waste_week;        // Last week with accrued waste
+    std::vector<int> collected_week;    // Week of the last collection
 
-    void AddWaste() {
-        waste_collected = false;
+    /**
+     * @brief Accrue waste produced since the last access
+     * @details Waste is produced at the beginning of each week
+     */
+    void AddWaste(unsigned int b) {
+        int week = current_week();
+        int weeks = week - waste_week[b];
+        if(weeks <= 0)
+            return;
 
-        switch(type) {
+        waste_week[b] = week;
+        switch(type[b]) {
         case HOUSE:
-            waste_produced += inhabitants * WASTE_PER_PERSON;
+            waste_produced[b] += weeks * inhabitants[b] * WASTE_PER_PERSON;
             break;
         case SMALL_FACT:
-            waste_produced = Uniform(500,999);
+            waste_produced[b] = Uniform(500,999);
             break;
+        default:
+            break;
+        }
+    }
+};
+
+BuildingStore buildings;
+
+typedef struct
+{
+    double value;
+    unsigned int a;
+    unsigned int b;
+} Saving;
+
+/**
+ * @brief Travel time between two buildings
+ */
+double route_distance(unsigned int a, unsigned int b)
+{
+    return fabs(buildings.Position(a) - buildings.Position(b));
+}
+
+/**
+ * @brief Travel time between a building and the nearest depot
+ * @details Depots are not placed on the 1-D map, so every building is the
+ *          same distance from them.
+ */
+double depot_distance()
+{
+    return depotTravel;
+}
 
+/**
+ * @brief Reset per-week route data of all trucks
+ */
+void clear_routes()
+{
+    for(unsigned int i = 0; i < GARBAGE_TRUCKS; i++) {
+        truckData[i].route.clear();
+        truckData[i].tours.clear();
+        truckData[i].start = 0;
+        truckData[i].next = 0;
+        truckData[i].end = 0;
+    }
+}
+
+#ifdef IMS_STATIC_ROUTES
+/**
+ * @brief Split the building list evenly between trucks in its index order
+ *        (reference plan for comparison with the planned tours)
+ */
+void plan_routes(int)
+{
+    unsigned int x = buildings.Size() / GARBAGE_TRUCKS;
+
+    clear_routes();
+    for(unsigned int i = 0; i < GARBAGE_TRUCKS; i++) {
+        unsigned int last = (i == GARBAGE_TRUCKS - 1) ? buildings.Size()
+                                                      : i * x + x;
+        for(unsigned int b = i * x; b < last; b++)
+            truckData[i].route.push_back(b);
+
+        truckData[i].tours.push_back(truckData[i].route.size());
+        truckData[i].end = truckData[i].route.size();
+    }
+}
+#else
+/**
+ * @brief Plan capacity-constrained collection tours for given week
+ * @details Clarke-Wright savings heuristic with the savings list limited to
+ *          ROUTE_NEIGHBOURS nearest buildings, which keeps the planning
+ *          O(n log n) even for maps with tens of thousands of buildings.
+ *          The depot distance is the same for all buildings, so the saving
+ *          degenerates to a constant minus the distance of the pair and the
+ *          merging joins the nearest pairs first; the capacity limit is what
+ *          splits the map into tours. Each tour is an undirected path, so
+ *          merging two tours is just linking their end points. Finished
+ *          tours are assigned to trucks longest first, always to the least
+ *          loaded truck.
+ */
+void plan_routes(int week)
+{
+    unsigned int n = buildings.Size();
+    std::vector<float> load(n);
+    std::vector<unsigned int> parent(n);
+    std::vector<int> adj(n * 2, -1);
+    std::vector<unsigned int> order;
+    std::vector<Saving> savings;
+    std::vector<unsigned int> stops;
+    std::vector<unsigned int> bounds;
+    std::vector<double> duration;
+    std::vector<unsigned int> by_duration;
+    std::vector<bool> visited(n, false);
+    double truck_time[GARBAGE_TRUCKS] = { 0, };
+
+    auto find = [&parent](unsigned int x) {
+        while(parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
         }
+        return x;
+    };
+
+    for(unsigned int i = 0; i < n; i++) {
+        parent[i] = i;
+        load[i] = buildings.ForecastWaste(i, week);
+        if(load[i] > 0)
+            order.push_back(i);
     }
 
-};
+    std::sort(order.begin(), order.end(),
+            [](unsigned int a, unsigned int b) {
+                return buildings.Position(a) < buildings.Position(b);
+            });
+
+    // Savings for the nearest neighbours of each building
+    for(unsigned int p = 0; p < order.size(); p++) {
+        for(unsigned int q = p + 1;
+                q < order.size() && q <= p + ROUTE_NEIGHBOURS; q++) {
+            unsigned int a = order[p], b = order[q];
+            savings.push_back({ 2 * depot_distance() - route_distance(a, b),
+                                a, b });
+        }
+    }
+
+    std::sort(savings.begin(), savings.end(),
+            [](const Saving &x, const Saving &y) {
+                return x.value > y.value;
+            });
+
+    // Merge tours, best savings first
+    for(const Saving &s : savings) {
+        unsigned int ra = find(s.a);
+        unsigned int rb = find(s.b);
+        if(ra == rb || adj[s.a * 2 + 1] != -1 || adj[s.b * 2 + 1] != -1)
+            continue;
+
+        if(load[ra] + load[rb] > GARBAGE_TRUCK_CAP * ROUTE_FILL)
+            continue;
+
+        adj[s.a * 2 + (adj[s.a * 2] != -1)] = s.b;
+        adj[s.b * 2 + (adj[s.b * 2] != -1)] = s.a;
+        parent[rb] = ra;
+        load[ra] += load[rb];
+    }
+
+    // Walk each tour from one of its end points
+    for(unsigned int start : order) {
+        if(visited[start] || adj[start * 2 + 1] != -1)
+            continue;
+
+        double d = depot_distance();
+        int prev = -1;
+        int cur = start;
+        while(cur != -1) {
+            visited[cur] = true;
+            stops.push_back(cur);
+            d += buildings.CollectionTime(cur);
+            int next = (adj[cur * 2] != prev) ? adj[cur * 2]
+                                              : adj[cur * 2 + 1];
+            if(next != -1)
+                d += route_distance(cur, next);
+            else
+                d += depot_distance();
+            prev = cur;
+            cur = next;
+        }
+
+        by_duration.push_back(bounds.size());
+        bounds.push_back(stops.size());
+        duration.push_back(d);
+    }
+
+    std::sort(by_duration.begin(), by_duration.end(),
+            [&duration](unsigned int a, unsigned int b) {
+                return duration[a] > duration[b];
+            });
+
+    clear_routes();
+    for(unsigned int t : by_duration) {
+        unsigned int truck = 0;
+        for(unsigned int i = 1; i < GARBAGE_TRUCKS; i++) {
+            if(truck_time[i] < truck_time[truck])
+                truck = i;
+        }
+
+        truck_time[truck] += duration[t];
+        std::vector<unsigned int> &route = truckData[truck].route;
+        route.insert(route.end(), stops.begin() + (t ? bounds[t - 1] : 0),
+                     stops.begin() + bounds[t]);
+        truckData[truck].tours.push_back(route.size());
+        truckData[truck].end = route.size();
+    }
+}
+#endif
 
 /**
  * @brief An object simulating one real-life day
@@ -190,12 +702,10 @@ private:
         }
 
         if(work_hours > 0) {
-            dbgout << "[DAY " << curr_day << "] WORKING HOURS"
-                      << std::endl;
+            dbglog(LOG_DEBUG) << "[DAY " << curr_day << "] WORKING HOURS";
             Wait(SIMULATION_HOUR * work_hours);
         }
-        dbgout << "[DAY " << curr_day << "] NON-WORKING HOURS"
-                  << std::endl;
+        dbglog(LOG_DEBUG) << "[DAY " << curr_day << "] NON-WORKING HOURS";
         Seize(workingHours, 1);
         Wait(SIMULATION_HOUR * nonwork_hours);
         Release(workingHours);
@@ -210,16 +720,25 @@ private:
             bool failed = 0;
             // End of the week - collect data for statistics
             histWastePerWeek(weekWaste);
+            trace.Record("week_waste", 0, weekWaste);
+            trace.Record("week_collection", 0,
+                         weekCollection / SIMULATION_HOUR);
             weekWaste = 0;
 
-            // Reset all garbage trucks' last positions
             for(unsigned int i = 0; i < GARBAGE_TRUCKS; i++) {
                 if(truckData[i].next != truckData[i].end)
                     failed = true;
 
-                truckData[i].next = truckData[i].start;
+                trace.Record("truck_hours", i,
+                             truckData[i].week_time / SIMULATION_HOUR);
+                trace.Record("truck_utilisation", i,
+                             truckData[i].week_time / TRUCK_WEEK_TIME);
+                truckData[i].week_time = 0;
             }
 
+            // Plan tours for the next week
+            plan_routes(current_week() + 1);
+
             histCollectionPerWeek(weekCollection / SIMULATION_HOUR);
             weekCollection = 0;
 
@@ -232,6 +751,84 @@ private:
     }
 };
 
+/**
+ * @brief One processing line of a depot
+ * @details The line keeps processing batches of at most DEPOT_BATCH
+ *          kilograms while there is any waste stored in the depot
+ */
+class ProcessWaste : public Process
+{
+public:
+    ProcessWaste(Depot *d) : depot(d) {}
+
+private:
+    Depot *depot;
+
+    void Behavior() {
+        Enter(depot->lines, 1);
+        while(depot->stored > 0.0) {
+            float w = std::min(depot->stored, (float)DEPOT_BATCH);
+            depot->stored -= w;
+            Wait(Exponential(w / depot->throughput * SIMULATION_HOUR));
+            wasteStats.dumped += w * 0.56;
+            wasteStats.recycled += w * 0.23;
+            wasteStats.burned += w * 0.18;
+            wasteStats.composted += w * 0.03;
+            wasteStats.total += w;
+            wasteCollected -= w;
+            depot->processed += w;
+        }
+        Leave(depot->lines, 1);
+    }
+};
+
+/**
+ * @brief Choose a depot for a truck returning with given amount of waste
+ * @details Depots are ranked by the travel time, plus (unless
+ *          IMS_NEAREST_DEPOT is defined) the expected time to process the
+ *          waste already stored or heading there. Depots without enough free
+ *          storage are used only if all of them are full.
+ *
+ * @param current Depot the truck started from (preferred on ties)
+ * @param waste Amount of waste in the truck
+ * @return Index of the chosen depot
+ */
+unsigned int choose_depot(unsigned int current, float waste)
+{
+    unsigned int best = current;
+    double best_cost = 0;
+
+    for(unsigned int i = 0; i < depots.size(); i++) {
+        Depot *d = depots[i];
+        double cost = d->travel_back;
+#ifndef IMS_NEAREST_DEPOT
+        cost += (d->stored + d->reserved) / d->throughput /
+                d->lines.Capacity() * SIMULATION_HOUR;
+#endif
+        if(d->stored + d->reserved + waste > d->capacity)
+            cost += SIMULATION_WEEK;
+
+        if(i == 0 || cost < best_cost ||
+                (cost == best_cost && i == current)) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Store waste in given depot and start an idle processing line
+ */
+void unload_waste(Depot *depot, float waste)
+{
+    depot->stored += waste;
+    wasteCollected += waste;
+    if(depot->stored > 0.0 && !depot->lines.Full())
+        (new ProcessWaste(depot))->Activate();
+}
+
 class GarbageTruck : public Process
 {
 public:
@@ -245,60 +842,85 @@ private:
     void Behavior() {
         double t;
         double total_time = 0;
+        int prev = -1;
+        TruckData &td = truckData[truck_id];
         Seize(workingHours);
         Seize(truckData[truck_id].taken);
         Enter(garbageTrucks, 1);
         Release(workingHours);
 
-        t = Exponential(SIMULATION_MINUTE * 15);
+        t = Exponential(depots[td.depot]->travel_out);
         Wait(t);
         total_time += t;
         truckData[truck_id].move_time += t;
 
-        for(unsigned int i = truckData[truck_id].start;
-                i < truckData[truck_id].end; i++) {
-            if(buildings[i]->WasteCollected())
+        // Current tour ends at the first tour boundary after 'next'
+        unsigned int tour_end = td.end;
+        for(unsigned int end : td.tours) {
+            if(end > td.next) {
+                tour_end = end;
+                break;
+            }
+        }
+
+        for(unsigned int k = td.next; k < tour_end && k < td.route.size();
+                k++) {
+            unsigned int b = td.route[k];
+            if(buildings.WasteCollected(b)) {
+                td.next = k + 1;
                 continue;
+            }
 
-            float w = buildings[i]->GetWaste();
+            float w = buildings.GetWaste(b);
             assert(w <= GARBAGE_TRUCK_CAP);
-            if((waste + w) < GARBAGE_TRUCK_CAP) {
-                // Garbage collection
-                waste += buildings[i]->CollectWaste();
-                t = Exponential(buildings[i]->CollectionTime());
-                Wait(t);
-                total_time += t;
-                truckData[truck_id].next++;;
-                histCollectionTime(t / SIMULATION_MINUTE);
-                dbgout << "[TRUCK #" << truck_id << "] Collected " << w
-                       << " kg of waste" << std::endl;
-            } else {
+            if((waste + w) >= GARBAGE_TRUCK_CAP) {
                 // Truck is full
                 break;
             }
 
-            if(workingHours.Busy()) {
-                // Return back
-                break;
+            if(prev != -1) {
+                t = Exponential(route_distance(prev, b));
+                Wait(t);
+                total_time += t;
+                td.move_time += t;
             }
 
-            t = Exponential(buildings[i]->TimeToNext());
+            // Garbage collection
+            waste += buildings.CollectWaste(b);
+            t = Exponential(buildings.CollectionTime(b));
             Wait(t);
             total_time += t;
-            truckData[truck_id].move_time += t;
+            td.next = k + 1;
+            prev = b;
+            histCollectionTime(t / SIMULATION_MINUTE);
+            dbglog(LOG_DEBUG) << "[TRUCK #" << truck_id << "] Collected "
+                              << w << " kg of waste";
+
+            if(workingHours.Busy()) {
+                // Return back
+                break;
+            }
         }
 
-        dbgout << "[TRUCK #" << truck_id << "] Returning back" << std::endl;
-        t = Exponential(SIMULATION_MINUTE * 25);
+        unsigned int target = choose_depot(td.depot, waste);
+        Depot *depot = depots[target];
+        dbglog(LOG_DEBUG) << "[TRUCK #" << truck_id << "] Returning to "
+                          << depot->name;
+        depot->reserved += waste;
+        t = Exponential(depot->travel_back);
         Wait(t);
         total_time += t;
         truckData[truck_id].move_time += t;
-        dbgout << "[TRUCK #" << truck_id << "] TOTAL COLLECTED: " << waste
-               << " kg" << std::endl;
+        dbglog(LOG_DEBUG) << "[TRUCK #" << truck_id << "] TOTAL COLLECTED: "
+                          << waste << " kg";
 
+        depot->reserved -= waste;
+        unload_waste(depot, waste);
+        // Next trip starts from the depot the truck ended at
+        td.depot = target;
         truckData[truck_id].time += total_time;
+        truckData[truck_id].week_time += total_time;
         weekCollection += total_time;
-        wasteCollected += waste;
         truckData[truck_id].waste += waste;;
         weekWaste += waste;
         Leave(garbageTrucks, 1);
@@ -324,54 +946,101 @@ private:
     }
 };
 
-class ProcessWaste : public Process
+/**
+ * @brief Periodic sampling of queue lengths and facility occupancy
+ */
+class TraceSampler : public Event
 {
 private:
     void Behavior() {
-        Seize(wasteProcessing);
-        float w = wasteCollected;
-        Wait(Exponential(SIMULATION_HOUR * 3));
-        wasteStats.dumped += w * 0.56;
-        wasteStats.recycled += w * 0.23;
-        wasteStats.burned += w * 0.18;
-        wasteStats.composted += w * 0.03;
-        wasteStats.total += w;
-        wasteCollected -= w;
-        Release(wasteProcessing);
+        trace.Record("trucks_out", 0, garbageTrucks.Used());
+        trace.Record("trucks_queue", 0, garbageTrucks.QueueLen());
+        for(unsigned int i = 0; i < depots.size(); i++) {
+            trace.Record("processing_busy", i, depots[i]->lines.Used());
+            trace.Record("processing_kg", i, depots[i]->stored);
+        }
+        trace.Record("waste_pending", 0, wasteCollected);
+        Activate(Time + TRACE_INTERVAL);
     }
 };
 
-class WasteProcessing : public Event
+/**
+ * @brief Add a waste processing depot
+ *
+ * @param name Depot name
+ * @param out Mean travel time from the depot to the map
+ * @param back Mean travel time from the map to the depot
+ * @param capacity Storage capacity (kg)
+ * @param throughput Processing rate of one line (kg per hour)
+ * @param lines Number of processing lines
+ */
+void add_depot(const std::string &name, double out, double back,
+               float capacity, float throughput, unsigned int lines)
 {
-private:
-    void Behavior() {
-        if(wasteCollected > 0.0 && !wasteProcessing.Busy()) {
-            (new ProcessWaste)->Activate();
-        }
+    Depot *d = new Depot;
+    d->name = name;
+    d->travel_out = out;
+    d->travel_back = back;
+    d->capacity = capacity;
+    d->throughput = throughput;
+    d->stored = 0;
+    d->reserved = 0;
+    d->processed = 0;
+    d->lines.SetName(d->name.c_str());
+    d->lines.SetCapacity(lines);
+    depots.push_back(d);
 
-        Activate(Time + SIMULATION_MINUTE);
-    }
-};
+    if(depots.size() == 1 || (out + back) / 2.0 < depotTravel)
+        depotTravel = (out + back) / 2.0;
+}
 
-void add_house(const std::string &name, int inhabitants, double ttm)
+void add_house(const std::string &, int inhabitants, double ttm)
 {
-    Building *b;
-    b = new Building(Building::HOUSE, ttm, name, inhabitants);
-    b->Activate();
-    buildings.push_back(b);
+    buildings.Add(BuildingStore::HOUSE, mapPosition, inhabitants);
+    mapPosition += ttm;
 }
 
-void add_fact(Building::TYPE t, const std::string &name, double ttm)
+void add_fact(BuildingStore::TYPE t, const std::string &, double ttm)
 {
-    Building *b;
-    b = new Building(t, ttm, name);
-    b->Activate();
-    buildings.push_back(b);
+    buildings.Add(t, mapPosition);
+    mapPosition += ttm;
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    int opt;
+    long seed = 0;
+    std::string trace_file;
+
+    while((opt = getopt(argc, argv, "s:t:v:")) != -1) {
+        switch(opt) {
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'v':
+            logLevel = strtol(optarg, NULL, 10);
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-s seed] [-t trace.csv] "
+                      << "[-v level]" << std::endl;
+            return 1;
+        }
+    }
+
     Init(0, SIMULATION_TIME);
+    if(seed != 0)
+        RandomSeed(seed);
+
+    if(!trace_file.empty() && !trace.Open(trace_file, seed)) {
+        perror("Couldn't open trace file");
+        return 1;
+    }
+
+    if(logLevel >= 0 && IMS_LOG_LEVEL >= 0)
+        asyncLog.Start();
 
     // MAP
     // Street 1
@@ -438,25 +1107,25 @@ int main(void)
     add_house("House 22", 3, SIMULATION_MINUTE);
     add_house("House 23", 4, SIMULATION_MINUTE);
     // Street 5
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 3);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 3);
     add_house("Block 1", 90, SIMULATION_MINUTE * 5);
     add_house("Block 2", 90, SIMULATION_MINUTE * 5);
-    add_fact(Building::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
     add_house("Block 3", 90, SIMULATION_MINUTE * 5);
     add_house("House 1", 6, SIMULATION_MINUTE);
     add_house("Block 4", 90, SIMULATION_MINUTE * 5);
-    add_fact(Building::SMALL_FACT, "Fact 5", SIMULATION_MINUTE * 10);
-    add_fact(Building::SMALL_FACT, "Fact 6", SIMULATION_MINUTE * 7);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 5", SIMULATION_MINUTE * 10);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 6", SIMULATION_MINUTE * 7);
     add_house("Block 5", 60, SIMULATION_MINUTE);
     add_house("Block 6", 75, SIMULATION_MINUTE);
     add_house("Block 7", 50, SIMULATION_MINUTE);
     add_house("Block 8", 50, SIMULATION_MINUTE);
     add_house("House 2", 8, SIMULATION_MINUTE * 3);
     // Street 6
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
     add_house("Block 1", 30, SIMULATION_MINUTE);
     add_house("Block 2", 30, SIMULATION_MINUTE);
     add_house("Block 3", 30, SIMULATION_MINUTE);
@@ -466,16 +1135,16 @@ int main(void)
     add_house("Block 7", 30, SIMULATION_MINUTE);
     add_house("Block 8", 80, SIMULATION_MINUTE);
     // Street 7
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("Block 1", 240, SIMULATION_MINUTE * 5);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
     add_house("School 1", 150, SIMULATION_MINUTE * 5);
     add_house("Block 2", 160, SIMULATION_MINUTE * 5);
     add_house("Block 3", 160, SIMULATION_MINUTE * 5);
     add_house("Block 4", 160, SIMULATION_MINUTE * 5);
     add_house("Block 5", 160, SIMULATION_MINUTE * 5);
     add_house("Block 6", 160, SIMULATION_MINUTE * 5);
-    add_fact(Building::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
     // Street 8
     add_house("Block 1", 40, SIMULATION_MINUTE);
     add_house("Block 2", 30, SIMULATION_MINUTE);
@@ -492,13 +1161,13 @@ int main(void)
     add_house("House 9", 4, SIMULATION_MINUTE);
     add_house("House 10", 8, SIMULATION_MINUTE);
     add_house("Block 5", 20, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("House 11", 4, SIMULATION_MINUTE);
     add_house("House 12", 10, SIMULATION_MINUTE);
     add_house("Block 6", 50, SIMULATION_MINUTE);
     add_house("House 13", 10, SIMULATION_MINUTE);
     add_house("House 14", 10, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
     add_house("House 14", 10, SIMULATION_MINUTE);
     // Street 9
     add_house("Block 1", 18, SIMULATION_MINUTE);
@@ -510,8 +1179,8 @@ int main(void)
     add_house("Block 7", 15, SIMULATION_MINUTE);
     add_house("Block 8", 20, SIMULATION_MINUTE);
     add_house("Block 9", 18, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
     add_house("Block 10", 30, SIMULATION_MINUTE);
     add_house("Block 11", 32, SIMULATION_MINUTE);
     add_house("Block 12", 12, SIMULATION_MINUTE);
@@ -526,7 +1195,7 @@ int main(void)
     add_house("Block 21", 15, SIMULATION_MINUTE);
     add_house("Block 22", 13, SIMULATION_MINUTE);
     add_house("Block 23", 22, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
     add_house("House 1", 4, SIMULATION_MINUTE);
     add_house("House 2", 7, SIMULATION_MINUTE);
     add_house("House 3", 5, SIMULATION_MINUTE);
@@ -537,7 +1206,7 @@ int main(void)
     add_house("Block 27", 15, SIMULATION_MINUTE);
     add_house("Block 28", 25, SIMULATION_MINUTE);
     add_house("Block 29", 40, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
     add_house("Block 30", 35, SIMULATION_MINUTE);
     add_house("Block 31", 35, SIMULATION_MINUTE);
     add_house("Block 32", 35, SIMULATION_MINUTE);
@@ -551,22 +1220,22 @@ int main(void)
     add_house("School 1", 200, SIMULATION_MINUTE * 5);
     // Street 10
     add_house("House 1", 5, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("Block 1", 222, SIMULATION_MINUTE * 2);
     add_house("House 2", 8, SIMULATION_MINUTE);
     add_house("Block 2", 50, SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
     add_house("Block 3", 30, SIMULATION_MINUTE * 2);
     add_house("House 3", 4, SIMULATION_MINUTE);
     add_house("House 4", 6, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
     // Street 11
     add_house("House 1", 6, SIMULATION_MINUTE);
     add_house("Block 1", 20, SIMULATION_MINUTE);
     add_house("Block 2", 16, SIMULATION_MINUTE);
     add_house("House 2", 4, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("Block 3", 14, SIMULATION_MINUTE);
     add_house("Block 4", 30, SIMULATION_MINUTE);
     add_house("House 3", 8, SIMULATION_MINUTE);
@@ -590,15 +1259,15 @@ int main(void)
     add_house("House 7", 8, SIMULATION_MINUTE);
     add_house("House 8", 9, SIMULATION_MINUTE);
     add_house("House 9", 8, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
     add_house("Block 1", 35, SIMULATION_MINUTE * 2);
     add_house("Block 2", 20, SIMULATION_MINUTE * 2);
     add_house("Block 3", 32, SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 5", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 6", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 5", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 6", SIMULATION_MINUTE * 2);
     add_house("Block 4", 67, SIMULATION_MINUTE);
     add_house("Block 5", 80, SIMULATION_MINUTE);
     add_house("Block 6", 75, SIMULATION_MINUTE);
@@ -610,7 +1279,7 @@ int main(void)
     add_house("Block 12", 42, SIMULATION_MINUTE);
     add_house("Block 13", 50, SIMULATION_MINUTE);
     add_house("Block 14", 48, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 7", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 7", SIMULATION_MINUTE * 2);
     add_house("Block 15", 51, SIMULATION_MINUTE);
     add_house("Block 16", 53, SIMULATION_MINUTE);
     add_house("Block 17", 49, SIMULATION_MINUTE);
@@ -652,14 +1321,14 @@ int main(void)
     // Street 16
     add_house("House 1", 3, SIMULATION_MINUTE);
     add_house("House 2", 3, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("House 3", 7, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
     add_house("House 4", 5, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
-    add_fact(Building::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 3", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 4", SIMULATION_MINUTE * 2);
     add_house("House 5", 4, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 5", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 5", SIMULATION_MINUTE * 2);
     add_house("House 6", 5, SIMULATION_MINUTE);
     add_house("House 7", 7, SIMULATION_MINUTE);
     add_house("House 8", 6, SIMULATION_MINUTE);
@@ -679,7 +1348,7 @@ int main(void)
     add_house("House 22", 4, SIMULATION_MINUTE);
     add_house("House 23", 3, SIMULATION_MINUTE);
     add_house("Block 1", 14, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 6", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 6", SIMULATION_MINUTE * 2);
     add_house("School 1", 250, SIMULATION_MINUTE * 3);
     // Street 17
     add_house("House 1", 6, SIMULATION_MINUTE);
@@ -694,14 +1363,14 @@ int main(void)
     add_house("House 2", 4, SIMULATION_MINUTE);
     add_house("House 3", 7, SIMULATION_MINUTE);
     add_house("House 4", 5, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("Block 3", 24, SIMULATION_MINUTE);
     add_house("Block 4", 14, SIMULATION_MINUTE);
     add_house("Block 5", 12, SIMULATION_MINUTE);
     add_house("Block 6", 18, SIMULATION_MINUTE);
     add_house("Block 7", 15, SIMULATION_MINUTE);
     add_house("Block 8", 27, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
     // Street 19
     add_house("House 1", 6, SIMULATION_MINUTE);
     add_house("House 2", 5, SIMULATION_MINUTE);
@@ -746,7 +1415,7 @@ int main(void)
     add_house("House 3", 4, SIMULATION_MINUTE);
     add_house("House 4", 4, SIMULATION_MINUTE);
     add_house("House 5", 5, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 1", SIMULATION_MINUTE * 2);
     add_house("House 6", 4, SIMULATION_MINUTE);
     add_house("House 7", 4, SIMULATION_MINUTE);
     add_house("House 8", 4, SIMULATION_MINUTE);
@@ -755,36 +1424,42 @@ int main(void)
     add_house("House 11", 7, SIMULATION_MINUTE);
     add_house("House 12", 7, SIMULATION_MINUTE);
     add_house("House 13", 6, SIMULATION_MINUTE);
-    add_fact(Building::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
+    add_fact(BuildingStore::SMALL_FACT, "Fact 2", SIMULATION_MINUTE * 2);
 
 
+    // DEPOTS
+    add_depot("Depot 1", SIMULATION_MINUTE * 15, SIMULATION_MINUTE * 25,
+              200000.0, 2500.0, 1);
+
     // Initialize trucks
     for(unsigned int i = 0; i < GARBAGE_TRUCKS; i++) {
-        int x = buildings.size() / GARBAGE_TRUCKS;
-        truckData[i].start = i * x;
-        truckData[i].end = i * x + x;
-        truckData[i].next = truckData[i].start;
+        truckData[i].depot = 0;
         truckData[i].time = 0;
         truckData[i].move_time = 0;
+        truckData[i].week_time = 0;
         truckData[i].waste = 0;
     }
 
-    if(truckData[GARBAGE_TRUCKS - 1].end != buildings.size())
-        truckData[GARBAGE_TRUCKS - 1].end = buildings.size();
+    plan_routes(0);
 
     (new DaySchedule)->Activate();
     (new Trucks)->Activate();
-    (new WasteProcessing)->Activate();
+    if(trace.Enabled())
+        (new TraceSampler)->Activate();
     Run();
+    trace.Close();
+    asyncLog.Stop();
 
     // Statistics
     double total_time = 0;
+    double total_waste = 0;
     std::string delim(30, '*');
     std::cout.imbue(std::locale(""));
     std::cout << std::fixed << std::setprecision(2);
     std::cout << "Per-truck statistics:" << std::endl << delim << std::endl;
     for(unsigned int i = 0; i < GARBAGE_TRUCKS; i++) {
         total_time += truckData[i].time;
+        total_waste += truckData[i].waste;
         std::cout << "Truck #" << (i + 1) << std::endl
                   << "\tWaste collected:\t" << truckData[i].waste << " kg"
                   << std::endl
@@ -797,10 +1472,22 @@ int main(void)
     std::cout << std::endl
               << "TOTAL TIME:\t\t" << (total_time / SIMULATION_HOUR)
               << " hours" << std::endl
+              << "TRUCK-HOURS PER TON:\t"
+              << ((total_waste > 0) ? (total_time / SIMULATION_HOUR) /
+                                      (total_waste / 1000.0) : 0)
+              << std::endl
               << "FAILED COLLECTIONS:\t" << failedCollections << std::endl
               << std::endl;
+    std::cout << "Per-depot statistics:" << std::endl << delim << std::endl;
+    for(Depot *d : depots) {
+        std::cout << d->name << std::endl
+                  << "\tWaste processed:\t" << d->processed << " kg"
+                  << std::endl
+                  << "\tWaste left:\t\t" << d->stored << " kg" << std::endl;
+    }
+    std::cout << std::endl;
     std::cout << "General statistics:" << std::endl << delim << std::endl;
-    std::cout << "Total buildings: " << buildings.size() << std::endl;
+    std::cout << "Total buildings: " << buildings.Size() << std::endl;
     std::cout << "Waste statistics:" << std::endl
               << "Dumped:\t\t" << wasteStats.dumped << " kg" << std::endl
               << "Recycled:\t" << wasteStats.recycled << " kg" << std::endl
@@ -0,0 +1,729 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "proto.hpp"
+
+// Protocol version of single requests
+#define PROTO_VER "2.0"
+// Protocol version of persistent sessions
+#define PROTO_VER_BINARY "3.0"
+// Receive buffer of one worker
+#define BENCH_BUFFER (64 << 10)
+// Default file sizes and their weights
+#define BENCH_SIZES "1k:60,64k:30,1m:10"
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * @brief Error codes
+ */
+enum ec {
+    E_OK = 0,   /**< Everything is ok */
+    E_SETUP,    /**< Error in connection setup */
+    E_PARAM,    /**< Invalid parameters */
+    E_OTHER,    /**< Other error */
+    E_SOCK,     /**< Error during socket() call */
+    E_WRITE,    /**< Error during write() call */
+    E_CMD       /**< Server rejected the request */
+};
+
+/**
+ * @brief File size class of the workload
+ */
+typedef struct {
+    size_t size;        /**< File size */
+    unsigned int weight;/**< Relative frequency of requests */
+} size_class_t;
+
+/**
+ * @brief Benchmark settings shared by all workers
+ */
+typedef struct {
+    struct sockaddr_in addr;        /**< Server address */
+    vector<size_class_t> sizes;     /**< File sizes */
+    unsigned int files;             /**< Prepared files of every size */
+    unsigned int put_ratio;         /**< Percentage of PUT requests */
+    bool session;                   /**< Keep one session per worker */
+    long ops;                       /**< Number of requests, -1 if timed */
+    steady_clock::time_point end;   /**< End of a timed run */
+    atomic<long> next;              /**< Requests started so far */
+} bench_t;
+
+/**
+ * @brief Measurements of one worker, latencies are in microseconds
+ */
+typedef struct {
+    vector<uint32_t> connect;       /**< Connection setup */
+    vector<uint32_t> first_byte;    /**< Request sent to first response byte */
+    vector<uint32_t> complete;      /**< Whole request */
+    uint64_t bytes;                 /**< Transferred payload */
+    unsigned long errors;           /**< Failed requests */
+} stats_t;
+
+/**
+ * @brief Connection of a worker
+ */
+typedef struct {
+    int sd;                         /**< Socket, -1 if not connected */
+    char in[BENCH_BUFFER];          /**< Received data */
+    size_t start;                   /**< First unprocessed byte */
+    size_t end;                     /**< End of received data */
+} conn_t;
+
+/**
+ * @brief Parse list of file sizes
+ * @details Format is size[:weight][,size[:weight]...], sizes may have
+ *          k or m suffix
+ *
+ * @param str Size list
+ * @param sizes Destination for the size classes
+ *
+ * @return true on success, false if the list is invalid
+ */
+bool parse_sizes(const string &str, vector<size_class_t> &sizes);
+
+/**
+ * @brief Return name of a prepared file
+ */
+string bench_file(size_t size, unsigned int idx);
+
+/**
+ * @brief Connect to the server and measure the setup time
+ *
+ * @param b Benchmark settings
+ * @param conn Connection to set up
+ * @param st Worker statistics
+ *
+ * @return E_OK on success, E_SETUP otherwise
+ */
+int bench_connect(bench_t *b, conn_t *conn, stats_t *st);
+
+/**
+ * @brief Do one request over a new connection (protocol version 2)
+ *
+ * @param b Benchmark settings
+ * @param conn Worker connection, closed afterwards
+ * @param file File name
+ * @param size Size of uploaded data, 0 for GET
+ * @param data Uploaded data
+ * @param st Worker statistics
+ *
+ * @return Error codes from ec enum
+ */
+int single_request(bench_t *b, conn_t *conn, const string &file, size_t size,
+                   const char *data, stats_t *st);
+
+/**
+ * @brief Do one request over the worker's session (protocol version 3)
+ *
+ * @param b Benchmark settings
+ * @param conn Worker connection, set up when not connected
+ * @param file File name
+ * @param size Size of uploaded data, 0 for GET
+ * @param data Uploaded data
+ * @param st Worker statistics
+ *
+ * @return Error codes from ec enum
+ */
+int session_request(bench_t *b, conn_t *conn, const string &file, size_t size,
+                    const char *data, stats_t *st);
+
+/**
+ * @brief Receive data until given amount is buffered
+ *
+ * @param conn Worker connection
+ * @param len Required length of unprocessed data
+ * @param first Set to the time of the first received byte (if not NULL and
+ *              nothing was buffered)
+ *
+ * @return E_OK on success, E_OTHER if the server closed the connection
+ */
+int conn_fill(conn_t *conn, size_t len, steady_clock::time_point *first);
+
+/**
+ * @brief Read CRLFCRLF terminated text response
+ *
+ * @param conn Worker connection
+ * @param msg Destination for the response (without terminator)
+ * @param first Set to the time of the first received byte
+ *
+ * @return E_OK on success, E_OTHER if the server closed the connection
+ */
+int conn_message(conn_t *conn, string &msg, steady_clock::time_point *first);
+
+/**
+ * @brief Receive and discard given amount of payload
+ *
+ * @return E_OK on success, E_OTHER if the server closed the connection
+ */
+int conn_discard(conn_t *conn, uint64_t len);
+
+/**
+ * @brief Run requests until the benchmark ends
+ *
+ * @param b Benchmark settings
+ * @param id Worker number
+ * @param st Worker statistics
+ */
+void bench_worker(bench_t *b, unsigned int id, stats_t *st);
+
+/**
+ * @brief Print percentiles of given latencies
+ */
+void print_latency(const string &name, vector<uint32_t> &lat);
+
+/**
+ * @brief Write whole buffer into given descriptor
+ *
+ * @return E_OK on success, E_WRITE otherwise
+ */
+int write_all(int fd, const char *data, size_t len);
+
+/**
+ * @brief Return microseconds between two time points
+ */
+inline uint32_t usec(steady_clock::time_point from, steady_clock::time_point to)
+{
+    return duration_cast<microseconds>(to - from).count();
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, rc;
+    int port = -1;
+    unsigned int workers = 8;
+    double seconds = 0;
+    string hostname = "127.0.0.1", sizes = BENCH_SIZES;
+    struct hostent *hostp;
+    bench_t b;
+    vector<thread> threads;
+    vector<stats_t> stats;
+    stats_t total;
+
+    b.files = 16;
+    b.put_ratio = 0;
+    b.session = false;
+    b.ops = 10000;
+
+    while((opt = getopt(argc, argv, "h:p:c:n:t:s:f:w:k")) != -1) {
+        switch(opt) {
+        case 'h':
+            hostname = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            if(port < 1 || port > 65535) {
+                cerr << "Invalid port" << endl;
+                exit(E_PARAM);
+            }
+
+            break;
+        case 'c':
+            workers = max(strtoul(optarg, NULL, 10), 1ul);
+            break;
+        case 'n':
+            b.ops = max(strtol(optarg, NULL, 10), 1l);
+            break;
+        case 't':
+            seconds = strtod(optarg, NULL);
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'f':
+            b.files = max(strtoul(optarg, NULL, 10), 1ul);
+            break;
+        case 'w':
+            b.put_ratio = min(strtoul(optarg, NULL, 10), 100ul);
+            break;
+        case 'k':
+            b.session = true;
+            break;
+        default:
+            cout << "Usage: " << argv[0] << " -p port [-h host] [-c workers] "
+                    "[-n requests|-t seconds] [-s size[:weight],...] "
+                    "[-f files] [-w put%] [-k]" << endl;
+            exit(E_PARAM);
+        }
+    }
+
+    if(port == -1 || !parse_sizes(sizes, b.sizes)) {
+        cout << "Usage: " << argv[0] << " -p port [-h host] [-c workers] "
+                "[-n requests|-t seconds] [-s size[:weight],...] "
+                "[-f files] [-w put%] [-k]" << endl;
+        exit(E_PARAM);
+    }
+
+    memset(&b.addr, 0, sizeof(b.addr));
+    b.addr.sin_family = AF_INET;
+    b.addr.sin_port = htons(port);
+    b.addr.sin_addr.s_addr = inet_addr(hostname.c_str());
+    if(b.addr.sin_addr.s_addr == INADDR_NONE) {
+        hostp = gethostbyname(hostname.c_str());
+        if(hostp == NULL) {
+            cerr << "Unknown host: " << hostname << endl;
+            exit(E_SETUP);
+        }
+
+        memcpy(&b.addr.sin_addr, hostp->h_addr_list[0],
+               sizeof(b.addr.sin_addr));
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Upload the files which are downloaded later
+    {
+        conn_t *conn = new conn_t;
+        stats_t st;
+        size_t largest = 0;
+
+        st.bytes = 0;
+        st.errors = 0;
+        for(const size_class_t &c : b.sizes)
+            largest = max(largest, c.size);
+
+        vector<char> data(largest, 'x');
+        conn->sd = -1;
+        for(const size_class_t &c : b.sizes) {
+            for(unsigned int i = 0; i < b.files; i++) {
+                rc = single_request(&b, conn, bench_file(c.size, i), c.size,
+                                    data.data(), &st);
+                if(rc != E_OK) {
+                    cerr << "Unable to prepare file "
+                         << bench_file(c.size, i) << endl;
+                    delete conn;
+                    exit(rc);
+                }
+            }
+        }
+
+        delete conn;
+    }
+
+    cout << "Prepared " << b.files * b.sizes.size() << " file(s), running "
+         << workers << " worker(s)" << (b.session ? " with sessions" : "")
+         << endl;
+
+    if(seconds > 0) {
+        b.ops = -1;
+        b.end = steady_clock::now() +
+                duration_cast<steady_clock::duration>(
+                    duration<double>(seconds));
+    }
+
+    b.next = 0;
+    stats.resize(workers);
+    steady_clock::time_point start = steady_clock::now();
+    for(unsigned int i = 0; i < workers; i++)
+        threads.push_back(thread(bench_worker, &b, i, &stats[i]));
+
+    for(thread &t : threads)
+        t.join();
+
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    total.bytes = 0;
+    total.errors = 0;
+    for(stats_t &st : stats) {
+        total.connect.insert(total.connect.end(), st.connect.begin(),
+                             st.connect.end());
+        total.first_byte.insert(total.first_byte.end(),
+                                st.first_byte.begin(), st.first_byte.end());
+        total.complete.insert(total.complete.end(), st.complete.begin(),
+                              st.complete.end());
+        total.bytes += st.bytes;
+        total.errors += st.errors;
+    }
+
+    cout << fixed << setprecision(1)
+         << "Requests: " << total.complete.size() << " ok, " << total.errors
+         << " failed in " << elapsed << " s" << endl
+         << "Throughput: " << total.complete.size() / elapsed << " req/s, "
+         << total.bytes / elapsed / (1 << 20) << " MiB/s" << endl;
+
+    cout << setw(12) << left << "latency [us]" << right
+         << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "p999"
+         << setw(10) << "max" << endl;
+    print_latency("connect", total.connect);
+    print_latency("first byte", total.first_byte);
+    print_latency("complete", total.complete);
+
+    return (total.errors > 0) ? E_CMD : E_OK;
+}
+
+bool parse_sizes(const string &str, vector<size_class_t> &sizes)
+{
+    stringstream ss(str);
+    string item;
+
+    while(getline(ss, item, ',')) {
+        size_class_t c;
+        char *ptr;
+
+        c.size = strtoul(item.c_str(), &ptr, 10);
+        if(ptr == item.c_str())
+            return false;
+
+        if(*ptr == 'k' || *ptr == 'K') {
+            c.size <<= 10;
+            ptr++;
+        } else if(*ptr == 'm' || *ptr == 'M') {
+            c.size <<= 20;
+            ptr++;
+        }
+
+        c.weight = 1;
+        if(*ptr == ':')
+            c.weight = strtoul(ptr + 1, &ptr, 10);
+
+        if(*ptr != '\0' || c.size == 0 || c.weight == 0)
+            return false;
+
+        sizes.push_back(c);
+    }
+
+    return !sizes.empty();
+}
+
+string bench_file(size_t size, unsigned int idx)
+{
+    return "bench_" + to_string(size) + "_" + to_string(idx);
+}
+
+int bench_connect(bench_t *b, conn_t *conn, stats_t *st)
+{
+    steady_clock::time_point start = steady_clock::now();
+
+    conn->start = conn->end = 0;
+    conn->sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->sd < 0) {
+        perror("socket() failed");
+        return E_SOCK;
+    }
+
+    if(connect(conn->sd, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0) {
+        perror("connect() failed");
+        close(conn->sd);
+        conn->sd = -1;
+        return E_SETUP;
+    }
+
+    st->connect.push_back(usec(start, steady_clock::now()));
+    return E_OK;
+}
+
+int single_request(bench_t *b, conn_t *conn, const string &file, size_t size,
+                   const char *data, stats_t *st)
+{
+    int rc, status = -1;
+    off_t offset, length = 0, fsize;
+    string msg;
+    stringstream ss;
+    steady_clock::time_point start, sent, first;
+
+    start = steady_clock::now();
+    rc = bench_connect(b, conn, st);
+    if(rc != E_OK)
+        return rc;
+
+    ss << PROTO_NAME << " " << PROTO_VER << " "
+       << ((data != NULL && size > 0) ? "PUT 0 " + to_string(size)
+                                     : string("GET 0 0"))
+       << " " << file << "\r\n\r\n";
+    sent = steady_clock::now();
+    rc = write_all(conn->sd, ss.str().c_str(), ss.str().size());
+    if(rc == E_OK)
+        rc = conn_message(conn, msg, &first);
+
+    if(rc == E_OK) {
+        ss.clear();
+        ss.str(msg);
+        if(!(ss >> status >> msg) || status != 0 ||
+           !(ss >> offset >> length >> fsize))
+            rc = E_CMD;
+    }
+
+    if(rc == E_OK)
+        rc = write_all(conn->sd, "READY\r\n\r\n", 9);
+
+    if(rc == E_OK && size > 0) {
+        // Server closes the connection when the data are stored
+        rc = write_all(conn->sd, data, size);
+        shutdown(conn->sd, SHUT_WR);
+        while(rc == E_OK && read(conn->sd, conn->in, BENCH_BUFFER) > 0)
+            ;
+    } else if(rc == E_OK) {
+        rc = conn_discard(conn, length);
+    }
+
+    close(conn->sd);
+    conn->sd = -1;
+
+    if(rc != E_OK)
+        return rc;
+
+    st->first_byte.push_back(usec(sent, first));
+    st->complete.push_back(usec(start, steady_clock::now()));
+    st->bytes += (size > 0) ? size : length;
+    return E_OK;
+}
+
+int session_request(bench_t *b, conn_t *conn, const string &file, size_t size,
+                    const char *data, stats_t *st)
+{
+    int rc, status = -1;
+    char req[PROTO_REQ_LEN + PROTO_NAME_MAX];
+    proto_request_t hdr;
+    proto_response_t resp;
+    string msg;
+    stringstream ss;
+    steady_clock::time_point start, first;
+
+    if(conn->sd == -1) {
+        rc = bench_connect(b, conn, st);
+        if(rc != E_OK)
+            return rc;
+
+        ss << PROTO_NAME << " " << PROTO_VER_BINARY << " SESSION\r\n\r\n";
+        rc = write_all(conn->sd, ss.str().c_str(), ss.str().size());
+        if(rc == E_OK)
+            rc = conn_message(conn, msg, &first);
+
+        ss.clear();
+        ss.str(msg);
+        if(rc != E_OK || !(ss >> status) || status != 0) {
+            cerr << "Server refused the session" << endl;
+            close(conn->sd);
+            conn->sd = -1;
+            return E_CMD;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.command = (size > 0) ? PROTO_PUT : PROTO_GET;
+    hdr.name_len = file.size();
+    hdr.length = size;
+    proto_pack_request(req, &hdr);
+    memcpy(req + PROTO_REQ_LEN, file.c_str(), file.size());
+
+    start = steady_clock::now();
+    if(size > 0) {
+        // Header and payload in one segment, Nagle would delay the payload
+        rc = (send(conn->sd, req, PROTO_REQ_LEN + file.size(), MSG_MORE) ==
+              (ssize_t)(PROTO_REQ_LEN + file.size())) ? E_OK : E_WRITE;
+        if(rc == E_OK)
+            rc = write_all(conn->sd, data, size);
+    } else {
+        rc = write_all(conn->sd, req, PROTO_REQ_LEN + file.size());
+    }
+    if(rc == E_OK)
+        rc = conn_fill(conn, PROTO_RESP_LEN, &first);
+    if(rc == E_OK && !proto_unpack_response(conn->in + conn->start, &resp))
+        rc = E_OTHER;
+
+    if(rc != E_OK) {
+        // Session is broken, the next request starts a new one
+        close(conn->sd);
+        conn->sd = -1;
+        return rc;
+    }
+
+    conn->start += PROTO_RESP_LEN;
+    if(resp.status != 0)
+        return E_CMD;
+
+    if(size == 0 && (rc = conn_discard(conn, resp.length)) != E_OK) {
+        close(conn->sd);
+        conn->sd = -1;
+        return rc;
+    }
+
+    st->first_byte.push_back(usec(start, first));
+    st->complete.push_back(usec(start, steady_clock::now()));
+    st->bytes += (size > 0) ? size : resp.length;
+    return E_OK;
+}
+
+int conn_fill(conn_t *conn, size_t len, steady_clock::time_point *first)
+{
+    ssize_t rc;
+
+    if(first != NULL && conn->end > conn->start)
+        *first = steady_clock::now();
+
+    if(BENCH_BUFFER - conn->start < len) {
+        memmove(conn->in, conn->in + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+
+    while(conn->end - conn->start < len) {
+        rc = read(conn->sd, conn->in + conn->end, BENCH_BUFFER - conn->end);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return E_OTHER;
+
+        if(first != NULL && conn->end == conn->start)
+            *first = steady_clock::now();
+
+        conn->end += rc;
+    }
+
+    return E_OK;
+}
+
+int conn_message(conn_t *conn, string &msg, steady_clock::time_point *first)
+{
+    char *end;
+
+    conn->start = conn->end = 0;
+    while(true) {
+        end = (char *)memmem(conn->in, conn->end, "\r\n\r\n", 4);
+        if(end != NULL) {
+            msg.assign(conn->in, end - conn->in);
+            conn->start = end + 4 - conn->in;
+            return E_OK;
+        }
+
+        if(conn_fill(conn, conn->end + 1, (conn->end == 0) ? first : NULL)
+           != E_OK)
+            return E_OTHER;
+    }
+}
+
+int conn_discard(conn_t *conn, uint64_t len)
+{
+    ssize_t rc;
+    size_t n = min((uint64_t)(conn->end - conn->start), len);
+
+    // Beginning of the payload may be received with the response
+    conn->start += n;
+    len -= n;
+    if(conn->start == conn->end)
+        conn->start = conn->end = 0;
+
+    while(len > 0) {
+        rc = read(conn->sd, conn->in + conn->end,
+                  min((uint64_t)(BENCH_BUFFER - conn->end), len));
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return E_OTHER;
+
+        len -= rc;
+    }
+
+    return E_OK;
+}
+
+void bench_worker(bench_t *b, unsigned int id, stats_t *st)
+{
+    int rc;
+    unsigned int total = 0;
+    size_t largest = 0;
+    mt19937 gen(id + 1);
+    conn_t *conn = new conn_t;
+    string put_file = "bench_put_" + to_string(id);
+
+    for(const size_class_t &c : b->sizes) {
+        total += c.weight;
+        largest = max(largest, c.size);
+    }
+
+    vector<char> data(largest, 'x');
+    uniform_int_distribution<unsigned int> pick(0, total - 1);
+    uniform_int_distribution<unsigned int> pick_file(0, b->files - 1);
+    uniform_int_distribution<unsigned int> pick_cmd(0, 99);
+
+    st->bytes = 0;
+    st->errors = 0;
+    conn->sd = -1;
+
+    while(true) {
+        if(b->ops >= 0 && b->next++ >= b->ops)
+            break;
+        if(b->ops < 0 && steady_clock::now() >= b->end)
+            break;
+
+        // Choose size class by its weight
+        unsigned int w = pick(gen);
+        size_t i = 0;
+        while(w >= b->sizes[i].weight)
+            w -= b->sizes[i++].weight;
+
+        size_t size = b->sizes[i].size;
+        bool put = pick_cmd(gen) < b->put_ratio && size > 0;
+        string file = (put) ? put_file : bench_file(size, pick_file(gen));
+
+        if(b->session)
+            rc = session_request(b, conn, file, (put) ? size : 0, data.data(),
+                                 st);
+        else
+            rc = single_request(b, conn, file, (put) ? size : 0, data.data(),
+                                st);
+
+        if(rc != E_OK)
+            st->errors++;
+    }
+
+    if(conn->sd != -1)
+        close(conn->sd);
+
+    delete conn;
+}
+
+void print_latency(const string &name, vector<uint32_t> &lat)
+{
+    cout << setw(12) << left << name << right;
+    if(lat.empty()) {
+        cout << setw(10) << "-" << endl;
+        return;
+    }
+
+    sort(lat.begin(), lat.end());
+    for(double p : {0.5, 0.99, 0.999})
+        cout << setw(10) << lat[min((size_t)(p * lat.size()), lat.size() - 1)];
+    cout << setw(10) << lat.back() << endl;
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+    ssize_t rc;
+
+    while(len > 0) {
+        rc = write(fd, data, len);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+
+            perror("write() failed");
+            return E_WRITE;
+        }
+
+        data += rc;
+        len -= rc;
+    }
+
+    return E_OK;
+}
@@ -0,0 +1,99 @@
+#include <ctime>
+#include <unistd.h>
+#include <errno.h>
+
+#include "cache.hpp"
+
+using namespace std;
+
+/**
+ * @brief Memory held by an entry besides its content
+ */
+static size_t entry_size(const string &name)
+{
+    return name.size() + 64;
+}
+
+void FileCache::set_budget(size_t budget)
+{
+    lock_guard<mutex> lock(m);
+
+    this->budget = budget;
+    make_room(0);
+}
+
+bool FileCache::cacheable(const struct stat &info) const
+{
+    return budget > 0 && S_ISREG(info.st_mode) &&
+           info.st_size <= CACHE_FILE_MAX &&
+           time(NULL) - info.st_mtim.tv_sec > CACHE_SETTLE;
+}
+
+FileCache::data_t FileCache::get(const string &name, const struct stat &info)
+{
+    lock_guard<mutex> lock(m);
+    auto found = index.find(name);
+
+    if(found == index.end())
+        return NULL;
+
+    lru_t::iterator it = found->second;
+    if(it->dev != info.st_dev || it->ino != info.st_ino ||
+       (off_t)it->data->size() != info.st_size ||
+       it->mtime.tv_sec != info.st_mtim.tv_sec ||
+       it->mtime.tv_nsec != info.st_mtim.tv_nsec) {
+        remove(it);
+        return NULL;
+    }
+
+    lru.splice(lru.begin(), lru, it);
+    return it->data;
+}
+
+FileCache::data_t FileCache::load(const string &name, int fd,
+                                  const struct stat &info)
+{
+    ssize_t rc;
+    off_t off = 0;
+    string *content = new string(info.st_size, '\0');
+    data_t data(content);
+
+    while(off < info.st_size) {
+        rc = pread(fd, &(*content)[off], info.st_size - off, off);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return NULL;
+
+        off += rc;
+    }
+
+    lock_guard<mutex> lock(m);
+    auto found = index.find(name);
+
+    if(found != index.end())
+        remove(found->second);
+
+    make_room(data->size() + entry_size(name));
+    if(data->size() + entry_size(name) > budget)
+        return data;
+
+    lru.push_front({name, data, info.st_dev, info.st_ino, info.st_mtim});
+    index[name] = lru.begin();
+    used += data->size() + entry_size(name);
+
+    return data;
+}
+
+void FileCache::remove(lru_t::iterator it)
+{
+    used -= it->data->size() + entry_size(it->name);
+    index.erase(it->name);
+    lru.erase(it);
+}
+
+void FileCache::make_room(size_t len)
+{
+    while(!lru.empty() && used + len > budget)
+        remove(prev(lru.end()));
+}
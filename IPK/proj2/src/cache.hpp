@@ -0,0 +1,105 @@
+#ifndef __CACHE_H_INCLUDED
+#define __CACHE_H_INCLUDED
+
+/**
+ * @brief In-memory cache of small files served by GET
+ * @details Entries are validated by the file's inode, size and modification
+ *          time on every lookup. Files modified less than CACHE_SETTLE
+ *          seconds ago are not cached, as a change within the timestamp
+ *          granularity couldn't be told apart. Least recently used entries
+ *          are evicted when the cache exceeds its byte budget. The cache
+ *          is shared by all threads.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+// Largest cached file
+#define CACHE_FILE_MAX (64 << 10)
+// Default byte budget of the cache
+#define CACHE_BUDGET (32 << 20)
+// Minimal age of cached file [s]
+#define CACHE_SETTLE 1
+
+class FileCache {
+public:
+    /**
+     * @brief Content of a cached file, valid as long as it's referenced
+     */
+    typedef std::shared_ptr<const std::string> data_t;
+
+    /**
+     * @param budget Most bytes held by the cache, 0 disables it
+     */
+    explicit FileCache(size_t budget = CACHE_BUDGET)
+        : budget(budget), used(0) {}
+
+    /**
+     * @brief Change the byte budget, evict entries over it
+     */
+    void set_budget(size_t budget);
+
+    /**
+     * @brief Check if a file with given attributes may be cached
+     */
+    bool cacheable(const struct stat &info) const;
+
+    /**
+     * @brief Look up file content
+     *
+     * @param name File name
+     * @param info Current attributes of the file
+     *
+     * @return File content, NULL if it isn't cached or it has changed
+     */
+    data_t get(const std::string &name, const struct stat &info);
+
+    /**
+     * @brief Read file and store it into the cache
+     *
+     * @param name File name
+     * @param fd File descriptor opened for reading
+     * @param info Attributes of @p fd
+     *
+     * @return File content, NULL if it couldn't be read
+     */
+    data_t load(const std::string &name, int fd, const struct stat &info);
+
+private:
+    /**
+     * @brief Cached file
+     */
+    typedef struct {
+        std::string name;       /**< File name */
+        data_t data;            /**< File content */
+        dev_t dev;              /**< Device of the file */
+        ino_t ino;              /**< Inode of the file */
+        struct timespec mtime;  /**< Modification time */
+    } entry_t;
+
+    typedef std::list<entry_t> lru_t;
+
+    size_t budget;
+    size_t used;
+    // Most recently used entries first
+    lru_t lru;
+    std::unordered_map<std::string, lru_t::iterator> index;
+    std::mutex m;
+
+    /**
+     * @brief Remove entry, the lock has to be held
+     */
+    void remove(lru_t::iterator it);
+
+    /**
+     * @brief Evict entries until given amount fits, the lock has to be held
+     */
+    void make_room(size_t len);
+};
+
+#endif
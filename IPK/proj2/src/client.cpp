@@ -9,16 +9,57 @@
 #include <stdexcept>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <deque>
 
-#define PROTO_NAME "IPK"
-#define PROTO_VER "0.1"
+#include "proto.hpp"
+#include "compress.hpp"
+#include "crc32c.hpp"
+
+// Version 2 adds ranges, version 1 is used with servers which don't know it
+#define PROTO_VER "2.0"
+// Text sessions, more ranges are requested over one connection
+#define PROTO_VER_SESSION "2.1"
+#define PROTO_VER_OLD "0.1"
+// Persistent sessions with pipelined binary requests
+#define PROTO_VER_BINARY "3.0"
+// Sessions with compressed payloads
+#define PROTO_VER_COMPRESS "3.1"
+// Sessions with checksummed payloads
+#define PROTO_VER_CHECKSUM "3.2"
 #define BUFFER_LENGTH 512
+// Largest amount of data moved by one sendfile()/splice() call
+#define ZEROCOPY_CHUNK (1 << 20)
+// Byte range fetched by one request of a striped download
+#define STRIPE_CHUNK (8 << 20)
+// Receive buffer of one stripe
+#define STRIPE_BUFFER (64 << 10)
+// Most connections of one striped download
+#define STRIPE_MAX 16
+// Throughput measurement interval for automatic stripe count [ms]
+#define STRIPE_PROBE 250
+// Part of the per-stripe throughput which a new stripe has to add
+#define STRIPE_GAIN 0.5
+// Most requests waiting for response in one session
+#define SESSION_WINDOW 64
+// Receive buffer of a session
+#define SESSION_BUFFER (64 << 10)
+// End of a partially downloaded file which is fetched again and compared
+#define RESUME_CHECK 4096
 
 using namespace std;
 
@@ -33,15 +74,42 @@ enum ec {
     E_SOCK,     /**< Error during socket() call */
     E_ACCEPT,   /**< Error during accept() call */
     E_WRITE,    /**< Error during write() call */
-    E_CMD       /**< Error during command processing */
+    E_CMD,      /**< Error during command processing */
+    E_VERSION   /**< Server doesn't support requested protocol version */
 };
 
+/**
+ * @brief Shared state of a striped download
+ */
+typedef struct {
+    string host;                /**< Server address */
+    int port;                   /**< Server port */
+    string file;                /**< Downloaded file */
+    int fd;                     /**< Local file (preallocated) */
+    off_t size;                 /**< File size */
+    atomic<off_t> next;         /**< Offset of the next unassigned range */
+    atomic<off_t> received;     /**< Bytes received by all stripes */
+    atomic<int> active;         /**< Running stripes */
+    atomic<bool> failed;        /**< Some stripe failed */
+    atomic<bool> session;       /**< Stripes keep their connections */
+} stripe_t;
+
+/**
+ * @brief Receive buffer of a session, [start, end) wasn't processed yet
+ */
+typedef struct {
+    char data[SESSION_BUFFER];
+    size_t start;
+    size_t end;
+} session_buffer_t;
+
 /**
  * @brief Connect to remote host
  *
  * @param port Target port
  * @param host Target host
- * @param sd Valid pointer where final socket will be stored in
+ * @param sd Valid pointer where final socket will be stored in, -1 is
+ *           stored on error
  *
  * @return Error codes from ec enum
  */
@@ -51,20 +119,231 @@ int client_setup(int port, const string &host, int *sd);
  * @brief Handle communication between client and server related to
  *        given command
  *
+ * @details With protocol version 2 the transfer continues from the end
+ *          of the local (GET) or remote (PUT) file when @p resume is set
+ *
  * @param sd Valid server socket descriptor
  * @param file File name to GET/PUT
  * @param cmd PUT or GET
+ * @param version Protocol version
+ * @param resume Resume interrupted transfer
+ *
+ * @return Error codes from ec enum, E_VERSION if the server
+ *         rejected the protocol version
+ */
+int process_command(int sd, const string &file, const string &cmd,
+                    const string &version, bool resume);
+
+/**
+ * @brief Transfer one file, fall back to older protocol version if the
+ *        server doesn't support the current one
+ *
+ * @param sd Valid server socket descriptor, may be replaced by a new one
+ * @param port Server port
+ * @param host Server host
+ * @param file File name to GET/PUT
+ * @param cmd PUT or GET
+ * @param streams Number of connections for download (@see download_striped)
+ * @param resume Resume interrupted transfer
+ *
+ * @return Error codes from ec enum
+ */
+int transfer_file(int *sd, int port, const string &host, const string &file,
+                  const string &cmd, unsigned int streams, bool resume);
+
+/**
+ * @brief Transfer more files over one connection
+ * @details The connection is switched to binary headers first. Requests
+ *          are pipelined, up to SESSION_WINDOW of them wait for their
+ *          response at once. Every file is framed by its length, so the
+ *          connection stays open for the next one. Payloads are
+ *          compressed in both directions when @p level is set and
+ *          followed by their checksum when @p checksum is set.
+ *
+ * @param sd Valid server socket descriptor
+ * @param files File names to GET/PUT
+ * @param cmd PUT or GET
+ * @param level Compression level (1-9), 0 disables compression
+ * @param checksum Verify payloads by CRC32C
+ *
+ * @return Error codes from ec enum, E_VERSION if the server
+ *         doesn't support sessions
+ */
+int process_session(int sd, const vector<string> &files, const string &cmd,
+                    int level, bool checksum);
+
+/**
+ * @brief Read one binary response of a session
+ *
+ * @param sd Valid server socket descriptor
+ * @param in Data received from the server
+ * @param resp Destination for the response
+ *
+ * @return E_OK on success, E_OTHER if the server closed the connection
+ *         or sent invalid response
+ */
+int read_response(int sd, session_buffer_t *in, proto_response_t *resp);
+
+/**
+ * @brief Receive data of a session until given amount is buffered
+ *
+ * @param sd Valid server socket descriptor
+ * @param in Data received from the server
+ * @param len Required length of unprocessed data
+ *
+ * @return E_OK on success, E_OTHER if the server closed the connection
+ */
+int session_fill(int sd, session_buffer_t *in, size_t len);
+
+/**
+ * @brief Mark given number of buffered bytes of a session as processed
+ */
+void session_consume(session_buffer_t *in, size_t len);
+
+/**
+ * @brief Receive file of given length in a session
+ * @details The file is discarded when it can't be stored
+ *
+ * @param sd Valid server socket descriptor
+ * @param in Data received from the server, but not processed yet
+ * @param file File name
+ * @param len File length
+ * @param compressed File is sent in compressed chunks
+ * @param checksum File is followed by its checksum
+ *
+ * @return E_OK on success, E_CMD if the file couldn't be stored or its
+ *         checksum doesn't match, other codes from ec enum on connection
+ *         errors
+ */
+int recv_session_file(int sd, session_buffer_t *in, const string &file,
+                      off_t len, bool compressed, bool checksum);
+
+/**
+ * @brief Send GET request for a byte range (protocol version 2) and
+ *        confirm the response with READY
+ * @details Requests of a session (version 2.1) are not confirmed, the
+ *          data follow the response and the connection stays open for
+ *          the next request
+ *
+ * @param sd Valid server socket descriptor
+ * @param file File name
+ * @param offset First requested byte
+ * @param length Requested length (0 means up to the end of file), set to
+ *               the length which the server will send
+ * @param size Set to the file size
+ * @param session Request is a part of a session
+ *
+ * @return Error codes from ec enum, E_VERSION if the server
+ *         doesn't support ranges (or sessions)
+ */
+int request_range(int sd, const string &file, off_t offset, off_t *length,
+                  off_t *size, bool session = false);
+
+/**
+ * @brief Download file over more connections at once
+ * @details The file is split into ranges of STRIPE_CHUNK bytes, which are
+ *          fetched by parallel connections (stripes) into the preallocated
+ *          local file. Each stripe requests its ranges over one session.
+ *          With @p streams 0 a new stripe is added while the previous one
+ *          added at least STRIPE_GAIN of the throughput of one stripe, i.e.
+ *          the stripes don't just share a saturated link.
+ *
+ * @param sd Valid server socket descriptor (used for the first range)
+ * @param port Server port
+ * @param file File name
+ * @param streams Number of connections, 0 means automatic
+ *
+ * @return Error codes from ec enum, E_VERSION if the server
+ *         doesn't support ranges
+ */
+int download_striped(int sd, int port, const string &file,
+                     unsigned int streams);
+
+/**
+ * @brief Fetch ranges of a striped download until all are assigned
+ *
+ * @param s Shared download state
+ * @param sd Server socket with already requested range or -1
+ * @param offset Offset of the requested range
+ * @param length Length of the requested range
+ */
+void stripe_worker(stripe_t *s, int sd, off_t offset, off_t length);
+
+/**
+ * @brief Receive a byte range into given offset of the local file
+ *
+ * @param sd Valid socket descriptor
+ * @param s Shared download state
+ * @param offset Offset in the local file
+ * @param len Number of bytes to receive
+ *
+ * @return E_OK on success, E_WRITE or E_OTHER otherwise
  */
-int process_command(int sd, const string &file, const string &cmd);
+int recv_range(int sd, stripe_t *s, off_t offset, off_t len);
+
+/**
+ * @brief Send file from its current position to the socket
+ * @details Uses sendfile(), falls back to read()/write() if the file
+ *          doesn't support it
+ *
+ * @param sd Valid socket descriptor
+ * @param fd Valid file descriptor
+ * @param len Number of bytes to send, -1 means until EOF
+ * @param crc Checksum updated with the sent data (if not NULL)
+ *
+ * @return E_OK on success, E_WRITE otherwise
+ */
+int send_file(int sd, int fd, off_t len, uint32_t *crc);
+
+/**
+ * @brief Receive file from the socket
+ * @details Data are spliced from the socket through a pipe into the file,
+ *          read()/write() is used if splice() is not supported
+ *
+ * @param sd Valid socket descriptor
+ * @param fd Valid file descriptor
+ * @param len Number of bytes to receive, -1 means until the server
+ *            closes the connection
+ * @param crc Checksum updated with the received data (if not NULL),
+ *            @p fd has to be readable then
+ *
+ * @return E_OK on success, E_WRITE otherwise
+ */
+int recv_file(int sd, int fd, off_t len, uint32_t *crc);
+
+/**
+ * @brief Compare received data with the local file
+ *
+ * @param sd Valid socket descriptor
+ * @param fd Valid readable file descriptor
+ * @param offset Offset of the received data in the file
+ * @param len Number of bytes to receive and compare
+ *
+ * @return E_OK if the data match, E_CMD if they don't, E_OTHER if
+ *         the data couldn't be received or read
+ */
+int verify_file(int sd, int fd, off_t offset, off_t len);
+
+/**
+ * @brief Write whole buffer into given descriptor
+ *
+ * @return E_OK on success, E_WRITE otherwise
+ */
+int write_all(int fd, const char *data, size_t len);
 
 int main(int argc, char *argv[])
 {
     int opt, sd;
     int ec = E_OK;
     int port = -1;
+    int level = 0;
+    bool resume = false;
+    bool checksum = false;
+    unsigned int streams = 1;
     string hostname, filename, command;
+    vector<string> files;
 
-    while((opt = getopt(argc, argv, "h:p:d:u:")) != -1) {
+    while((opt = getopt(argc, argv, "h:p:d:u:rj:z:c")) != -1) {
         switch(opt) {
         case 'h':
             hostname = optarg;
@@ -106,10 +385,28 @@ int main(int argc, char *argv[])
 
             filename = optarg;
             command = "PUT";
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 'j':
+            streams = min(strtoul(optarg, NULL, 10), (unsigned long)STRIPE_MAX);
+            break;
+        case 'c':
+            checksum = true;
+            break;
+        case 'z':
+            level = strtol(optarg, NULL, 10);
+            if(level < 1 || level > 9) {
+                cerr << "Invalid compression level (1-9)" << endl;
+                exit(E_PARAM);
+            }
+
             break;
         case '?':
-            cout << "Usage: " << argv[0] << " -h hostname -p port [-d|u] "
-                    "filename" << endl;
+            cout << "Usage: " << argv[0] << " -h hostname -p port [-r] "
+                    "[-j streams] [-z level] [-c] [-d|u] filename "
+                "[filename...]" << endl;
             exit(1);
         default:
             cerr << "Unexpected error during getopt() call" << endl;
@@ -117,20 +414,63 @@ int main(int argc, char *argv[])
         }
     }
 
-    if(optind < argc || hostname.empty() || filename.empty() || port == -1) {
-        cout << "test" << endl;
-        cout << "Usage: " << argv[0] << " -h hostname -p port [-d|u] "
-                "filename" << endl;
+    // Uploads go over one connection
+    if(command == "PUT" && streams != 1) {
+        cerr << "Option -j can be used only with -d" << endl;
+        exit(E_PARAM);
+    }
+
+    if(hostname.empty() || filename.empty() || port == -1) {
+        cout << "Usage: " << argv[0] << " -h hostname -p port [-r] "
+                "[-j streams] [-z level] [-c] [-d|u] filename "
+                "[filename...]" << endl;
         exit(E_PARAM);
     }
 
+    // Other files are transferred by the same command
+    files.push_back(filename);
+    files.insert(files.end(), argv + optind, argv + argc);
+
+    // Session closed by the server must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
     ec = client_setup(port, hostname, &sd);
     if(ec != E_OK) {
         cerr << "Client setup failed" << endl;
         exit(ec);
     }
 
-    ec = process_command(sd, filename, command);
+    // Compression and checksums are available in sessions only
+    if((files.size() > 1 || level > 0 || checksum) && streams == 1 &&
+       !resume) {
+        ec = process_session(sd, files, command, level, checksum);
+        if(ec == E_VERSION) {
+            // Older server, transfer files one by one
+            close(sd);
+            sd = -1;
+            ec = E_OK;
+        } else {
+            files.clear();
+        }
+    }
+
+    for(size_t i = 0; i < files.size(); i++) {
+        int rc = E_OK;
+
+        if(sd == -1 && (rc = client_setup(port, hostname, &sd)) != E_OK) {
+            ec = rc;
+            break;
+        }
+
+        rc = transfer_file(&sd, port, hostname, files[i], command, streams,
+                           resume);
+        if(rc != E_OK)
+            ec = rc;
+
+        close(sd);
+        sd = -1;
+    }
+
     if(ec != E_OK) {
         cerr << "An error has occured during command processing" << endl;
     }
@@ -147,10 +487,11 @@ int client_setup(int port, const string &host, int *sd)
     struct sockaddr_in server_addr;
     struct hostent *hostp;
 
+    // Stripes connect from their threads, errors are only returned
     *sd = socket(AF_INET, SOCK_STREAM, 0);
     if(*sd < 0) {
         perror("socket() failed");
-        exit(E_SOCK);
+        return E_SOCK;
     }
 
     memset(&server_addr, 0, sizeof(server_addr));
@@ -163,6 +504,8 @@ int client_setup(int port, const string &host, int *sd)
         hostp = gethostbyname(host.c_str());
         if(hostp == NULL) {
             cerr << "Unknown host: " << host << endl;
+            close(*sd);
+            *sd = -1;
             return E_SETUP;
         }
 
@@ -173,111 +516,867 @@ int client_setup(int port, const string &host, int *sd)
     rc = connect(*sd, (struct sockaddr *)&server_addr, sizeof(server_addr));
     if(rc < 0) {
         perror("connect() failed");
+        close(*sd);
+        *sd = -1;
         return E_SETUP;
     }
 
     return E_OK;
 }
 
-int process_command(int sd, const string &file, const string &cmd)
+int process_command(int sd, const string &file, const string &cmd,
+                    const string &version, bool resume)
 {
-    int rc, status = -1;
+    int rc, fd, status = -1;
+    bool v2 = (version == PROTO_VER);
+    off_t offset = 0, length = -1, size = 0, check = 0;
     char buffer[BUFFER_LENGTH] = { 0, };
     string::size_type idx;
     string request, response, message;
     string confirm = "READY\r\n\r\n";
+    struct stat info;
     stringstream ss;
 
-    ss << PROTO_NAME << " " << PROTO_VER << " " << cmd << " " << file
-       << "\r\n\r\n";
+    if(cmd == "PUT") {
+        fd = open(file.c_str(), O_RDONLY);
+    } else {
+        // Partial file is read back when resuming
+        fd = open(file.c_str(), (resume) ? O_RDWR|O_CREAT
+                                         : O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    }
+
+    if(fd < 0 || fstat(fd, &info) < 0) {
+        perror("open() failed");
+        cerr << "Error: unable to open file '" << file << "'" << endl;
+        return E_CMD;
+    }
+
+    ss << PROTO_NAME << " " << version << " " << cmd << " ";
+    if(v2 && cmd == "PUT") {
+        // Server tells us where to continue when appending
+        ss << ((resume) ? "APPEND" : "0") << " " << info.st_size << " ";
+    } else if(v2) {
+        // Partially downloaded file is the offset, 0 length means whole file.
+        // Its end is downloaded again to check it's a part of the remote
+        // file, not of another version of it.
+        if(resume)
+            check = min(info.st_size, (off_t)RESUME_CHECK);
+        ss << info.st_size - check << " 0 ";
+    }
 
+    ss << file << "\r\n\r\n";
     request = ss.str();
 
     rc = write(sd, request.c_str(), request.size());
     if(rc < 0) {
         perror("send() failed");
+        close(fd);
         return E_WRITE;
     }
 
     while((rc = read(sd, buffer, BUFFER_LENGTH)) > 0) {
         response.append(buffer, rc);
-        if((idx = response.find("\r\n\r\n")) != string::npos) {
+        // Terminator may start in the previously received data
+        idx = response.find("\r\n\r\n", (response.size() > (size_t)rc + 3)
+                                          ? response.size() - rc - 3 : 0);
+        if(idx != string::npos) {
             response.erase(idx);
             break;
         }
     }
 
+    ss.clear();
     ss.str(response);
     ss >> status >> message;
 
     if(status != 0) {
+        close(fd);
+        if(message == "INVALID_VERSION")
+            return E_VERSION;
+
         cerr << "Can't " << cmd << " file " << file << endl
              << "Error: " << status << ": " << message << endl;
         return E_CMD;
     }
 
+    if(v2) {
+        if(!(ss >> offset >> length >> size)) {
+            cerr << "Error: invalid response '" << response << "'" << endl;
+            close(fd);
+            return E_CMD;
+        }
+
+        if(offset + check > 0)
+            cout << "Resuming from byte " << offset + check << endl;
+
+        if(lseek(fd, offset, SEEK_SET) < 0) {
+            perror("lseek() failed");
+            close(fd);
+            return E_CMD;
+        }
+    }
+
+    cout << ((cmd == "PUT") ? "Uploading" : "Downloading") << " file '"
+         << file << "'" << endl;
+
+    // Synchronize client and server
+    rc = write(sd, confirm.c_str(), confirm.size());
+    if(rc < 0) {
+        perror("write() failed");
+        close(fd);
+        return E_WRITE;
+    }
+
+    cout << "Waiting for server" << endl;
     if(cmd == "PUT") {
-        cout << "Uploading file '" << file << "'" << endl;
-        ifstream in;
-        string sync;
-        try {
-            in.open(file, ios::in|ios::binary);
-            if(!in.is_open()) {
-                perror("open() failed");
-                throw runtime_error("unable to open file '" + file + "'");
+        rc = send_file(sd, fd, length, NULL);
+    } else {
+        check = min(check, length);
+        rc = verify_file(sd, fd, offset, check);
+        if(rc == E_CMD)
+            cerr << "Error: local file '" << file << "' doesn't match the "
+                    "remote one, download it again without -r" << endl;
+        if(rc == E_OK && lseek(fd, offset + check, SEEK_SET) < 0) {
+            perror("lseek() failed");
+            rc = E_CMD;
+        }
+        if(rc == E_OK)
+            rc = recv_file(sd, fd, length - check, NULL);
+        // Local file may have been longer than the remote one
+        if(rc == E_OK && v2 && ftruncate(fd, size) < 0) {
+            perror("ftruncate() failed");
+            rc = E_WRITE;
+        }
+    }
+
+    close(fd);
+    if(rc != E_OK)
+        return rc;
+
+    cout << ((cmd == "PUT") ? "File uploaded" : "File downloaded") << endl;
+
+    return E_OK;
+}
+
+int transfer_file(int *sd, int port, const string &host, const string &file,
+                  const string &cmd, unsigned int streams, bool resume)
+{
+    int ec;
+
+    if(cmd == "GET" && streams != 1 && !resume)
+        ec = download_striped(*sd, port, file, streams);
+    else
+        ec = process_command(*sd, file, cmd, PROTO_VER, resume);
+
+    if(ec == E_VERSION && !resume) {
+        // Older server, try again without ranges
+        close(*sd);
+        ec = client_setup(port, host, sd);
+        if(ec == E_OK)
+            ec = process_command(*sd, file, cmd, PROTO_VER_OLD, false);
+    } else if(ec == E_VERSION) {
+        cerr << "Server doesn't support resuming of transfers" << endl;
+    }
+
+    return ec;
+}
+
+int process_session(int sd, const vector<string> &files, const string &cmd,
+                    int level, bool checksum)
+{
+    int rc, ec = E_OK, status = -1;
+    size_t next = 0, out_len = 0;
+    uint32_t crc;
+    char buffer[BUFFER_LENGTH];
+    char out[PROTO_TRAILER_LEN +
+             SESSION_WINDOW * (PROTO_REQ_LEN + PROTO_NAME_MAX)];
+    struct stat info;
+    proto_request_t req;
+    proto_response_t resp;
+    session_buffer_t in;
+    deque<string> pending;
+    string response;
+    stringstream ss;
+
+    // Switch the connection to binary headers, older servers refuse it
+    ss << PROTO_NAME << " "
+       << ((checksum) ? PROTO_VER_CHECKSUM
+           : (level > 0) ? PROTO_VER_COMPRESS : PROTO_VER_BINARY)
+       << " SESSION\r\n\r\n";
+    if(write_all(sd, ss.str().c_str(), ss.str().size()) != E_OK)
+        return E_WRITE;
+
+    // Server doesn't send anything else before our next request
+    while(response.find("\r\n\r\n") == string::npos &&
+          (rc = read(sd, buffer, BUFFER_LENGTH)) > 0)
+        response.append(buffer, rc);
+
+    ss.clear();
+    ss.str(response);
+    if(!(ss >> status) || status != 0)
+        return E_VERSION;
+
+    in.start = in.end = 0;
+    memset(&req, 0, sizeof(req));
+    req.command = (cmd == "PUT") ? PROTO_PUT : PROTO_GET;
+    if(level > 0)
+        req.flags = PROTO_FLAG_DEFLATE | (level << PROTO_LEVEL_SHIFT);
+    if(checksum)
+        req.flags |= PROTO_FLAG_CHECKSUM;
+
+    while(next < files.size() || !pending.empty()) {
+        while(next < files.size() && pending.size() < SESSION_WINDOW) {
+            const string &file = files[next++];
+            int fd = -1;
+
+            if(file.size() > PROTO_NAME_MAX) {
+                cerr << "Error: file name '" << file << "' is too long" << endl;
+                ec = E_CMD;
+                continue;
             }
-        } catch(const exception &e) {
-            cerr << "Error: " << e.what() << endl;
-            return E_CMD;
+
+            if(req.command == PROTO_PUT) {
+                fd = open(file.c_str(), O_RDONLY);
+                if(fd < 0 || fstat(fd, &info) < 0) {
+                    perror("open() failed");
+                    cerr << "Error: unable to open file '" << file << "'"
+                         << endl;
+                    if(fd >= 0)
+                        close(fd);
+                    ec = E_CMD;
+                    continue;
+                }
+            }
+
+            req.name_len = file.size();
+            req.length = (fd != -1) ? info.st_size : 0;
+            proto_pack_request(out + out_len, &req);
+            memcpy(out + out_len + PROTO_REQ_LEN, file.c_str(), file.size());
+            out_len += PROTO_REQ_LEN + file.size();
+            pending.push_back(file);
+
+            if(fd == -1)
+                continue;
+
+            // Payload of PUT follows its request
+            crc = 0;
+            rc = write_all(sd, out, out_len);
+            if(rc == E_OK && level > 0)
+                rc = (send_compressed(fd, sd, info.st_size, level, NULL,
+                                      (checksum) ? &crc : NULL) < 0)
+                     ? E_WRITE : E_OK;
+            else if(rc == E_OK)
+                rc = send_file(sd, fd, info.st_size,
+                               (checksum) ? &crc : NULL);
+            close(fd);
+            out_len = 0;
+            if(rc != E_OK)
+                return rc;
+
+            // Trailer goes out along with the next request
+            if(checksum) {
+                proto_pack_trailer(out, crc);
+                out_len = PROTO_TRAILER_LEN;
+            }
+        }
+
+        if(out_len > 0) {
+            if(write_all(sd, out, out_len) != E_OK)
+                return E_WRITE;
+            out_len = 0;
+        }
+
+        if(pending.empty())
+            break;
+
+        if(read_response(sd, &in, &resp) != E_OK) {
+            cerr << "Server closed the session" << endl;
+            return E_OTHER;
+        }
+
+        if(resp.status != 0) {
+            cerr << "Can't " << cmd << " file " << pending.front() << endl
+                 << "Error: " << (int)resp.status << ": "
+                 << proto_status(resp.status) << endl;
+            ec = E_CMD;
+        } else if(req.command == PROTO_GET) {
+            rc = recv_session_file(sd, &in, pending.front(), resp.length,
+                                   resp.flags & PROTO_FLAG_DEFLATE,
+                                   resp.flags & PROTO_FLAG_CHECKSUM);
+            if(rc == E_CMD)
+                ec = rc;
+            else if(rc != E_OK)
+                return rc;
         }
 
-        // Synchronize client and server
-        rc = write(sd, confirm.c_str(), confirm.size());
+        pending.pop_front();
+    }
+
+    cout << "Transferred " << files.size() << " file(s)" << endl;
+
+    return ec;
+}
+
+int read_response(int sd, session_buffer_t *in, proto_response_t *resp)
+{
+    if(session_fill(sd, in, PROTO_RESP_LEN) != E_OK)
+        return E_OTHER;
+
+    if(!proto_unpack_response(in->data + in->start, resp))
+        return E_OTHER;
+
+    session_consume(in, PROTO_RESP_LEN);
+
+    return E_OK;
+}
+
+int session_fill(int sd, session_buffer_t *in, size_t len)
+{
+    ssize_t rc;
+
+    // Make room for the whole header
+    if(in->end - in->start < len && SESSION_BUFFER - in->start < len) {
+        memmove(in->data, in->data + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+
+    while(in->end - in->start < len) {
+        rc = read(sd, in->data + in->end, SESSION_BUFFER - in->end);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return E_OTHER;
+
+        in->end += rc;
+    }
+
+    return E_OK;
+}
+
+void session_consume(session_buffer_t *in, size_t len)
+{
+    in->start += len;
+    if(in->start == in->end)
+        in->start = in->end = 0;
+}
+
+int recv_session_file(int sd, session_buffer_t *in, const string &file,
+                      off_t len, bool compressed, bool checksum)
+{
+    ssize_t rc;
+    size_t n;
+    int fd, ec = E_OK;
+    uint32_t crc = 0, sum;
+    char buffer[BUFFER_LENGTH];
+
+    // Checksum reads the stored data back
+    fd = open(file.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if(fd < 0) {
+        perror("open() failed");
+        cerr << "Error: unable to open file '" << file << "'" << endl;
+        ec = E_CMD;
+    }
+
+    if(compressed) {
+        size_t used;
+
+        // Undecodable stream can't be skipped, the session is lost
+        rc = recv_compressed(sd, fd, len, in->data + in->start,
+                             in->end - in->start, &used, &crc);
+        session_consume(in, used);
         if(rc < 0) {
-            perror("write() failed");
-            return E_WRITE;
+            if(fd >= 0)
+                close(fd);
+            return E_OTHER;
+        }
+
+        len = 0;
+    }
+
+    // Beginning of the file may be received with the response
+    n = min((off_t)(in->end - in->start), len);
+    if(fd >= 0 && write_all(fd, in->data + in->start, n) != E_OK)
+        ec = E_CMD;
+    if(checksum)
+        crc = crc32c(crc, in->data + in->start, n);
+    session_consume(in, n);
+    len -= n;
+
+    if(fd >= 0 && ec == E_OK && len > 0) {
+        rc = recv_file(sd, fd, len, (checksum) ? &crc : NULL);
+        if(rc != E_OK) {
+            close(fd);
+            return rc;
+        }
+
+        len = 0;
+    }
+
+    if(fd >= 0)
+        close(fd);
+
+    // Skip the rest of the file which can't be stored
+    while(len > 0) {
+        rc = read(sd, buffer, min(len, (off_t)BUFFER_LENGTH));
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return E_OTHER;
+
+        len -= rc;
+    }
+
+    if(!checksum)
+        return ec;
+
+    if(session_fill(sd, in, PROTO_TRAILER_LEN) != E_OK)
+        return E_OTHER;
+
+    sum = proto_unpack_trailer(in->data + in->start);
+    session_consume(in, PROTO_TRAILER_LEN);
+    if(ec == E_OK && sum != crc) {
+        cerr << "Error: checksum of file '" << file << "' doesn't match"
+             << endl;
+        ec = E_CMD;
+    }
+
+    return ec;
+}
+
+int request_range(int sd, const string &file, off_t offset, off_t *length,
+                  off_t *size, bool session)
+{
+    int rc, status = -1;
+    size_t seen;
+    off_t resp_offset = -1;
+    char buffer[BUFFER_LENGTH];
+    string::size_type idx;
+    string response, message;
+    string confirm = "READY\r\n\r\n";
+    stringstream ss;
+
+    ss << PROTO_NAME << " " << ((session) ? PROTO_VER_SESSION : PROTO_VER)
+       << " GET " << offset << " " << *length << " " << file << "\r\n\r\n";
+
+    if(write_all(sd, ss.str().c_str(), ss.str().size()) != E_OK)
+        return E_WRITE;
+
+    // Data of a session follow the response, only the response is taken
+    // off the socket
+    while((rc = recv(sd, buffer, BUFFER_LENGTH, MSG_PEEK)) > 0) {
+        seen = response.size();
+        response.append(buffer, rc);
+        // Terminator may start in the previously received data
+        idx = response.find("\r\n\r\n", (seen > 3) ? seen - 3 : 0);
+        if(idx != string::npos)
+            rc = idx + 4 - seen;
+
+        if(read(sd, buffer, rc) != rc) {
+            perror("read() failed");
+            return E_OTHER;
+        }
+
+        if(idx != string::npos) {
+            response.erase(idx);
+            break;
         }
+    }
+
+    ss.clear();
+    ss.str(response);
+    ss >> status >> message;
+
+    if(status != 0) {
+        if(message == "INVALID_VERSION")
+            return E_VERSION;
+
+        cerr << "Can't GET file " << file << endl
+             << "Error: " << status << ": " << message << endl;
+        return E_CMD;
+    }
+
+    if(!(ss >> resp_offset >> *length >> *size) || resp_offset != offset) {
+        cerr << "Error: invalid response '" << response << "'" << endl;
+        return E_CMD;
+    }
+
+    if(session)
+        return E_OK;
+
+    return write_all(sd, confirm.c_str(), confirm.size());
+}
 
-        cout << "Waiting for server" << endl;
-        while(in.good()) {
-            in.read(buffer, BUFFER_LENGTH);
-            rc = write(sd, buffer, in.gcount());
-            if(rc < 0) {
-                perror("write() failed");
+int download_striped(int sd, int port, const string &file,
+                     unsigned int streams)
+{
+    int rc;
+    off_t length = STRIPE_CHUNK, size = 0;
+    char addr[INET_ADDRSTRLEN];
+    struct sockaddr_in peer;
+    socklen_t plen = sizeof(peer);
+    stripe_t s;
+    vector<thread> stripes;
+
+    // The first range tells us the file size
+    rc = request_range(sd, file, 0, &length, &size);
+    if(rc != E_OK)
+        return rc;
+
+    // Other stripes connect to the same address, without name resolution
+    if(getpeername(sd, (struct sockaddr *)&peer, &plen) < 0 ||
+       inet_ntop(AF_INET, &peer.sin_addr, addr, sizeof(addr)) == NULL) {
+        perror("getpeername() failed");
+        return E_SETUP;
+    }
+
+    s.host = addr;
+    s.port = port;
+    s.file = file;
+    s.size = size;
+    s.next = length;
+    s.received = 0;
+    s.active = 0;
+    s.failed = false;
+    s.session = true;
+
+    s.fd = open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(s.fd < 0) {
+        perror("open() failed");
+        cerr << "Error: unable to open file '" << file << "'" << endl;
+        return E_CMD;
+    }
+
+    // Stripes write with pwrite(), reserve the whole file first
+    if(size > 0 && posix_fallocate(s.fd, 0, size) != 0 &&
+       ftruncate(s.fd, size) < 0) {
+        perror("ftruncate() failed");
+        close(s.fd);
+        return E_WRITE;
+    }
+
+    cout << "Downloading file '" << file << "' (" << size << " bytes)" << endl;
+
+    // Main socket is owned by the first stripe now
+    s.active++;
+    stripes.push_back(thread(stripe_worker, &s, dup(sd), 0, length));
+
+    if(streams != 0) {
+        while(stripes.size() < streams && s.next < s.size) {
+            s.active++;
+            stripes.push_back(thread(stripe_worker, &s, -1, 0, 0));
+        }
+    } else {
+        // Add stripes while the last one adds enough to the throughput of
+        // the others, they share a saturated link otherwise
+        double prev = 0, rate;
+        off_t last = 0;
+        auto start = chrono::steady_clock::now();
+
+        while(s.active > 0 && stripes.size() < STRIPE_MAX) {
+            // Don't oversleep the end of small downloads
+            for(int t = 0; t < STRIPE_PROBE && s.active > 0; t += 10)
+                this_thread::sleep_for(chrono::milliseconds(10));
+
+            auto now = chrono::steady_clock::now();
+            rate = (s.received - last) /
+                   chrono::duration<double>(now - start).count();
+            last = s.received;
+            start = now;
+
+            if(stripes.size() > 1 &&
+               rate - prev < prev / (stripes.size() - 1) * STRIPE_GAIN)
+                break;
+            if(s.next >= s.size)
+                break;
+
+            prev = rate;
+            s.active++;
+            stripes.push_back(thread(stripe_worker, &s, -1, 0, 0));
+        }
+    }
+
+    for(thread &t : stripes)
+        t.join();
+
+    cout << "Used " << stripes.size() << " connection(s)" << endl;
+    close(s.fd);
+    if(s.failed)
+        return E_OTHER;
+
+    cout << "File downloaded" << endl;
+    return E_OK;
+}
+
+void stripe_worker(stripe_t *s, int sd, off_t offset, off_t length)
+{
+    int rc = E_OK;
+    off_t size;
+    // Given socket has its range requested already, the server closes it
+    // after the range
+    bool session = false;
+    bool requested = (sd != -1);
+
+    while(!s->failed) {
+        if(!requested) {
+            offset = s->next.fetch_add(STRIPE_CHUNK);
+            if(offset >= s->size)
+                break;
+
+            length = min((off_t)STRIPE_CHUNK, s->size - offset);
+            if(sd == -1) {
+                rc = client_setup(s->port, s->host, &sd);
+                session = s->session;
+            }
+            if(rc == E_OK)
+                rc = request_range(sd, s->file, offset, &length, &size,
+                                   session);
+            if(rc == E_VERSION && session) {
+                // Server without sessions, every range takes a connection
+                s->session = session = false;
+                close(sd);
+                rc = client_setup(s->port, s->host, &sd);
+                if(rc == E_OK)
+                    rc = request_range(sd, s->file, offset, &length, &size);
+            }
+            if(rc == E_OK && size != s->size) {
+                cerr << "File has changed during download" << endl;
+                rc = E_OTHER;
+            }
+        }
+
+        if(rc == E_OK)
+            rc = recv_range(sd, s, offset, length);
+        requested = false;
+
+        // Session continues with the next range
+        if((rc != E_OK || !session) && sd != -1) {
+            close(sd);
+            sd = -1;
+        }
+
+        if(rc != E_OK)
+            s->failed = true;
+    }
+
+    if(sd != -1)
+        close(sd);
+
+    s->active--;
+}
+
+int recv_range(int sd, stripe_t *s, off_t offset, off_t len)
+{
+    ssize_t rc, wc;
+    char buffer[STRIPE_BUFFER];
+
+    while(len > 0) {
+        rc = read(sd, buffer, min(len, (off_t)STRIPE_BUFFER));
+        if(rc < 0 && errno == EINTR)
+            continue;
+
+        if(rc <= 0) {
+            if(rc < 0)
+                perror("read() failed");
+            else
+                cerr << "Server closed connection " << len << " bytes before "
+                        "the end of range" << endl;
+            return E_OTHER;
+        }
+
+        for(ssize_t off = 0; off < rc; off += wc) {
+            wc = pwrite(s->fd, buffer + off, rc - off, offset + off);
+            if(wc < 0) {
+                if(errno == EINTR) {
+                    wc = 0;
+                    continue;
+                }
+
+                perror("pwrite() failed");
                 return E_WRITE;
             }
         }
 
-        cout << "File uploaded" << endl;
-        in.close();
-    } else if(cmd == "GET") {
-        cout << "Downloading file '" << file << "'" << endl;
-        ofstream out;
-        try {
-            out.open(file, ios::out|ios::binary);
-            if(!out.is_open()) {
-                perror("open() failed");
-                throw runtime_error("unable to open file '" + file + "'");
+        offset += rc;
+        len -= rc;
+        s->received += rc;
+    }
+
+    return E_OK;
+}
+
+int send_file(int sd, int fd, off_t len, uint32_t *crc)
+{
+    ssize_t rc;
+    off_t pos = (crc != NULL) ? lseek(fd, 0, SEEK_CUR) : 0;
+    char buffer[BUFFER_LENGTH];
+
+    while(len != 0 && (rc = sendfile(sd, fd, NULL, (len > 0 && len <
+                       ZEROCOPY_CHUNK) ? len : ZEROCOPY_CHUNK)) != 0) {
+        if(rc > 0) {
+            // Sent data are read back from the page cache
+            if(crc != NULL && crc32c_fd(fd, pos, rc, crc) < 0) {
+                perror("pread() failed");
+                return E_WRITE;
             }
-        } catch(const exception &e) {
-            cerr << "Error: " << e.what() << endl;
-            return E_CMD;
+
+            pos += rc;
+            if(len > 0)
+                len -= rc;
+            continue;
         }
+        if(errno == EINTR)
+            continue;
+        if(errno == EINVAL || errno == ENOSYS)
+            break;
 
-        // Synchronize client and server
-        rc = write(sd, confirm.c_str(), confirm.size());
-        if(rc < 0) {
-            perror("write() failed");
+        perror("sendfile() failed");
+        return E_WRITE;
+    }
+
+    // Fallback for files without sendfile() support
+    while(len != 0 && (rc = read(fd, buffer, (len > 0 && len <
+                       BUFFER_LENGTH) ? len : BUFFER_LENGTH)) > 0) {
+        if(crc != NULL)
+            *crc = crc32c(*crc, buffer, rc);
+        if(write_all(sd, buffer, rc) != E_OK)
             return E_WRITE;
+        if(len > 0)
+            len -= rc;
+    }
+
+    if(len > 0) {
+        cerr << "File shrank during upload" << endl;
+        return E_WRITE;
+    }
+
+    if(rc < 0) {
+        perror("read() failed");
+        return E_WRITE;
+    }
+
+    return E_OK;
+}
+
+int recv_file(int sd, int fd, off_t len, uint32_t *crc)
+{
+    ssize_t rc = 0, n = -1;
+    off_t pos = (crc != NULL) ? lseek(fd, 0, SEEK_CUR) : 0;
+    int pipe_fd[2];
+    char buffer[BUFFER_LENGTH];
+
+    if(pipe(pipe_fd) == 0) {
+        fcntl(pipe_fd[1], F_SETPIPE_SZ, ZEROCOPY_CHUNK);
+        while(len != 0 && (n = splice(sd, NULL, pipe_fd[1], NULL,
+                           (len > 0 && len < ZEROCOPY_CHUNK) ? len
+                           : ZEROCOPY_CHUNK, SPLICE_F_MOVE)) > 0) {
+            if(len > 0)
+                len -= n;
+
+            while(n > 0) {
+                rc = splice(pipe_fd[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+                if(rc < 0 && errno == EINVAL) {
+                    // File doesn't support splice(), copy the pipe content
+                    rc = read(pipe_fd[0], buffer,
+                              min(n, (ssize_t)BUFFER_LENGTH));
+                    if(rc > 0 && crc != NULL)
+                        *crc = crc32c(*crc, buffer, rc);
+                    if(rc > 0 && write_all(fd, buffer, rc) != E_OK)
+                        rc = -1;
+                } else if(rc > 0 && crc != NULL &&
+                          crc32c_fd(fd, pos, rc, crc) < 0) {
+                    // Stored data are read back from the page cache
+                    rc = -1;
+                }
+
+                if(rc > 0 && crc != NULL)
+                    pos += rc;
+
+                if(rc < 0 && errno != EINTR) {
+                    perror("splice() failed");
+                    close(pipe_fd[0]);
+                    close(pipe_fd[1]);
+                    return E_WRITE;
+                }
+
+                n -= max(rc, (ssize_t)0);
+            }
+        }
+
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        rc = 0;
+    }
+
+    // Fallback without splice()
+    while(n < 0 && len != 0 && (rc = read(sd, buffer, (len > 0 && len <
+                                BUFFER_LENGTH) ? len : BUFFER_LENGTH)) > 0) {
+        if(crc != NULL)
+            *crc = crc32c(*crc, buffer, rc);
+        if(write_all(fd, buffer, rc) != E_OK)
+            return E_WRITE;
+        if(len > 0)
+            len -= rc;
+    }
+
+    if(len > 0) {
+        cerr << "Server closed connection " << len << " bytes before the end "
+                "of file" << endl;
+        return E_OTHER;
+    }
+
+    return (rc < 0) ? E_WRITE : E_OK;
+}
+
+int verify_file(int sd, int fd, off_t offset, off_t len)
+{
+    ssize_t rc;
+    char remote[BUFFER_LENGTH];
+    char local[BUFFER_LENGTH];
+
+    while(len > 0) {
+        rc = read(sd, remote, min(len, (off_t)BUFFER_LENGTH));
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0) {
+            if(rc < 0)
+                perror("read() failed");
+            else
+                cerr << "Server closed connection" << endl;
+            return E_OTHER;
+        }
+
+        if(pread(fd, local, rc, offset) != rc) {
+            perror("pread() failed");
+            return E_OTHER;
         }
 
-        cout << "Waiting for server" << endl;
-        while((rc = read(sd, buffer, BUFFER_LENGTH)) > 0) {
-            out.write(buffer, rc);
+        if(memcmp(local, remote, rc) != 0)
+            return E_CMD;
+
+        offset += rc;
+        len -= rc;
+    }
+
+    return E_OK;
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+    ssize_t rc;
+
+    while(len > 0) {
+        rc = write(fd, data, len);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+
+            perror("write() failed");
+            return E_WRITE;
         }
 
-        cout << "File downloaded" << endl;
-        out.close();
+        data += rc;
+        len -= rc;
     }
 
     return E_OK;
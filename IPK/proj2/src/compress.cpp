@@ -0,0 +1,380 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "compress.hpp"
+#include "crc32c.hpp"
+
+// Chunks waiting between the compression thread and the socket
+#define CHUNK_QUEUE 4
+// Compressed chunk has to save at least 1/CHUNK_GAIN of its size
+#define CHUNK_GAIN 10
+// Chunks sent raw without trying after an incompressible one
+#define CHUNK_BACKOFF 16
+
+using namespace std;
+
+/**
+ * @brief One chunk of the payload
+ */
+typedef struct {
+    vector<char> data;  /**< Chunk data as sent */
+    uint32_t raw_len;   /**< Length of raw data */
+    bool raw;           /**< Data are not compressed */
+} chunk_t;
+
+/**
+ * @brief Bounded queue of chunks between two threads
+ */
+class ChunkQueue {
+public:
+    ChunkQueue() : closed(false), aborted(false) {}
+
+    /**
+     * @brief Add chunk, wait while the queue is full
+     *
+     * @return false if the other side aborted the transfer
+     */
+    bool push(chunk_t &chunk) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] { return q.size() < CHUNK_QUEUE || aborted; });
+        if(aborted)
+            return false;
+
+        q.push_back(move(chunk));
+        cv.notify_all();
+        return true;
+    }
+
+    /**
+     * @brief Take chunk, wait while the queue is empty
+     *
+     * @return false if there are no more chunks
+     */
+    bool pop(chunk_t &chunk) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] { return !q.empty() || closed || aborted; });
+        if(q.empty() || aborted)
+            return false;
+
+        chunk = move(q.front());
+        q.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    /**
+     * @brief No more chunks will be added
+     */
+    void close() {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+    /**
+     * @brief Stop the transfer on both sides
+     */
+    void abort() {
+        lock_guard<mutex> lock(m);
+        aborted = true;
+        cv.notify_all();
+    }
+
+    bool failed() {
+        lock_guard<mutex> lock(m);
+        return aborted;
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+    deque<chunk_t> q;
+    bool closed;
+    bool aborted;
+};
+
+/**
+ * @brief Read exactly given number of bytes
+ *
+ * @return 0 on success, -1 on error or premature EOF
+ */
+static int read_exact(int fd, char *data, size_t len)
+{
+    ssize_t rc;
+
+    while(len > 0) {
+        rc = read(fd, data, len);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+
+        data += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write whole buffer
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int write_exact(int fd, const char *data, size_t len)
+{
+    ssize_t rc;
+
+    while(len > 0) {
+        rc = write(fd, data, len);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0)
+            return -1;
+
+        data += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write all given buffers
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int writev_exact(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t rc;
+
+    while(cnt > 0) {
+        rc = writev(fd, iov, cnt);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0)
+            return -1;
+
+        // Skip what was written
+        while(cnt > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+
+        if(cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read and compress chunks of the input file
+ */
+static void compress_chunks(ChunkQueue *q, int fd, off_t len, int level,
+                            uint32_t *crc)
+{
+    int backoff = 0;
+    vector<char> raw(CHUNK_SIZE);
+
+    while(len > 0) {
+        chunk_t chunk;
+        size_t n = (len < CHUNK_SIZE) ? len : CHUNK_SIZE;
+
+        if(read_exact(fd, raw.data(), n) < 0) {
+            perror("read() failed");
+            q->abort();
+            return;
+        }
+
+        if(crc != NULL)
+            *crc = crc32c(*crc, raw.data(), n);
+
+        chunk.raw_len = n;
+        chunk.raw = true;
+
+        if(backoff > 0) {
+            backoff--;
+        } else {
+            uLongf clen = compressBound(n);
+            chunk.data.resize(clen);
+            if(compress2((Bytef *)chunk.data.data(), &clen,
+                         (const Bytef *)raw.data(), n, level) == Z_OK &&
+               clen < n - n / CHUNK_GAIN) {
+                chunk.data.resize(clen);
+                chunk.raw = false;
+            } else {
+                // Data don't compress, don't waste time on next chunks
+                backoff = CHUNK_BACKOFF;
+            }
+        }
+
+        if(chunk.raw)
+            chunk.data.assign(raw.begin(), raw.begin() + n);
+
+        if(!q->push(chunk))
+            return;
+
+        len -= n;
+    }
+
+    q->close();
+}
+
+int send_compressed(int in_fd, int out_fd, off_t len, int level, off_t *wire,
+                    uint32_t *crc)
+{
+    int rc = 0;
+    off_t sent = 0;
+    chunk_t chunk;
+    ChunkQueue q;
+    thread compressor(compress_chunks, &q, in_fd, len, level, crc);
+
+    while(q.pop(chunk)) {
+        uint32_t header[2];
+        struct iovec iov[2];
+        size_t total;
+
+        header[0] = htobe32(chunk.data.size() | (chunk.raw ? CHUNK_RAW : 0));
+        header[1] = htobe32(chunk.raw_len);
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = chunk.data.data();
+        iov[1].iov_len = chunk.data.size();
+        total = iov[0].iov_len + iov[1].iov_len;
+
+        if(writev_exact(out_fd, iov, 2) < 0) {
+            perror("writev() failed");
+            rc = -1;
+            break;
+        }
+
+        sent += total;
+    }
+
+    if(rc < 0 || q.failed()) {
+        rc = -1;
+        q.abort();
+    }
+
+    compressor.join();
+    if(wire != NULL)
+        *wire = sent;
+
+    return rc;
+}
+
+/**
+ * @brief Decompress chunks and write them to the output file
+ */
+static void decompress_chunks(ChunkQueue *q, int fd, uint32_t *crc)
+{
+    chunk_t chunk;
+    vector<char> raw(CHUNK_SIZE);
+
+    while(q->pop(chunk)) {
+        const char *data = chunk.data.data();
+
+        if(!chunk.raw) {
+            uLongf rlen = chunk.raw_len;
+            if(uncompress((Bytef *)raw.data(), &rlen,
+                          (const Bytef *)chunk.data.data(),
+                          chunk.data.size()) != Z_OK ||
+               rlen != chunk.raw_len) {
+                cerr << "Invalid compressed chunk" << endl;
+                q->abort();
+                return;
+            }
+
+            data = raw.data();
+        }
+
+        if(crc != NULL)
+            *crc = crc32c(*crc, data, chunk.raw_len);
+
+        if(fd != -1 && write_exact(fd, data, chunk.raw_len) < 0) {
+            perror("write() failed");
+            q->abort();
+            return;
+        }
+    }
+}
+
+int recv_compressed(int in_fd, int out_fd, off_t len, const char *pre,
+                    size_t pre_len, size_t *used, uint32_t *crc)
+{
+    int rc = 0;
+    ChunkQueue q;
+    thread decompressor(decompress_chunks, &q, out_fd, crc);
+
+    *used = 0;
+
+    // Take data from the buffer first, then from the socket
+    auto take = [&](char *dst, size_t n) {
+        size_t k = (pre_len - *used < n) ? pre_len - *used : n;
+        memcpy(dst, pre + *used, k);
+        *used += k;
+        return read_exact(in_fd, dst + k, n - k);
+    };
+
+    while(len > 0 && rc == 0) {
+        uint32_t header[2];
+        size_t stored, raw_len;
+        chunk_t chunk;
+
+        if(take((char *)header, sizeof(header)) < 0) {
+            cerr << "Connection closed inside compressed data" << endl;
+            rc = -1;
+            break;
+        }
+
+        chunk.raw = (be32toh(header[0]) & CHUNK_RAW) != 0;
+        stored = be32toh(header[0]) & ~CHUNK_RAW;
+        raw_len = be32toh(header[1]);
+
+        if(raw_len > CHUNK_SIZE || (off_t)raw_len > len ||
+           stored > compressBound(CHUNK_SIZE) ||
+           (chunk.raw && stored != raw_len)) {
+            cerr << "Invalid chunk header" << endl;
+            rc = -1;
+            break;
+        }
+
+        chunk.raw_len = raw_len;
+        chunk.data.resize(stored);
+        if(take(chunk.data.data(), stored) < 0) {
+            cerr << "Connection closed inside compressed data" << endl;
+            rc = -1;
+            break;
+        }
+
+        if(!q.push(chunk))
+            rc = -1;
+
+        len -= raw_len;
+    }
+
+    if(rc < 0)
+        q.abort();
+    else
+        q.close();
+
+    decompressor.join();
+
+    return (rc < 0 || q.failed()) ? -1 : 0;
+}
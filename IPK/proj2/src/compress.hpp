@@ -0,0 +1,64 @@
+#ifndef __COMPRESS_H_INCLUDED
+#define __COMPRESS_H_INCLUDED
+
+/**
+ * @brief Compressed payloads of the IPK protocol
+ * @details Compressed payload is a sequence of chunks, each of them
+ *          with 8 B header followed by chunk data:
+ *          | stored_len:32 | raw_len:32 |
+ *          Chunks are deflated (zlib format) independently, chunk which
+ *          doesn't shrink enough is stored raw, which is marked by
+ *          CHUNK_RAW bit in stored_len. All numbers are sent in network
+ *          byte order.
+ */
+
+#include <sys/types.h>
+#include <cstddef>
+#include <stdint.h>
+
+// Largest amount of raw data in one chunk
+#define CHUNK_SIZE (256 << 10)
+// Flag of chunks stored without compression
+#define CHUNK_RAW 0x80000000u
+// Compression level used when none is requested
+#define COMPRESS_LEVEL 6
+// Highest zlib compression level (Z_BEST_COMPRESSION)
+#define COMPRESS_LEVEL_MAX 9
+
+/**
+ * @brief Send compressed data
+ * @details Data are read and compressed by a separate thread, so the
+ *          compression runs along with the socket writes
+ *
+ * @param in_fd File descriptor to read the data from
+ * @param out_fd Socket descriptor to send the chunks to
+ * @param len Number of raw bytes to send
+ * @param level zlib compression level
+ * @param wire Set to the number of bytes sent (if not NULL)
+ * @param crc Checksum updated with the raw data (if not NULL)
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int send_compressed(int in_fd, int out_fd, off_t len, int level, off_t *wire,
+                    uint32_t *crc);
+
+/**
+ * @brief Receive compressed data
+ * @details Chunks are decompressed and written by a separate thread.
+ *          Data which were already received may be passed in @p pre, only
+ *          the data of given payload are read from the socket.
+ *
+ * @param in_fd Socket descriptor to read the chunks from
+ * @param out_fd File descriptor to write the data to, -1 to discard them
+ * @param len Number of raw bytes to receive
+ * @param pre Already received data
+ * @param pre_len Length of already received data
+ * @param used Set to the number of bytes used from @p pre
+ * @param crc Checksum updated with the raw data (if not NULL)
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int recv_compressed(int in_fd, int out_fd, off_t len, const char *pre,
+                    size_t pre_len, size_t *used, uint32_t *crc);
+
+#endif
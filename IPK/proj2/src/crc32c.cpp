@@ -0,0 +1,136 @@
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.hpp"
+
+// Reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78u
+// Buffer for data read back from a file
+#define CRC_BUFFER (64 << 10)
+
+using namespace std;
+
+/**
+ * @brief Lookup tables for slicing-by-8
+ */
+typedef struct {
+    uint32_t t[8][256];
+} crc_tables_t;
+
+static crc_tables_t make_tables()
+{
+    crc_tables_t tables;
+
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        tables.t[0][i] = crc;
+    }
+
+    for(uint32_t i = 0; i < 256; i++)
+        for(int k = 1; k < 8; k++)
+            tables.t[k][i] = (tables.t[k - 1][i] >> 8) ^
+                             tables.t[0][tables.t[k - 1][i] & 0xff];
+
+    return tables;
+}
+
+/**
+ * @brief Software implementation, processes 8 bytes per step
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    static const crc_tables_t tables = make_tables();
+    const uint32_t (*t)[256] = tables.t;
+
+    while(len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        // Tables expect little endian words
+        lo = le32toh(lo) ^ crc;
+        hi = le32toh(hi);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while(len-- > 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Hardware implementation using the SSE 4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while(len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+    while(len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+static bool has_sse42()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hw = has_sse42();
+    if(hw)
+        return ~crc32c_hw(crc, p, len);
+#endif
+
+    return ~crc32c_sw(crc, p, len);
+}
+
+int crc32c_fd(int fd, off_t offset, size_t len, uint32_t *crc)
+{
+    ssize_t rc;
+    char buffer[CRC_BUFFER];
+
+    while(len > 0) {
+        rc = pread(fd, buffer, (len < CRC_BUFFER) ? len : CRC_BUFFER, offset);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+
+        *crc = crc32c(*crc, buffer, rc);
+        offset += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
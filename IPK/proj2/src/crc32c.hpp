@@ -0,0 +1,41 @@
+#ifndef __CRC32C_H_INCLUDED
+#define __CRC32C_H_INCLUDED
+
+/**
+ * @brief CRC32C (Castagnoli) checksums of transferred data
+ * @details SSE 4.2 instruction is used when the CPU supports it, table
+ *          driven implementation otherwise. Checksum of more buffers is
+ *          computed by passing the previous result as @p crc, the initial
+ *          value is 0.
+ */
+
+#include <sys/types.h>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+ * @brief Update checksum with given data
+ *
+ * @param crc Checksum of the preceding data
+ * @param data Data
+ * @param len Length of data
+ *
+ * @return Checksum including the data
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @brief Update checksum with a range of file
+ * @details Used along with sendfile()/splice(), the data are read back
+ *          from the page cache
+ *
+ * @param fd File descriptor opened for reading
+ * @param offset First byte of the range
+ * @param len Length of the range
+ * @param crc Checksum to update
+ *
+ * @return 0 on success, -1 on error or premature end of file
+ */
+int crc32c_fd(int fd, off_t offset, size_t len, uint32_t *crc);
+
+#endif
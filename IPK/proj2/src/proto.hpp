@@ -0,0 +1,224 @@
+#ifndef __PROTO_H_INCLUDED
+#define __PROTO_H_INCLUDED
+
+/**
+ * @brief Binary headers of the IPK protocol (version 3)
+ * @details Connection switches to binary headers after the text request
+ *          "IPK 3.0 SESSION" was answered with OK. Every binary header
+ *          starts with the protocol name and the version byte 3, which is
+ *          never a space as in text requests. All numbers are sent in
+ *          network byte order.
+ *
+ *          Request (PROTO_REQ_LEN bytes followed by the file name):
+ *          | "IPK" | version | command | flags | name_len:16 |
+ *          | offset:64 | length:64 |
+ *
+ *          Response (PROTO_RESP_LEN bytes):
+ *          | "IPK" | version | status | flags | reserved:16 |
+ *          | offset:64 | length:64 | size:64 |
+ *
+ *          Offset and length have the same meaning as in text version 2,
+ *          requests are pipelined as in text version 2.1.
+ *
+ *          Sessions started by "IPK 3.1 SESSION" may set PROTO_FLAG_DEFLATE
+ *          with compression level in the upper bits of request flags, PUT
+ *          payload is compressed then (@see compress.hpp). Response with
+ *          PROTO_FLAG_DEFLATE carries compressed GET payload.
+ *
+ *          Sessions started by "IPK 3.2 SESSION" may set PROTO_FLAG_CHECKSUM,
+ *          payload in both directions is followed by PROTO_TRAILER_LEN
+ *          bytes with CRC32C of the raw data then (@see crc32c.hpp). Server
+ *          marks GET responses with the trailer by the same flag, PUT with
+ *          wrong checksum is answered by CHECKSUM_ERROR.
+ */
+
+#include <cstring>
+#include <stdint.h>
+#include <endian.h>
+
+#define PROTO_NAME "IPK"
+#define PROTO_BIN_VERSION 3
+#define PROTO_REQ_LEN 24
+#define PROTO_RESP_LEN 32
+// Longest file name in a binary request
+#define PROTO_NAME_MAX 255
+// Payload is compressed, compression level is in the upper 4 bits
+#define PROTO_FLAG_DEFLATE 0x01
+#define PROTO_LEVEL_SHIFT 4
+// Payload is followed by a checksum trailer
+#define PROTO_FLAG_CHECKSUM 0x02
+#define PROTO_TRAILER_LEN 4
+
+/**
+ * @brief Commands of binary requests
+ */
+enum proto_cmd {
+    PROTO_GET = 1,  /**< Download file */
+    PROTO_PUT = 2   /**< Upload file */
+};
+
+/**
+ * @brief Binary request header
+ */
+typedef struct {
+    uint8_t command;    /**< Command from proto_cmd enum */
+    uint8_t flags;      /**< Request flags */
+    uint16_t name_len;  /**< Length of the file name behind the header */
+    uint64_t offset;    /**< First transferred byte */
+    uint64_t length;    /**< GET: range length, PUT: final file size */
+} proto_request_t;
+
+/**
+ * @brief Binary response header
+ */
+typedef struct {
+    uint8_t status;     /**< Status code, 0 means OK */
+    uint8_t flags;      /**< Response flags */
+    uint64_t offset;    /**< First transferred byte */
+    uint64_t length;    /**< Length of the transferred range */
+    uint64_t size;      /**< File size */
+} proto_response_t;
+
+/**
+ * @brief Status messages, indexed by status code
+ */
+static const char *const proto_status_msg[] = {
+    "OK",
+    "INVALID_PROTOCOL",
+    "INVALID_VERSION",
+    "INVALID_COMMAND",
+    "INVALID_FILE",
+    "GET_ERROR",
+    "PUT_ERROR",
+    "INVALID_RANGE",
+    "CHECKSUM_ERROR"
+};
+
+#define PROTO_STATUS_COUNT \
+    (sizeof(proto_status_msg) / sizeof(proto_status_msg[0]))
+
+/**
+ * @brief Return message of given status code
+ */
+inline const char *proto_status(unsigned int status)
+{
+    return (status < PROTO_STATUS_COUNT) ? proto_status_msg[status]
+                                         : "UNKNOWN_ERROR";
+}
+
+/**
+ * @brief Check if given data start with a binary header
+ *
+ * @param buf Received data
+ * @param len Length of received data, at least 4 bytes are needed
+ */
+inline bool proto_is_binary(const char *buf, size_t len)
+{
+    return len >= 4 && memcmp(buf, PROTO_NAME, 3) == 0 &&
+           buf[3] == PROTO_BIN_VERSION;
+}
+
+/**
+ * @brief Fill in magic and version of a binary header
+ */
+inline void proto_pack_magic(char *buf)
+{
+    memcpy(buf, PROTO_NAME, 3);
+    buf[3] = PROTO_BIN_VERSION;
+}
+
+/**
+ * @brief Store request header into PROTO_REQ_LEN bytes of given buffer
+ */
+inline void proto_pack_request(char *buf, const proto_request_t *req)
+{
+    uint16_t name_len = htobe16(req->name_len);
+    uint64_t offset = htobe64(req->offset);
+    uint64_t length = htobe64(req->length);
+
+    proto_pack_magic(buf);
+    buf[4] = req->command;
+    buf[5] = req->flags;
+    memcpy(buf + 6, &name_len, 2);
+    memcpy(buf + 8, &offset, 8);
+    memcpy(buf + 16, &length, 8);
+}
+
+/**
+ * @brief Load request header from PROTO_REQ_LEN bytes of given buffer
+ * @details Magic and version are expected to be checked by
+ *          proto_is_binary() already
+ */
+inline void proto_unpack_request(const char *buf, proto_request_t *req)
+{
+    req->command = buf[4];
+    req->flags = buf[5];
+    memcpy(&req->name_len, buf + 6, 2);
+    memcpy(&req->offset, buf + 8, 8);
+    memcpy(&req->length, buf + 16, 8);
+    req->name_len = be16toh(req->name_len);
+    req->offset = be64toh(req->offset);
+    req->length = be64toh(req->length);
+}
+
+/**
+ * @brief Store response header into PROTO_RESP_LEN bytes of given buffer
+ */
+inline void proto_pack_response(char *buf, const proto_response_t *resp)
+{
+    uint64_t offset = htobe64(resp->offset);
+    uint64_t length = htobe64(resp->length);
+    uint64_t size = htobe64(resp->size);
+
+    proto_pack_magic(buf);
+    buf[4] = resp->status;
+    buf[5] = resp->flags;
+    buf[6] = buf[7] = 0;
+    memcpy(buf + 8, &offset, 8);
+    memcpy(buf + 16, &length, 8);
+    memcpy(buf + 24, &size, 8);
+}
+
+/**
+ * @brief Load response header from PROTO_RESP_LEN bytes of given buffer
+ *
+ * @return false if the data don't start with a binary header
+ */
+inline bool proto_unpack_response(const char *buf, proto_response_t *resp)
+{
+    if(!proto_is_binary(buf, PROTO_RESP_LEN))
+        return false;
+
+    resp->status = buf[4];
+    resp->flags = buf[5];
+    memcpy(&resp->offset, buf + 8, 8);
+    memcpy(&resp->length, buf + 16, 8);
+    memcpy(&resp->size, buf + 24, 8);
+    resp->offset = be64toh(resp->offset);
+    resp->length = be64toh(resp->length);
+    resp->size = be64toh(resp->size);
+
+    return true;
+}
+
+/**
+ * @brief Store checksum into PROTO_TRAILER_LEN bytes of given buffer
+ */
+inline void proto_pack_trailer(char *buf, uint32_t crc)
+{
+    crc = htobe32(crc);
+    memcpy(buf, &crc, PROTO_TRAILER_LEN);
+}
+
+/**
+ * @brief Load checksum from PROTO_TRAILER_LEN bytes of given buffer
+ */
+inline uint32_t proto_unpack_trailer(const char *buf)
+{
+    uint32_t crc;
+
+    memcpy(&crc, buf, PROTO_TRAILER_LEN);
+    return be32toh(crc);
+}
+
+#endif
@@ -10,16 +10,47 @@
 #include <stdexcept>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <signal.h>
-
-#define PROTO_NAME "IPK"
+#include <fcntl.h>
+#include <errno.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "proto.hpp"
+#include "compress.hpp"
+#include "crc32c.hpp"
+#include "cache.hpp"
+
+// Highest supported protocol version
+#define PROTO_VER_MAX 3.2f
+// First version with persistent sessions
+#define PROTO_VER_SESSION 2.1f
+// First session version with compressed payloads
+#define PROTO_VER_COMPRESS 3.1f
+// First session version with checksummed payloads
+#define PROTO_VER_CHECKSUM 3.2f
 #define CLIENT_QUEUE 10
 #define BUFFER_LENGTH 512
+// Receive buffer of a connection, holds the longest request header
+#define IN_BUFFER 8192
+// Send buffer of a connection, holds the longest status message
+#define OUT_BUFFER 128
+#define WORKER_EVENTS 64
+// Pause of an event loop out of descriptors (us)
+#define WORKER_BACKOFF 100000
+// Largest amount of data moved by one sendfile()/splice() call
+#define ZEROCOPY_CHUNK (1 << 20)
 
 using namespace std;
 
@@ -34,6 +65,7 @@ enum ec {
     E_SOCK,     /**< Error during socket() call */
     E_ACCEPT,   /**< Error during accept() call */
     E_WRITE,    /**< Error during write() call */
+    E_AGAIN,    /**< Operation would block */
 };
 
 /**
@@ -48,15 +80,26 @@ public:
      */
     ProtoErr(int ec) : error_code(ec) {
         ostringstream os;
-        if(ec < 0 || (size_t)ec >= p_emsg.size())
-            os << ec << " UNKNOWN_ERROR";
-        else
-            os << ec << " " << p_emsg[ec];
+        os << ec << " " << proto_status(ec);
 
         os << "\r\n\r\n";
         message = os.str();
     }
 
+    /**
+     * @brief Construct successful status message of protocol version 2
+     *
+     * @param offset First byte of the file which is transferred
+     * @param length Number of bytes which follow after READY
+     * @param size Size of the whole file
+     */
+    ProtoErr(off_t offset, off_t length, off_t size) : error_code(PE_OK) {
+        ostringstream os;
+        os << PE_OK << " " << proto_status(PE_OK) << " " << offset << " "
+           << length << " " << size << "\r\n\r\n";
+        message = os.str();
+    }
+
     /**
      * @brief Return final messsage which consist of error code
      *        and error message
@@ -98,24 +141,388 @@ public:
         PE_INVALID_FILE,    /**< Invalid filename */
         PE_GET_ERROR,       /**< Error during GET */
         PE_PUT_ERROR,       /**< Error during PUT */
+        PE_INVALID_RANGE,   /**< Offset or length out of file bounds */
+        PE_CHECKSUM,        /**< Checksum of received data doesn't match */
         PE_ENUM_SIZE        /**< Placeholder for enum size */
     };
 
+private:
+    int error_code;
+    string message;
+};
+
+/**
+ * @brief State machine of one client connection
+ * @details Walks the client through the protocol phases (header, status,
+ *          READY, payload). All socket operations are written for
+ *          non-blocking sockets, so the same code serves both the event
+ *          loop and the forked workers, where every step simply blocks
+ *          until it's done.
+ */
+class Connection {
+public:
+    /**
+     * @brief Create state machine for given client socket
+     *
+     * @param sd Valid client socket descriptor (not owned by the object)
+     */
+    Connection(int sd) : sd(sd), file(-1), st(ST_HEADER),
+                         after_status(ST_DONE), after_ready(ST_DONE),
+                         in_start(0), in_end(0), in_scan(0), out_len(0),
+                         out_off(0), buf_len(0), buf_off(0),
+                         zero_copy(true), pipe_len(0), remaining(-1),
+                         offset(0), size(0), session(false), binary(false),
+                         version(0),
+                         deflate(false), level(COMPRESS_LEVEL),
+                         checksum(false), trailer(false), crc(0), crc_pos(0),
+                         cache_off(0) {
+        pipe_fd[0] = pipe_fd[1] = -1;
+        blocking = !(fcntl(sd, F_GETFL, 0) & O_NONBLOCK);
+    }
+
+    ~Connection() {
+        if(file != -1)
+            close(file);
+        if(pipe_fd[0] != -1) {
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+        }
+    }
+
+    /**
+     * @brief Process as much I/O as possible without blocking
+     *
+     * @return E_OK if the connection should continue (or has finished
+     *         successfully), error code from ec enum otherwise
+     */
+    int handle_io();
+
+    /**
+     * @brief Check if the request is finished and the socket can be closed
+     */
+    bool done() const { return st == ST_DONE; }
+
+    /**
+     * @brief Check if the connection waits for the socket to be writable
+     */
+    bool wants_write() const {
+        return st == ST_STATUS || st == ST_SEND || st == ST_CACHED;
+    }
+
+    /**
+     * @brief Check if the connection has to continue in blocking mode
+     * @details Compressed transfers don't fit into the event loop, the
+     *          compression would stall other connections
+     */
+    bool offload() const {
+        return !blocking && (st == ST_ZSEND || st == ST_ZRECV || st == ST_ZSKIP);
+    }
+
+    /**
+     * @brief Switch the client socket to blocking mode
+     */
+    void set_blocking() {
+        fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) & ~O_NONBLOCK);
+        blocking = true;
+    }
+
+    /**
+     * @brief Return client socket descriptor
+     */
+    int socket() const { return sd; }
+
+private:
     /**
-     * @brief Error messages for error codes in enum p_ec
+     * @brief Connection states
      */
-    vector<string> p_emsg = {
-        "OK",
-        "INVALID_PROTOCOL",
-        "INVALID_VERSION",
-        "INVALID_COMMAND",
-        "INVALID_FILE",
-        "GET_ERROR"
+    enum state {
+        ST_HEADER,  /**< Reading request header */
+        ST_STATUS,  /**< Sending status message */
+        ST_READY,   /**< Waiting for READY from client */
+        ST_RECV,    /**< Receiving file from client (PUT) */
+        ST_SEND,    /**< Sending file to client (GET) */
+        ST_CACHED,  /**< Sending status and file from the cache (GET) */
+        ST_SKIP,    /**< Discarding payload of rejected PUT (session) */
+        ST_ZSEND,   /**< Sending compressed file (blocking) */
+        ST_ZRECV,   /**< Receiving compressed file (blocking) */
+        ST_ZSKIP,   /**< Discarding compressed payload (blocking) */
+        ST_TRAILER, /**< Reading checksum behind PUT payload */
+        ST_DONE     /**< Request finished */
     };
 
+    int sd;
+    int file;
+    state st;
+    state after_status;
+    state after_ready;
+    // Received data are parsed in place, [in_start, in_end) is unprocessed
+    char in[IN_BUFFER];
+    size_t in_start;
+    size_t in_end;
+    // Where to continue searching for the end of text message
+    size_t in_scan;
+    char out[OUT_BUFFER];
+    size_t out_len;
+    size_t out_off;
+    char buffer[BUFFER_LENGTH];
+    size_t buf_len;
+    size_t buf_off;
+    bool zero_copy;
+    int pipe_fd[2];
+    size_t pipe_len;
+    // Payload bytes left to transfer, -1 means until EOF (version 1)
+    off_t remaining;
+    // Transferred range and file size (version 2)
+    off_t offset;
+    off_t size;
+    // Connection serves more requests, without READY (version 2.1)
+    bool session;
+    // Session uses binary headers (version 3), version of the session
+    bool binary;
+    float version;
+    // Payload of current request is compressed with given level
+    bool deflate;
+    int level;
+    // Client socket is in blocking mode
+    bool blocking;
+    // Payload of current request is checksummed, PUT payload is followed
+    // by the client's checksum
+    bool checksum;
+    bool trailer;
+    // Checksum of the transferred data, file offset of the next byte
+    // which isn't included yet (zero-copy transfers)
+    uint32_t crc;
+    off_t crc_pos;
+    // Content of a small file served from memory, offset of the next byte
+    FileCache::data_t cached;
+    off_t cache_off;
+
+    /**
+     * @brief Do one step of the state machine
+     *
+     * @return E_OK on progress, E_AGAIN if the socket would block,
+     *         other codes from ec enum on error
+     */
+    int step();
+
+    /**
+     * @brief Return number of received bytes which weren't processed yet
+     */
+    size_t buffered() const { return in_end - in_start; }
+
+    /**
+     * @brief Mark given number of received bytes as processed
+     */
+    void consume(size_t len);
+
+    /**
+     * @brief Receive more data into the input buffer
+     *
+     * @param eof Set to true when the peer closed the connection
+     *
+     * @return E_OK, E_AGAIN or E_OTHER (also when the buffer is full)
+     */
+    int fill(bool *eof);
+
+    /**
+     * @brief Read and process binary request header
+     *
+     * @return E_OK, E_AGAIN or E_OTHER
+     */
+    int read_binary();
+
+    /**
+     * @brief Read one CRLFCRLF terminated message
+     *
+     * @param msg Destination for the message (without terminator)
+     * @param eof Set to true when the peer closed the connection, msg
+     *            contains the unterminated rest in that case
+     *
+     * @return E_OK, E_AGAIN or E_OTHER
+     */
+    int read_message(string &msg, bool *eof);
+
+    /**
+     * @brief Parse request header and prepare the response
+     *
+     * @param message Request header
+     */
+    void process_request(const string &message);
+
+    /**
+     * @brief Open requested file and prepare the transferred range
+     * @details Version 1 transfers the whole file until EOF, version 2
+     *          GET sends @p length bytes from @p offset (0 means up to
+     *          the end of file) and PUT writes the file from @p offset
+     *          (-1 means the current end of file) so it's @p length
+     *          bytes long afterwards
+     *
+     * @param command Command from proto_cmd enum
+     * @param file File name
+     * @param version Protocol version of the request
+     * @param offset Requested offset
+     * @param length Requested length or final size
+     */
+    void open_file(int command, const char *file, float version,
+                   off_t offset, off_t length);
+
+    /**
+     * @brief Limit the size of the next transfer by the remaining payload
+     *
+     * @param len Maximal transfer size
+     *
+     * @return Number of bytes to transfer
+     */
+    size_t limit(size_t len) const {
+        return (remaining >= 0 && (off_t)len > remaining) ? remaining : len;
+    }
+
+    /**
+     * @brief Finish the PUT request
+     *
+     * @return E_OK on success, E_WRITE otherwise
+     */
+    int finish_put();
+
+    /**
+     * @brief Finish current request
+     * @details Sessions continue with the next request, other connections
+     *          are done
+     */
+    void finish_request();
+
+    /**
+     * @brief Reject request with given status
+     * @details Payload of a pipelined PUT is skipped in sessions first,
+     *          so the next request can be read
+     *
+     * @param code Error code from ProtoErr::p_ec enum
+     * @param payload Length of the payload which follows the request
+     */
+    void reject(int code, off_t payload);
+
+    /**
+     * @brief Transfer compressed payload in blocking mode
+     *
+     * @return E_OK on success, other codes from ec enum on error
+     */
+    int transfer_compressed();
+
+    /**
+     * @brief Look up small file in the cache, load it on miss
+     * @details Compressed transfers and version 1 read the file itself
+     *
+     * @param name File name
+     * @param version Protocol version of the request
+     * @param info Set to the file attributes (when found)
+     *
+     * @return true if the file is served from memory
+     */
+    bool open_cached(const char *name, float version, struct stat *info);
+
+    /**
+     * @brief Send prepared status along with the cached file
+     *
+     * @return E_OK, E_AGAIN or E_WRITE
+     */
+    int send_cached();
+
+    /**
+     * @brief Read checksum trailer of PUT and compare it with the data
+     *
+     * @return E_OK, E_AGAIN or E_OTHER
+     */
+    int check_trailer();
+
+    /**
+     * @brief Send checksum trailer behind GET payload
+     */
+    void send_trailer();
+
+    /**
+     * @brief Discard payload of a rejected request
+     *
+     * @return E_OK on progress, E_AGAIN if the socket would block,
+     *         other codes from ec enum on error
+     */
+    int skip();
+
+    /**
+     * @brief Queue status message and set state which follows it
+     *
+     * @param code Error code from ProtoErr::p_ec enum
+     * @param next State after the message is sent
+     */
+    void set_status(int code, state next);
+
+    /**
+     * @brief Queue successful status of a range transfer (version 2)
+     *
+     * @param length Length of the transferred range
+     * @param next State after the message is sent
+     */
+    void set_range_status(off_t length, state next);
+
+    /**
+     * @brief Write file data received from the client
+     *
+     * @return E_OK on success, E_WRITE otherwise
+     */
+    int store(const char *data, size_t len);
+
+    /**
+     * @brief Receive file data from the client (PUT)
+     * @details Data are spliced from the socket through a pipe into the file
+     *          without copying them into user space, read()/write() is used
+     *          only if splice() is not supported for the file
+     *
+     * @return E_OK on progress, E_AGAIN if the socket would block,
+     *         other codes from ec enum on error
+     */
+    int receive();
+
+    /**
+     * @brief Send file data to the client (GET)
+     * @details Uses sendfile(), read()/write() is used only if sendfile()
+     *          is not supported for the file
+     *
+     * @return E_OK on progress, E_AGAIN if the socket would block,
+     *         other codes from ec enum on error
+     */
+    int send();
+};
+
+/**
+ * @brief Fixed set of threads finishing connections in blocking mode
+ * @details Event loops hand compressed transfers over to the pool
+ *          (@see Connection::offload()). Only as many of them as there are
+ *          threads run at once, the others wait in the queue.
+ */
+class OffloadPool {
+public:
+    /**
+     * @brief Start given number of threads
+     */
+    void start(unsigned int threads);
+
+    /**
+     * @brief Queue connection taken over from an event loop
+     */
+    void push(Connection *conn);
+
+    /**
+     * @brief Finish queued connections and join the threads
+     */
+    void stop();
+
 private:
-    int error_code;
-    string message;
+    void run();
+
+    vector<thread> threads;
+    mutex m;
+    condition_variable cv;
+    deque<Connection *> queue;
+    bool closed = false;
 };
 
 /**
@@ -139,10 +546,13 @@ string ltrim(const string &str);
  * 
  * @param port Port which server will listen on
  * @param sd Valid pointer where final socket will be stored in
+ * @param reuse_port Allow more sockets to listen on the same port
+ *                   (SO_REUSEPORT), the kernel balances connections
+ *                   between them
  *
  * @return Error codes from ec enum
  */
-int server_setup(int port, int *sd);
+int server_setup(int port, int *sd, bool reuse_port = false);
 
 /**
  * @brief Listen for and handle clients
@@ -154,6 +564,28 @@ int server_setup(int port, int *sd);
  */
 int handle_clients(int sd);
 
+/**
+ * @brief Listen for and handle clients in event loops
+ * @details Start given number of worker threads, each of them with its own
+ *          listening socket (SO_REUSEPORT) and epoll event loop driving
+ *          non-blocking client connections
+ *
+ * @param port Port which server will listen on
+ * @param workers Number of worker threads
+ *
+ * @return Error codes from ec enum
+ */
+int handle_clients_epoll(int port, unsigned int workers);
+
+/**
+ * @brief Event loop of one worker thread
+ *
+ * @param sd Valid listening socket descriptor
+ *
+ * @return Error codes from ec enum
+ */
+int worker_loop(int sd);
+
 /**
  * @brief Handle client request
  *
@@ -163,52 +595,111 @@ int handle_clients(int sd);
  */
 int handle_request(int sd);
 
+/**
+ * @brief Finish connection in blocking mode and release it
+ *
+ * @param conn Connection taken over from an event loop
+ */
+void run_connection(Connection *conn);
+
+/**
+ * @brief Small files shared by all connections
+ */
+FileCache file_cache;
+
+/**
+ * @brief Threads running compressed transfers of all event loops
+ */
+OffloadPool offload_pool;
+
+/**
+ * @brief Serializes status output of worker threads
+ */
+mutex output_lock;
+
+/**
+ * @brief Print a line to the standard output
+ * @details Event loops and offloaded connections log from several threads
+ *
+ * @param msg Line without the newline
+ */
+void print_status(const string &msg);
+
 /**
  * @brief Check validity of file name
  * @details File name for this assignment should not contain some characters
  *
  * @param file File name to check
+ * @param len Length of the file name
  *
  * @return true if given file name is valid, false otherwise
  */
-bool check_filename(const string &file);
+bool check_filename(const char *file, size_t len);
 
 int main(int argc, char *argv[])
 {
-    int port, sd, ec = E_OK;
+    int opt, sd = -1, ec = E_OK;
+    int port = -1;
+    bool event_loop = false;
+    unsigned int workers = thread::hardware_concurrency();
 
     signal(SIGCHLD, catch_child);
-
-    // We need to parse only one parameter, so there's no need to use
-    // getopt() or similar library/mechanism
-    if(argc == 3 && strcmp(argv[1], "-p") == 0) {
-        try {
-            char *ptr;
-            // Try to convert string to int
-            port = strtol(argv[2], &ptr, 10);
-
-            if(*ptr != '\0')
-                throw invalid_argument("not a number");
-
-            // Check port range
-            if(port < 1 || port > 65535)
-                throw range_error("out of range");
-        } catch(const exception &e) {
-            cerr << "Invalid port (" << e.what() << ")" << endl;
+    signal(SIGPIPE, SIG_IGN);
+
+    while((opt = getopt(argc, argv, "p:ew:m:")) != -1) {
+        switch(opt) {
+        case 'p':
+            try {
+                char *ptr;
+                // Try to convert string to int
+                port = strtol(optarg, &ptr, 10);
+
+                if(*ptr != '\0')
+                    throw invalid_argument("not a number");
+
+                // Check port range
+                if(port < 1 || port > 65535)
+                    throw range_error("out of range");
+            } catch(const exception &e) {
+                cerr << "Invalid port (" << e.what() << ")" << endl;
+                exit(E_PARAM);
+            }
+            break;
+        case 'e':
+            event_loop = true;
+            break;
+        case 'w':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            // Cache budget in MiB, 0 disables the cache
+            file_cache.set_budget(strtoul(optarg, NULL, 10) << 20);
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " -p <port> [-e [-w workers]] "
+                    "[-m cache_mb]" << endl;
             exit(E_PARAM);
         }
-    } else {
-        cerr << "Usage: " << argv[0] << " -p <port>" << endl;
+    }
+
+    if(optind < argc || port == -1) {
+        cerr << "Usage: " << argv[0] << " -p <port> [-e [-w workers]] "
+                "[-m cache_mb]" << endl;
         exit(E_PARAM);
     }
 
-    ec = server_setup(port, &sd);
-    if(ec != E_OK) {
-        cerr << "Server setup failed" << endl;
-        exit(ec);
+    if(event_loop) {
+        ec = handle_clients_epoll(port, (workers > 0) ? workers : 1);
+    } else {
+        ec = server_setup(port, &sd);
+        if(ec != E_OK) {
+            cerr << "Server setup failed" << endl;
+            exit(ec);
+        }
+
+        ec = handle_clients(sd);
     }
 
-    ec = handle_clients(sd);
     if(ec != E_OK) {
         cerr << "An error has occured during client handling" << endl;
     }
@@ -219,12 +710,18 @@ int main(int argc, char *argv[])
     return ec;
 }
 
-void catch_child(int sig_num)
+void catch_child(int)
 {
     int status;
     wait(&status);
 }
 
+void print_status(const string &msg)
+{
+    lock_guard<mutex> lock(output_lock);
+    cout << msg << endl;
+}
+
 string ltrim(const string &str)
 {
     size_t first = str.find_first_not_of(" \t");
@@ -234,7 +731,7 @@ string ltrim(const string &str)
     return str.substr(first, str.size());
 }
 
-int server_setup(int port, int *sd)
+int server_setup(int port, int *sd, bool reuse_port)
 {
     int rc, on = 1;
     struct sockaddr_in server_addr;
@@ -251,6 +748,15 @@ int server_setup(int port, int *sd)
         return E_SETUP;
     }
 
+    if(reuse_port) {
+        rc = setsockopt(*sd, SOL_SOCKET, SO_REUSEPORT, (char *)&on,
+                        sizeof(on));
+        if(rc < 0) {
+            perror("setsockopt(SO_REUSEPORT) failed");
+            return E_SETUP;
+        }
+    }
+
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
@@ -314,155 +820,1152 @@ int handle_clients(int sd)
     return ec;
 }
 
-int handle_request(int sd)
+int handle_clients_epoll(int port, unsigned int workers)
 {
-    int rc;
-    float version;
-    char buffer[BUFFER_LENGTH] = { 0, };
-    string::size_type idx;
-    string message, protocol, command, file, sync;
-    stringstream is;
-
-    while((rc = read(sd, buffer, BUFFER_LENGTH)) > 0) {
-        message.append(buffer, rc);
-        if((idx = message.find("\r\n\r\n")) != string::npos) {
-            message.erase(idx);
+    int ec = E_OK;
+    vector<int> sockets;
+    vector<thread> threads;
+
+    for(unsigned int i = 0; i < workers; i++) {
+        int sd = -1;
+        ec = server_setup(port, &sd, true);
+        if(ec != E_OK) {
+            cerr << "Server setup failed" << endl;
+            if(sd != -1)
+                close(sd);
             break;
         }
-    }
 
-    if(message.size() == 0) {
-        cerr << "[worker] Received empty message" << endl;
-        return E_OK;
+        sockets.push_back(sd);
     }
 
-    is.str(message);
+    if(ec == E_OK) {
+        cout << "[server] starting " << workers << " event loop(s)" << endl;
+        // Compression is bound by CPU just as the event loops
+        offload_pool.start(workers);
+        for(int sd : sockets)
+            threads.push_back(thread(worker_loop, sd));
 
-    // Parse protocol, version and command
-    is >> protocol >> version >> command;
-    // Assign rest of the stream to file
-    file.assign(std::istreambuf_iterator<char>(is), {});
+        for(thread &t : threads)
+            t.join();
+        offload_pool.stop();
+    }
 
-    // Edit parsed elements appropriately 
-    transform(protocol.begin(), protocol.end(), protocol.begin(), ::toupper);
-    transform(command.begin(), command.end(), command.begin(), ::toupper);
-    file = ltrim(file);
+    for(int sd : sockets)
+        close(sd);
 
-    // Check protocol
-    if(protocol != PROTO_NAME) {
-        cerr << "[worker] Received invalid protocol name" << endl;
-        ProtoErr err(ProtoErr::PE_INVALID_PROTO);
-        return err.send(sd);
-    }
+    return ec;
+}
 
-    // Version check is not important right now
+int worker_loop(int sd)
+{
+    int efd, n, cd, reserve;
+    struct epoll_event ev, events[WORKER_EVENTS];
 
-    // Check command
-    if(command != "PUT" && command != "GET") {
-        cerr << "[worker] Received invalid command" << endl;
-        ProtoErr err(ProtoErr::PE_INVALID_CMD);
-        return err.send(sd);
+    efd = epoll_create1(0);
+    if(efd < 0) {
+        perror("epoll_create1() failed");
+        return E_SETUP;
     }
 
-    if(file.size() == 0 || !check_filename(file)) {
-        cerr << "[worker] Received invalid file name" << endl;
-        ProtoErr err(ProtoErr::PE_INVALID_FILE);
-        return err.send(sd);
+    // Spare descriptor to turn clients away when the limit is reached
+    reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    // Listening socket is the only one without connection data
+    ev.data.ptr = NULL;
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+        perror("epoll_ctl() failed");
+        close(efd);
+        return E_SETUP;
     }
 
-    memset(buffer, 0, BUFFER_LENGTH);
+    while(true) {
+        n = epoll_wait(efd, events, WORKER_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
 
-    if(command == "PUT") {
-        cout << "[worker] PUT request for file '" << file << "'" << endl;
-        ofstream out;
-        try {
-            out.open(file, ios::out|ios::binary);
-            if(!out.is_open()) {
-                perror("open() failed");
-                throw runtime_error("unable to open file '" + file + "'"); 
-            }
-        } catch(const exception &e) {
-            cerr << "[worker] " << e.what() << endl;
-            ProtoErr err(ProtoErr::PE_PUT_ERROR);
-            return err.send(sd);
+            perror("epoll_wait() failed");
+            break;
         }
 
-        ProtoErr status(ProtoErr::PE_OK);
-        status.send(sd);
-
-        cout << "[worker] Waiting for client" << endl;
-        while((rc = read(sd, buffer, BUFFER_LENGTH)) > 0) {
-            sync.append(buffer, rc);
-            if((idx = sync.find("\r\n\r\n")) != string::npos) {
-                sync.erase(idx);
-                break;
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr == NULL) {
+                // New clients
+                while((cd = accept4(sd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = new Connection(cd);
+                    if(epoll_ctl(efd, EPOLL_CTL_ADD, cd, &ev) < 0) {
+                        perror("epoll_ctl() failed");
+                        delete (Connection *)ev.data.ptr;
+                        close(cd);
+                    }
+                }
+
+                if(errno == EMFILE || errno == ENFILE) {
+                    // Listener is level-triggered, the pending client has to
+                    // be taken off the queue or the loop would spin on it
+                    perror("accept4() failed");
+                    if(reserve >= 0) {
+                        close(reserve);
+                        cd = accept4(sd, NULL, NULL, SOCK_NONBLOCK);
+                        if(cd >= 0)
+                            close(cd);
+                        reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    } else {
+                        // No spare descriptor, wait for connections to close
+                        usleep(WORKER_BACKOFF);
+                    }
+                } else if(errno != EAGAIN && errno != EWOULDBLOCK &&
+                          errno != EINTR) {
+                    perror("accept4() failed");
+                }
+
+                continue;
             }
-        }
-
-        if(sync != "READY")
-            return E_OTHER;
-
-        while((rc = read(sd, buffer, BUFFER_LENGTH)) > 0) {
-            out.write(buffer, rc);
-        }
 
-        cout << "[worker] file saved" << endl;
-        out.close();
-    } else if(command == "GET") {
-        cout << "[worker] GET request for file '" << file << "'" << endl;
-        ifstream in;
-        try {
-            in.open(file, ios::in|ios::binary);
-            if(!in.is_open()) {
-                perror("open() failed");
-                throw runtime_error("unable to open file '" + file + "'"); 
+            Connection *conn = (Connection *)events[i].data.ptr;
+            bool writing = conn->wants_write();
+
+            if(conn->handle_io() != E_OK || conn->done()) {
+                epoll_ctl(efd, EPOLL_CTL_DEL, conn->socket(), NULL);
+                close(conn->socket());
+                delete conn;
+            } else if(conn->offload()) {
+                // Rest of the session runs in the pool
+                epoll_ctl(efd, EPOLL_CTL_DEL, conn->socket(), NULL);
+                offload_pool.push(conn);
+            } else if(writing != conn->wants_write()) {
+                ev.events = conn->wants_write() ? EPOLLOUT : EPOLLIN;
+                ev.data.ptr = conn;
+                epoll_ctl(efd, EPOLL_CTL_MOD, conn->socket(), &ev);
             }
-        } catch(const exception &e) {
-            cerr << "[worker] " << e.what() << endl;
-            ProtoErr err(ProtoErr::PE_GET_ERROR);
-            return err.send(sd);
         }
+    }
 
-        ProtoErr status(ProtoErr::PE_OK);
-        status.send(sd);
+    if(reserve >= 0)
+        close(reserve);
+    close(efd);
+    return E_OTHER;
+}
 
-        cout << "[worker] Waiting for client" << endl;
-        while((rc = read(sd, buffer, BUFFER_LENGTH)) > 0) {
-            sync.append(buffer, rc);
-            if((idx = sync.find("\r\n\r\n")) != string::npos) {
-                sync.erase(idx);
-                break;
-            }
-        }
+int handle_request(int sd)
+{
+    Connection conn(sd);
 
-        if(sync != "READY")
-            return E_OTHER;
+    return conn.handle_io();
+}
 
-        while(in.good()) {
-            in.read(buffer, BUFFER_LENGTH);
-            rc = write(sd, buffer, in.gcount());
+void run_connection(Connection *conn)
+{
+    conn->set_blocking();
+    conn->handle_io();
+    close(conn->socket());
+    delete conn;
+}
+
+void OffloadPool::start(unsigned int count)
+{
+    closed = false;
+    for(unsigned int i = 0; i < count; i++)
+        threads.push_back(thread(&OffloadPool::run, this));
+}
+
+void OffloadPool::push(Connection *conn)
+{
+    lock_guard<mutex> lock(m);
+    queue.push_back(conn);
+    cv.notify_one();
+}
+
+void OffloadPool::stop()
+{
+    {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+    for(thread &t : threads)
+        t.join();
+    threads.clear();
+}
+
+void OffloadPool::run()
+{
+    Connection *conn;
+
+    while(true) {
+        {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [this] { return closed || !queue.empty(); });
+            if(queue.empty())
+                return;
+
+            conn = queue.front();
+            queue.pop_front();
+        }
+
+        run_connection(conn);
+    }
+}
+
+int Connection::handle_io()
+{
+    int rc = E_OK;
+
+    while(st != ST_DONE) {
+        rc = step();
+        if(rc == E_AGAIN)
+            return E_OK;
+
+        if(rc != E_OK) {
+            st = ST_DONE;
+            break;
+        }
+    }
+
+    return rc;
+}
+
+int Connection::step()
+{
+    int rc;
+    bool eof = false;
+    string message;
+
+    switch(st) {
+    case ST_HEADER:
+        // First bytes tell text and binary requests apart
+        while(buffered() < 4 && !eof) {
+            rc = fill(&eof);
+            if(rc != E_OK)
+                return rc;
+        }
+
+        if(proto_is_binary(in + in_start, buffered()))
+            return read_binary();
+
+        rc = read_message(message, &eof);
+        if(rc != E_OK)
+            return rc;
+
+        if(message.size() == 0) {
+            // Sessions end by closing the connection
+            if(!session)
+                cerr << "[worker] Received empty message" << endl;
+            st = ST_DONE;
+            return E_OK;
+        }
+
+        process_request(message);
+        return E_OK;
+    case ST_STATUS:
+        while(out_off < out_len) {
+            // Status goes out in one segment with the payload behind it,
+            // otherwise Nagle holds the payload until the status is acked
+            rc = ::send(sd, out + out_off, out_len - out_off,
+                      (after_status == ST_SEND) ? MSG_MORE : 0);
             if(rc < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return E_AGAIN;
+                if(errno == EINTR)
+                    continue;
+
                 perror("[worker] write() failed");
                 return E_WRITE;
             }
+
+            out_off += rc;
         }
 
-        cout << "[worker] file sent" << endl;
-        in.close();
+        if(after_status == ST_READY)
+            print_status("[worker] Waiting for client");
+
+        st = after_status;
+        return E_OK;
+    case ST_READY:
+        rc = read_message(message, &eof);
+        if(rc != E_OK)
+            return rc;
+
+        if(message != "READY")
+            return E_OTHER;
+
+        st = after_ready;
+        return E_OK;
+    case ST_RECV:
+        return receive();
+    case ST_SEND:
+        return send();
+    case ST_CACHED:
+        return send_cached();
+    case ST_SKIP:
+        return skip();
+    case ST_ZSEND:
+    case ST_ZRECV:
+    case ST_ZSKIP:
+        // Event loops hand the connection over to a thread (@see offload())
+        if(!blocking)
+            return E_AGAIN;
+
+        return transfer_compressed();
+    case ST_TRAILER:
+        return check_trailer();
+    case ST_DONE:
+        break;
     }
 
     return E_OK;
 }
 
-bool check_filename(const string &file)
+int Connection::receive()
 {
-    // Slash and backslash test
-    if(file.find_first_of("/\\") != string::npos)
+    ssize_t rc;
+
+    // Data which came along with the request or READY
+    if(buffered() > 0 && remaining != 0) {
+        size_t len = limit(buffered());
+        rc = store(in + in_start, len);
+        consume(len);
+        if(remaining > 0)
+            remaining -= len;
+        return rc;
+    }
+
+    // Flush the pipe first
+    while(pipe_len > 0) {
+        if(zero_copy) {
+            rc = splice(pipe_fd[0], NULL, file, NULL, pipe_len, SPLICE_F_MOVE);
+            if(rc > 0 && checksum) {
+                if(crc32c_fd(file, crc_pos, rc, &crc) < 0) {
+                    perror("[worker] pread() failed");
+                    return E_WRITE;
+                }
+
+                crc_pos += rc;
+            }
+        } else {
+            rc = read(pipe_fd[0], buffer, min(pipe_len, (size_t)BUFFER_LENGTH));
+            if(rc > 0 && store(buffer, rc) != E_OK)
+                return E_WRITE;
+        }
+
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EINVAL && zero_copy) {
+                // File doesn't support splice(), copy the rest
+                zero_copy = false;
+                continue;
+            }
+
+            perror("[worker] splice() failed");
+            return E_WRITE;
+        }
+
+        pipe_len -= rc;
+    }
+
+    if(remaining == 0 && trailer) {
+        st = ST_TRAILER;
+        return E_OK;
+    }
+
+    if(remaining == 0)
+        return finish_put();
+
+    if(zero_copy && pipe_fd[0] == -1) {
+        if(pipe2(pipe_fd, O_NONBLOCK) < 0) {
+            pipe_fd[0] = pipe_fd[1] = -1;
+            zero_copy = false;
+        } else {
+            // Bigger pipe means less splice() calls, failure is not fatal
+            fcntl(pipe_fd[1], F_SETPIPE_SZ, ZEROCOPY_CHUNK);
+        }
+    }
+
+    if(zero_copy) {
+        rc = splice(sd, NULL, pipe_fd[1], NULL, limit(ZEROCOPY_CHUNK),
+                    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if(rc > 0) {
+            pipe_len = rc;
+            if(remaining > 0)
+                remaining -= rc;
+            return E_OK;
+        }
+    } else {
+        rc = read(sd, buffer, limit(BUFFER_LENGTH));
+        if(rc > 0) {
+            if(remaining > 0)
+                remaining -= rc;
+            return store(buffer, rc);
+        }
+    }
+
+    if(rc == 0) {
+        if(remaining > 0) {
+            cerr << "[worker] client closed connection " << remaining
+                 << " bytes before the end of file" << endl;
+            return E_OTHER;
+        }
+
+        return finish_put();
+    }
+
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return E_AGAIN;
+    if(errno == EINTR)
+        return E_OK;
+
+    perror("[worker] read() failed");
+    return E_OTHER;
+}
+
+int Connection::finish_put()
+{
+    print_status("[worker] file saved");
+    finish_request();
+
+    // Sessions confirm the PUT when the data are stored
+    if(session) {
+        set_range_status(size - offset, ST_HEADER);
+    }
+
+    return E_OK;
+}
+
+void Connection::finish_request()
+{
+    if(!session) {
+        st = ST_DONE;
+        return;
+    }
+
+    if(file != -1)
+        close(file);
+
+    file = -1;
+    cached.reset();
+    remaining = -1;
+    buf_len = buf_off = 0;
+    zero_copy = true;
+    st = ST_HEADER;
+}
+
+void Connection::reject(int code, off_t payload)
+{
+    if(file != -1)
+        close(file);
+
+    file = -1;
+    cached.reset();
+    set_status(code, (session) ? ST_HEADER : ST_DONE);
+    // Trailer has to be skipped even behind empty payload
+    if(session && (payload > 0 || trailer)) {
+        remaining = payload;
+        st = (deflate) ? ST_ZSKIP : ST_SKIP;
+    }
+}
+
+int Connection::check_trailer()
+{
+    int rc;
+    bool eof = false;
+    uint32_t sum;
+
+    while(buffered() < PROTO_TRAILER_LEN && !eof) {
+        rc = fill(&eof);
+        if(rc != E_OK)
+            return rc;
+    }
+
+    if(buffered() < PROTO_TRAILER_LEN) {
+        cerr << "[worker] client closed connection before checksum" << endl;
+        return E_OTHER;
+    }
+
+    sum = proto_unpack_trailer(in + in_start);
+    consume(PROTO_TRAILER_LEN);
+    trailer = false;
+
+    // Payload was skipped, status is already prepared by reject()
+    if(file == -1) {
+        remaining = -1;
+        st = ST_STATUS;
+        return E_OK;
+    }
+
+    if(sum != crc) {
+        cerr << "[worker] checksum mismatch (received " << hex << sum
+             << ", computed " << crc << dec << ")" << endl;
+        // Damaged data don't stay, the file is left as before the PUT
+        if(ftruncate(file, offset) < 0)
+            perror("[worker] ftruncate() failed");
+        reject(ProtoErr::PE_CHECKSUM, 0);
+        return E_OK;
+    }
+
+    return finish_put();
+}
+
+void Connection::send_trailer()
+{
+    proto_pack_trailer(out, crc);
+    out_len = PROTO_TRAILER_LEN;
+    out_off = 0;
+    after_status = st;
+    st = ST_STATUS;
+}
+
+int Connection::transfer_compressed()
+{
+    int rc;
+    off_t wire = 0;
+    size_t used = 0;
+
+    if(st == ST_ZSEND) {
+        if(send_compressed(file, sd, remaining, level, &wire,
+                           (checksum) ? &crc : NULL) < 0)
+            return E_WRITE;
+
+        print_status("[worker] file sent (" + to_string(wire) +
+                     " bytes compressed)");
+        remaining = 0;
+        finish_request();
+        if(checksum)
+            send_trailer();
+        return E_OK;
+    }
+
+    rc = recv_compressed(sd, (st == ST_ZRECV) ? file : -1, remaining,
+                         in + in_start, buffered(), &used,
+                         (checksum) ? &crc : NULL);
+    consume(used);
+    if(rc < 0)
+        return E_OTHER;
+
+    if(trailer) {
+        remaining = 0;
+        st = ST_TRAILER;
+        return E_OK;
+    }
+
+    if(st == ST_ZSKIP) {
+        // Status is already prepared by reject()
+        remaining = -1;
+        st = ST_STATUS;
+        return E_OK;
+    }
+
+    remaining = 0;
+    return finish_put();
+}
+
+int Connection::skip()
+{
+    ssize_t rc;
+
+    if(buffered() > 0) {
+        size_t len = limit(buffered());
+        consume(len);
+        remaining -= len;
+    }
+
+    while(remaining > 0) {
+        rc = read(sd, buffer, limit(BUFFER_LENGTH));
+        if(rc == 0) {
+            cerr << "[worker] client closed connection" << endl;
+            return E_OTHER;
+        }
+
+        if(rc < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return E_AGAIN;
+            if(errno == EINTR)
+                continue;
+
+            perror("[worker] read() failed");
+            return E_OTHER;
+        }
+
+        remaining -= rc;
+    }
+
+    if(trailer) {
+        st = ST_TRAILER;
+        return E_OK;
+    }
+
+    // Status is already prepared by reject()
+    remaining = -1;
+    st = ST_STATUS;
+    return E_OK;
+}
+
+int Connection::send()
+{
+    ssize_t rc;
+
+    if(remaining == 0 && buf_off == buf_len) {
+        print_status("[worker] file sent");
+        finish_request();
+        if(checksum)
+            send_trailer();
+        return E_OK;
+    }
+
+    if(zero_copy) {
+        rc = sendfile(sd, file, NULL, limit(ZEROCOPY_CHUNK));
+        if(rc > 0) {
+            if(remaining > 0)
+                remaining -= rc;
+            if(checksum) {
+                if(crc32c_fd(file, crc_pos, rc, &crc) < 0) {
+                    perror("[worker] pread() failed");
+                    return E_OTHER;
+                }
+
+                crc_pos += rc;
+            }
+
+            return E_OK;
+        }
+
+        if(rc < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            zero_copy = false;
+            return E_OK;
+        }
+    } else {
+        if(buf_off == buf_len) {
+            rc = read(file, buffer, limit(BUFFER_LENGTH));
+            if(rc < 0) {
+                perror("[worker] read() failed");
+                return E_OTHER;
+            }
+
+            buf_len = rc;
+            buf_off = 0;
+            if(remaining > 0)
+                remaining -= rc;
+            if(checksum)
+                crc = crc32c(crc, buffer, rc);
+        }
+
+        rc = (buf_len > 0) ? write(sd, buffer + buf_off, buf_len - buf_off)
+                           : 0;
+        if(rc > 0) {
+            buf_off += rc;
+            return E_OK;
+        }
+    }
+
+    if(rc == 0) {
+        if(remaining > 0) {
+            cerr << "[worker] file shrank during transfer" << endl;
+            return E_OTHER;
+        }
+
+        print_status("[worker] file sent");
+        st = ST_DONE;
+        return E_OK;
+    }
+
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return E_AGAIN;
+    if(errno == EINTR)
+        return E_OK;
+
+    perror("[worker] write() failed");
+    return E_WRITE;
+}
+
+void Connection::consume(size_t len)
+{
+    in_start += len;
+    if(in_start == in_end)
+        in_start = in_end = in_scan = 0;
+}
+
+int Connection::fill(bool *eof)
+{
+    ssize_t rc;
+
+    // Make room behind the unprocessed data
+    if(in_end == IN_BUFFER && in_start > 0) {
+        memmove(in, in + in_start, buffered());
+        in_scan -= min(in_scan, in_start);
+        in_end -= in_start;
+        in_start = 0;
+    }
+
+    if(in_end == IN_BUFFER) {
+        cerr << "[worker] request is too long" << endl;
+        return E_OTHER;
+    }
+
+    while(true) {
+        rc = read(sd, in + in_end, IN_BUFFER - in_end);
+        if(rc > 0) {
+            in_end += rc;
+            return E_OK;
+        } else if(rc == 0) {
+            *eof = true;
+            return E_OK;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return E_AGAIN;
+        } else if(errno != EINTR) {
+            perror("[worker] read() failed");
+            return E_OTHER;
+        }
+    }
+}
+
+int Connection::read_message(string &msg, bool *eof)
+{
+    int rc;
+    char *end;
+
+    while(true) {
+        // Only the new data are searched, terminator may span the old ones
+        in_scan = max(in_scan, in_start);
+        end = (char *)memmem(in + in_scan, in_end - in_scan, "\r\n\r\n", 4);
+        if(end != NULL) {
+            msg.assign(in + in_start, end - (in + in_start));
+            consume(end + 4 - (in + in_start));
+            in_scan = in_start;
+            return E_OK;
+        }
+
+        in_scan = max(in_start, (in_end > 3) ? in_end - 3 : 0);
+
+        if(*eof) {
+            msg.assign(in + in_start, buffered());
+            consume(buffered());
+            return E_OK;
+        }
+
+        rc = fill(eof);
+        if(rc != E_OK)
+            return rc;
+    }
+}
+
+int Connection::read_binary()
+{
+    int rc;
+    bool eof = false;
+    size_t len;
+    off_t payload;
+    proto_request_t req;
+    char file[PROTO_NAME_MAX + 1];
+
+    while(buffered() < PROTO_REQ_LEN && !eof) {
+        rc = fill(&eof);
+        if(rc != E_OK)
+            return rc;
+    }
+
+    if(buffered() < PROTO_REQ_LEN)
+        return E_OTHER;
+
+    proto_unpack_request(in + in_start, &req);
+    session = binary = true;
+    deflate = (req.flags & PROTO_FLAG_DEFLATE) != 0;
+    level = req.flags >> PROTO_LEVEL_SHIFT;
+    if(level == 0)
+        level = COMPRESS_LEVEL;
+    checksum = (req.flags & PROTO_FLAG_CHECKSUM) != 0;
+    trailer = checksum && req.command == PROTO_PUT;
+    crc = 0;
+
+    if(req.name_len > PROTO_NAME_MAX) {
+        cerr << "[worker] Received too long file name" << endl;
+        set_status(ProtoErr::PE_INVALID_FILE, ST_DONE);
+        return E_OK;
+    }
+
+    len = PROTO_REQ_LEN + req.name_len;
+    while(buffered() < len && !eof) {
+        rc = fill(&eof);
+        if(rc != E_OK)
+            return rc;
+    }
+
+    if(buffered() < len)
+        return E_OTHER;
+
+    memcpy(file, in + in_start + PROTO_REQ_LEN, req.name_len);
+    file[req.name_len] = '\0';
+    consume(len);
+
+    if(req.command != PROTO_GET && req.command != PROTO_PUT) {
+        cerr << "[worker] Received invalid command" << endl;
+        set_status(ProtoErr::PE_INVALID_CMD, ST_DONE);
+        return E_OK;
+    }
+
+    // Payload of PUT can't be skipped without valid range
+    if((off_t)req.offset < 0 || (off_t)req.length < 0 ||
+       (req.command == PROTO_PUT && req.offset > req.length)) {
+        cerr << "[worker] Received invalid range" << endl;
+        set_status(ProtoErr::PE_INVALID_RANGE, ST_DONE);
+        return E_OK;
+    }
+
+    if(!check_filename(file, req.name_len)) {
+        cerr << "[worker] Received invalid file name" << endl;
+        reject(ProtoErr::PE_INVALID_FILE, (req.command == PROTO_PUT)
+                                          ? req.length - req.offset : 0);
+        return E_OK;
+    }
+
+    payload = (req.command == PROTO_PUT) ? req.length - req.offset : 0;
+
+    // Flags are known only since the session version which added them
+    if((deflate && version < PROTO_VER_COMPRESS) ||
+       (checksum && version < PROTO_VER_CHECKSUM)) {
+        cerr << "[worker] Received unsupported flags in session " << version
+             << endl;
+        reject(ProtoErr::PE_INVALID_VER, payload);
+        return E_OK;
+    }
+
+    // Unknown level would make every chunk fail to compress
+    if(deflate && level > COMPRESS_LEVEL_MAX) {
+        cerr << "[worker] Received invalid compression level " << level
+             << endl;
+        reject(ProtoErr::PE_INVALID_CMD, payload);
+        return E_OK;
+    }
+
+    open_file(req.command, file, PROTO_BIN_VERSION, req.offset, req.length);
+    return E_OK;
+}
+
+void Connection::process_request(const string &message)
+{
+    float version = 0;
+    off_t offset = 0, length = 0;
+    string protocol, command, file;
+    stringstream is;
+
+    is.str(message);
+
+    // Parse protocol, version and command
+    is >> protocol >> version >> command;
+    transform(command.begin(), command.end(), command.begin(), ::toupper);
+
+    // Version 2 adds offset and length before the file name
+    if(version >= 2) {
+        string off_str, len_str;
+        char *ptr;
+
+        is >> off_str >> len_str;
+        transform(off_str.begin(), off_str.end(), off_str.begin(), ::toupper);
+        if(off_str == "APPEND" && command == "PUT") {
+            offset = -1;
+        } else {
+            offset = strtoll(off_str.c_str(), &ptr, 10);
+            if(off_str.empty() || *ptr != '\0' || offset < 0)
+                offset = -2;
+        }
+
+        length = strtoll(len_str.c_str(), &ptr, 10);
+        if(len_str.empty() || *ptr != '\0' || length < 0)
+            offset = -2;
+    }
+
+    // Assign rest of the stream to file
+    file.assign(std::istreambuf_iterator<char>(is), {});
+
+    // Edit parsed elements appropriately 
+    transform(protocol.begin(), protocol.end(), protocol.begin(), ::toupper);
+    file = ltrim(file);
+
+    // Check protocol
+    if(protocol != PROTO_NAME) {
+        cerr << "[worker] Received invalid protocol name" << endl;
+        return set_status(ProtoErr::PE_INVALID_PROTO, ST_DONE);
+    }
+
+    // Clients fall back to older version when they get INVALID_VERSION
+    if(version <= 0 || version > PROTO_VER_MAX) {
+        cerr << "[worker] Received unsupported version " << version << endl;
+        return set_status(ProtoErr::PE_INVALID_VER, ST_DONE);
+    }
+
+    session = (version >= PROTO_VER_SESSION);
+
+    // Check command
+    // Following requests of the connection use binary headers
+    if(command == "SESSION" && version >= PROTO_BIN_VERSION) {
+        print_status("[worker] binary session");
+        this->version = version;
+        return set_status(ProtoErr::PE_OK, ST_HEADER);
+    }
+
+    if(command != "PUT" && command != "GET") {
+        cerr << "[worker] Received invalid command" << endl;
+        return set_status(ProtoErr::PE_INVALID_CMD, ST_DONE);
+    }
+
+    // Pipelined PUT has to state the length of its payload
+    if(offset < -1 || (session && command == "PUT" &&
+                       (offset == -1 || offset > length))) {
+        cerr << "[worker] Received invalid range" << endl;
+        return set_status(ProtoErr::PE_INVALID_RANGE, ST_DONE);
+    }
+
+    if(!check_filename(file.c_str(), file.size())) {
+        cerr << "[worker] Received invalid file name" << endl;
+        return reject(ProtoErr::PE_INVALID_FILE,
+                      (session && command == "PUT") ? length - offset : 0);
+    }
+
+    open_file((command == "PUT") ? PROTO_PUT : PROTO_GET, file.c_str(), version,
+              offset, length);
+}
+
+void Connection::open_file(int command, const char *file, float version,
+                           off_t offset, off_t length)
+{
+    struct stat info;
+    int code = (command == PROTO_PUT) ? ProtoErr::PE_PUT_ERROR
+                                      : ProtoErr::PE_GET_ERROR;
+    off_t payload = (session && command == PROTO_PUT) ? length - offset : 0;
+
+    ostringstream os;
+    os << "[worker] " << ((command == PROTO_PUT) ? "PUT" : "GET")
+       << " request for file '" << file << "'";
+    if(version >= 2)
+        os << " (offset " << offset << ", length " << length << ")";
+    print_status(os.str());
+
+    if(command == PROTO_PUT) {
+        // Checksum reads the stored data back
+        this->file = open(file, (version >= 2)
+                          ? O_RDWR|O_CREAT : O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        after_ready = ST_RECV;
+    } else if(open_cached(file, version, &info)) {
+        after_ready = ST_CACHED;
+    } else {
+        this->file = open(file, O_RDONLY);
+        after_ready = ST_SEND;
+    }
+
+    if(!cached && (this->file < 0 || fstat(this->file, &info) < 0)) {
+        perror("open() failed");
+        cerr << "[worker] unable to open file '" << file << "'" << endl;
+        return reject(code, payload);
+    }
+
+    if(version < 2)
+        return set_status(ProtoErr::PE_OK, ST_READY);
+
+    if(command == PROTO_PUT) {
+        // Offset -1 appends to the current file
+        if(offset == -1)
+            offset = info.st_size;
+
+        size = length;
+        length = size - offset;
+    } else {
+        size = info.st_size;
+        if(length == 0 || length > size - offset)
+            length = size - offset;
+    }
+
+    if(length < 0 || (command == PROTO_PUT && offset > info.st_size)) {
+        cerr << "[worker] offset " << offset << " is out of file" << endl;
+        return reject(ProtoErr::PE_INVALID_RANGE, payload);
+    }
+
+    // Old content behind the offset goes away before the upload, so the
+    // file size is always the number of stored bytes and an interrupted
+    // upload can be resumed from it
+    if(command == PROTO_PUT && ftruncate(this->file, offset) < 0) {
+        perror("[worker] ftruncate() failed");
+        return reject(code, payload);
+    }
+
+    if(!cached && lseek(this->file, offset, SEEK_SET) < 0) {
+        perror("[worker] lseek() failed");
+        return reject(code, payload);
+    }
+
+    remaining = length;
+    this->offset = offset;
+    crc_pos = offset;
+    if(cached) {
+        cache_off = offset;
+        if(checksum)
+            crc = crc32c(crc, cached->data() + offset, length);
+    }
+
+    // Sessions send GET data right after the status and confirm PUT
+    // only when the data are stored
+    if(session && command == PROTO_PUT) {
+        st = (deflate) ? ST_ZRECV : ST_RECV;
+        return;
+    }
+
+    if(session && cached) {
+        // Status goes out along with the data by one writev()
+        set_range_status(length, ST_HEADER);
+        st = ST_CACHED;
+    } else if(session) {
+        set_range_status(length, (deflate) ? ST_ZSEND : ST_SEND);
+    } else {
+        set_range_status(length, ST_READY);
+    }
+}
+
+bool Connection::open_cached(const char *name, float version,
+                             struct stat *info)
+{
+    int fd;
+
+    if(version < 2 || deflate || stat(name, info) < 0 ||
+       !file_cache.cacheable(*info))
         return false;
 
+    cached = file_cache.get(name, *info);
+    if(cached)
+        return true;
+
+    fd = open(name, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    // File may have changed since stat()
+    if(fstat(fd, info) == 0 && file_cache.cacheable(*info))
+        cached = file_cache.load(name, fd, *info);
+
+    close(fd);
+    return (bool)cached;
+}
+
+int Connection::send_cached()
+{
+    ssize_t rc;
+    size_t len;
+    int cnt;
+    struct iovec iov[2];
+
+    while(out_off < out_len || remaining > 0) {
+        cnt = 0;
+        if(out_off < out_len) {
+            iov[cnt].iov_base = out + out_off;
+            iov[cnt++].iov_len = out_len - out_off;
+        }
+
+        if(remaining > 0) {
+            iov[cnt].iov_base = (char *)cached->data() + cache_off;
+            iov[cnt++].iov_len = remaining;
+        }
+
+        rc = writev(sd, iov, cnt);
+        if(rc < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return E_AGAIN;
+            if(errno == EINTR)
+                continue;
+
+            perror("[worker] writev() failed");
+            return E_WRITE;
+        }
+
+        len = min((size_t)rc, out_len - out_off);
+        out_off += len;
+        cache_off += rc - len;
+        remaining -= rc - len;
+    }
+
+    print_status("[worker] file sent (cached)");
+    finish_request();
+    if(checksum)
+        send_trailer();
+    return E_OK;
+}
+
+void Connection::set_status(int code, state next)
+{
+    if(binary) {
+        proto_response_t resp = { (uint8_t)code, 0, 0, 0, 0 };
+        proto_pack_response(out, &resp);
+        out_len = PROTO_RESP_LEN;
+    } else {
+        ProtoErr status(code);
+        out_len = min(status.len(), sizeof(out));
+        memcpy(out, status.msg(), out_len);
+    }
+
+    out_off = 0;
+    after_status = next;
+    st = ST_STATUS;
+}
+
+void Connection::set_range_status(off_t length, state next)
+{
+    if(binary) {
+        proto_response_t resp = { ProtoErr::PE_OK,
+                                  (uint8_t)(((deflate) ? PROTO_FLAG_DEFLATE : 0) |
+                                            ((checksum) ? PROTO_FLAG_CHECKSUM : 0)),
+                                  (uint64_t)offset, (uint64_t)length,
+                                  (uint64_t)size };
+        proto_pack_response(out, &resp);
+        out_len = PROTO_RESP_LEN;
+    } else {
+        ProtoErr status(offset, length, size);
+        out_len = min(status.len(), sizeof(out));
+        memcpy(out, status.msg(), out_len);
+    }
+
+    out_off = 0;
+    after_status = next;
+    st = ST_STATUS;
+}
+
+int Connection::store(const char *data, size_t len)
+{
+    ssize_t rc;
+
+    while(len > 0) {
+        rc = write(file, data, len);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+
+            perror("[worker] write() failed");
+            return E_WRITE;
+        }
+
+        if(checksum)
+            crc = crc32c(crc, data, rc);
+
+        crc_pos += rc;
+        data += rc;
+        len -= rc;
+    }
+
+    return E_OK;
+}
+
+bool check_filename(const char *file, size_t len)
+{
+    // Slash, backslash and NUL test
+    for(size_t i = 0; i < len; i++) {
+        if(file[i] == '/' || file[i] == '\\' || file[i] == '\0')
+            return false;
+    }
+
     // Current dir (.) and parent dir (..) check
-    if(file == ".." || file == ".")
+    if((len == 1 && file[0] == '.') || (len == 2 && !strncmp(file, "..", 2)))
         return false;
 
-    return true;
+    return len > 0;
 }
@@ -32,11 +32,14 @@ echo "Server starting on port $PORT"
 # 1) Upload file 'myfile' to server
 # 2) Remove this file from client's directory
 # 3) Download the file again from server
+# 4) Cut the file and resume its download
 cd tmp
 ln -s ../client client
 ./client -h localhost -p $PORT -u myfile
 rm myfile
 ./client -h localhost -p $PORT -d myfile
+head -c 6 ../.orig > myfile
+./client -h localhost -p $PORT -r -d myfile
 
 killall server
 killall client
@@ -1,10 +1,14 @@
 #include <iostream>
 #include <sstream>
-#include <fstream>
 #include <exception>
 #include <unistd.h>
 #include <cstring>
+#include <stdint.h>
 #include <string>
+#include <ctime>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -12,14 +16,40 @@
 #include "imap.hpp"
 #include "tls.hpp"
 #include "utils.hpp"
+#include "writer.hpp"
+
+/**
+ * @brief Read one line of server response
+ *
+ * @param conn Current connection data
+ * @param line Destination for the line, including the CRLF terminator
+ *
+ * @return E_OK on success, E_SOCK otherwise
+ */
+static int imap_read_line(connection_data_t *conn, std::string &line)
+{
+    ssize_t rc;
+
+    rc = socket_read_line(conn, line);
+    if(rc > 0)
+        return E_OK;
+
+    if(rc < 0)
+        perror("socket_read() failed");
+    else
+        std::cerr << "Connection closed by server" << std::endl;
+
+    return E_SOCK;
+}
 
 int imap_connect(const config_data_t *config, connection_data_t *conn)
 {
     int rc;
     struct sockaddr_in server_addr;
-    struct hostent *hostp;
-    char buf[64] = { 0, };
+    struct addrinfo hints;
+    struct addrinfo *res;
     std::string response;
+    std::string cache;
 
     conn->sd = socket(AF_INET, SOCK_STREAM, 0);
     if(conn->sd < 0) {
@@ -32,15 +62,21 @@ int imap_connect(const config_data_t *config, connection_data_t *conn)
     server_addr.sin_port = htons(config->port);
     server_addr.sin_addr.s_addr = inet_addr(config->server_addr.c_str());
 
+    // getaddrinfo() is used instead of gethostbyname(), more connections
+    // may be opened by parallel threads
     if(server_addr.sin_addr.s_addr == INADDR_NONE) {
-        hostp = gethostbyname(config->server_addr.c_str());
-        if(hostp == NULL) {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if(getaddrinfo(config->server_addr.c_str(), NULL, &hints, &res) != 0) {
             std::cerr << "Unknown host: " << config->server_addr << std::endl;
             return E_SETUP;
         }
 
-        memcpy(&server_addr.sin_addr, hostp->h_addr_list[0],
+        memcpy(&server_addr.sin_addr,
+                &((struct sockaddr_in *)res->ai_addr)->sin_addr,
                 sizeof(server_addr.sin_addr));
+        freeaddrinfo(res);
     }
 
     rc = connect(conn->sd, (struct sockaddr *)&server_addr,
@@ -51,75 +87,355 @@ int imap_connect(const config_data_t *config, connection_data_t *conn)
     }
 
     if(config->tls) {
-        rc = tls_upgrade_connection(conn, config->cert_file, config->cert_dir);
+        if(!config->tls_cache.empty())
+            cache = config->tls_cache + config->server_addr + "-" +
+                    std::to_string(config->port);
+
+        rc = tls_upgrade_connection(conn, config->cert_file, config->cert_dir,
+                                    cache);
         if(rc != E_OK)
             return E_SETUP;
     }
 
-    while((rc = socket_read(conn, buf, 64)) > 0) {
-        response.append(buf, rc);
-        if(response.find_first_of("\r\n") != std::string::npos)
+    rc = imap_read_line(conn, response);
+    if(rc != E_OK)
+        return rc;
+
+    if(response.compare(0, 4, "* OK") != 0) {
+        std::cerr << "Server error" << std::endl;
+        return E_SETUP;
+    }
+
+    return E_OK;
+}
+
+/**
+ * @brief Get size of a literal which ends given response line
+ *
+ * @param line Response line including CRLF
+ *
+ * @return Literal size, -1 if the line doesn't end with a literal
+ */
+static long imap_literal_size(const std::string &line)
+{
+    size_t end = line.find_last_not_of("\r\n");
+    size_t start;
+    char *ptr;
+    long size;
+
+    if(end == std::string::npos || line[end] != '}')
+        return -1;
+
+    start = line.find_last_of('{', end);
+    if(start == std::string::npos)
+        return -1;
+
+    size = strtol(line.c_str() + start + 1, &ptr, 10);
+    if(ptr == line.c_str() + start + 1 || ptr != line.c_str() + end ||
+       size < 0)
+        return -1;
+
+    return size;
+}
+
+/**
+ * @brief Check if the literal which ends given line is a BODY[...] item
+ *
+ * @param line Response line ending with a literal
+ */
+static bool imap_is_body_literal(const std::string &line)
+{
+    size_t end = line.find_last_of('{');
+    size_t open;
+
+    if(end == std::string::npos || end == 0)
+        return false;
+
+    end = line.find_last_not_of(' ', end - 1);
+    if(end == std::string::npos || line[end] != ']')
+        return false;
+
+    open = line.find_last_of('[', end);
+    return open != std::string::npos && open >= 4 &&
+           line.compare(open - 4, 4, "BODY") == 0;
+}
+
+/**
+ * @brief Read a literal of given size from the server
+ *
+ * @param conn Current connection data
+ * @param size Literal size
+ * @param out If not NULL, the literal is appended to it
+ *
+ * @return E_OK on success, E_SOCK otherwise
+ */
+static int imap_read_literal(connection_data_t *conn, long size,
+                             std::string *out)
+{
+    const char *data;
+    ssize_t rc = 0;
+
+    // Literal goes from the receive buffer straight to the output
+    while(size > 0) {
+        rc = socket_read_buffered(conn, &data);
+        if(rc <= 0)
             break;
+
+        if(rc > size)
+            rc = size;
+        if(out != NULL)
+            out->append(data, rc);
+        socket_consume(conn, rc);
+        size -= rc;
     }
 
-    if(rc < 0) {
-        perror("socket_read() failed");
+    if(size > 0) {
+        if(rc < 0)
+            perror("socket_read() failed");
+        else
+            std::cerr << "Connection closed by server" << std::endl;
         return E_SOCK;
     }
 
-    if(response.compare(0, 4, "* OK") != 0) {
-        std::cerr << "Server error" << std::endl;
-        return E_SETUP;
+    return E_OK;
+}
+
+/**
+ * @brief Read the rest of an untagged response
+ *
+ * @param conn Current connection data
+ * @param line First line of the response
+ * @param response If not NULL, the whole response is appended to it
+ *
+ * @return E_OK on success, E_SOCK otherwise
+ */
+static int imap_read_untagged(connection_data_t *conn, std::string &line,
+                              std::string *response)
+{
+    long size;
+    int rc;
+
+    if(response != NULL)
+        response->append(line);
+
+    while((size = imap_literal_size(line)) >= 0) {
+        rc = imap_read_literal(conn, size, response);
+        if(rc == E_OK)
+            rc = imap_read_line(conn, line);
+        if(rc != E_OK)
+            return rc;
+
+        if(response != NULL)
+            response->append(line);
     }
 
     return E_OK;
 }
 
-int imap_login(connection_data_t *conn, const std::string &user,
-                const std::string &pass)
+/**
+ * @brief Get keyword of an untagged response
+ *
+ * @param line First line of the response, e.g. "* 5 FETCH (...)"
+ *
+ * @return Response keyword, e.g. "FETCH"
+ */
+static std::string imap_untagged_keyword(const std::string &line)
 {
-    unsigned int req_id = conn->cnt++;
-    std::stringstream ss;
-    std::string req;
+    std::istringstream iss(line.substr(2));
+    std::string keyword;
 
-    ss << req_id << " LOGIN " << user << " " << pass << "\r\n";
-    req = ss.str();
+    iss >> keyword;
+    // Message data are prefixed by the message number
+    if(!keyword.empty() && isdigit(keyword[0]))
+        iss >> keyword;
 
-    if(imap_exec_command(conn, req, req_id) != E_OK){
-        return E_CMD;
+    return keyword;
+}
+
+/**
+ * @brief Read one server response and route it to its command
+ * @details Tagged responses complete the command with the same tag.
+ *          Untagged ones go to the oldest command in flight which expects
+ *          their keyword, or to the oldest command without keyword if
+ *          nobody expects them.
+ *
+ * @param conn Current connection data
+ *
+ * @return E_OK on success, E_SOCK otherwise
+ */
+static int imap_read_response(connection_data_t *conn)
+{
+    imap_command_t *cmd = NULL;
+    imap_command_t *fallback = NULL;
+    std::string keyword;
+    std::string line;
+    unsigned long tag;
+    char *ptr;
+    int rc;
+
+    rc = imap_read_line(conn, line);
+    if(rc != E_OK)
+        return rc;
+
+    if(line.compare(0, 2, "* ") == 0) {
+        keyword = imap_untagged_keyword(line);
+        for(auto &it : conn->pending) {
+            if(it.second.done)
+                continue;
+            if(it.second.keyword == keyword) {
+                cmd = &it.second;
+                break;
+            }
+            if(fallback == NULL && it.second.keyword.empty())
+                fallback = &it.second;
+        }
+
+        if(cmd == NULL)
+            cmd = fallback;
+
+        if(cmd == NULL || !cmd->handler)
+            return imap_read_untagged(conn, line,
+                                     (cmd) ? &cmd->response : NULL);
+
+        rc = cmd->handler(conn, line);
+        if(rc == E_SOCK)
+            return rc;
+        if(rc != E_OK && cmd->ec == E_OK)
+            cmd->ec = rc;
+
+        return E_OK;
     }
 
+    // Continuation requests are not expected, commands are sent whole
+    if(line.compare(0, 2, "+ ") == 0)
+        return E_OK;
+
+    tag = strtoul(line.c_str(), &ptr, 10);
+    auto it = conn->pending.find(tag);
+    if(ptr == line.c_str() || *ptr != ' ' || it == conn->pending.end()) {
+        std::cerr << "Unexpected server response: " << line;
+        return E_OK;
+    }
+
+    it->second.status = line;
+    it->second.done = true;
+
     return E_OK;
 }
 
-int imap_exec_command(connection_data_t *conn, const std::string &command,
-                        unsigned int req_id, std::string *response)
+int imap_send(connection_data_t *conn, const std::string &command,
+              unsigned int *tag, const std::string &keyword,
+              imap_handler_t handler)
 {
-    std::string resp;
-    char buf[512] = { 0, };
+    unsigned int req_id = conn->cnt++;
+    std::string req = std::to_string(req_id) + " " + command + "\r\n";
+    imap_command_t &cmd = conn->pending[req_id];
     int rc;
 
-    rc = socket_write(conn, (char*)command.c_str(), command.size());
+    cmd.keyword = keyword;
+    cmd.handler = handler;
+
+    rc = socket_write(conn, (char*)req.c_str(), req.size());
     if(rc <= 0) {
         perror("socket_write() failed");
+        conn->pending.erase(req_id);
         return E_SOCK;
     }
 
-    while((rc = socket_read(conn, buf, 512)) > 0) {
-        resp.append(buf, rc);
-        if(resp.find_first_of("\r\n") != std::string::npos)
-            break;
-    }
+    *tag = req_id;
 
-    if(rc < 0) {
-        perror("socket_read() failed");
-        return E_SOCK;
+    return E_OK;
+}
+
+int imap_wait(connection_data_t *conn, unsigned int tag, std::string *response)
+{
+    auto it = conn->pending.find(tag);
+    int rc = E_OK;
+
+    if(it == conn->pending.end())
+        return E_CMD;
+
+    while(!it->second.done) {
+        rc = imap_read_response(conn);
+        if(rc != E_OK)
+            return rc;
     }
 
     if(response != NULL)
-        *response = resp;
+        *response = it->second.response + it->second.status;
+
+    if(imap_status_check(tag, it->second.status) != E_OK)
+        rc = E_CMD;
+    else
+        rc = it->second.ec;
+
+    conn->pending.erase(it);
+
+    return rc;
+}
+
+int imap_exec_command(connection_data_t *conn, const std::string &command,
+                      std::string *response)
+{
+    unsigned int tag;
+    int rc;
+
+    rc = imap_send(conn, command, &tag);
+    if(rc != E_OK)
+        return rc;
+
+    return imap_wait(conn, tag, response);
+}
+
+int imap_idle(connection_data_t *conn, int timeout, bool *exists)
+{
+    unsigned int tag;
+    int rc;
+    std::string done = "DONE\r\n";
+    time_t end = time(NULL) + timeout;
+
+    *exists = false;
+
+    // Only new mail is interesting, other changes don't matter
+    rc = imap_send(conn, "IDLE", &tag, "EXISTS",
+                   [&](connection_data_t *conn, std::string &line) {
+                       sscanf(line.c_str(), "* %d EXISTS", &conn->mail_count);
+                       *exists = true;
+                       return imap_read_untagged(conn, line, NULL);
+                   });
+    if(rc != E_OK)
+        return rc;
+
+    auto it = conn->pending.find(tag);
+
+    // Server which doesn't support IDLE completes it right away
+    while(!*exists && !it->second.done && time(NULL) < end) {
+        rc = socket_wait(conn, (end - time(NULL)) * 1000);
+        if(rc < 0) {
+            perror("poll() failed");
+            conn->pending.erase(it);
+            return E_SOCK;
+        }
+        if(rc == 0)
+            break;
+
+        rc = imap_read_response(conn);
+        if(rc != E_OK) {
+            conn->pending.erase(it);
+            return rc;
+        }
+    }
+
+    if(!it->second.done) {
+        rc = socket_write(conn, (char*)done.c_str(), done.size());
+        if(rc <= 0) {
+            perror("socket_write() failed");
+            conn->pending.erase(it);
+            return E_SOCK;
+        }
+    }
 
-    return imap_status_check(req_id, resp);
+    return imap_wait(conn, tag);
 }
 
 int imap_status_check(unsigned int req_id, std::string &response)
@@ -145,27 +461,85 @@ int imap_status_check(unsigned int req_id, std::string &response)
     return E_CMD;
 }
 
+/**
+ * @brief Start compression if the server supports it (RFC 4978)
+ *
+ * @param conn Current connection data, user is logged in
+ * @param capability Response with capabilities, if it is empty, server is
+ *                   asked for them
+ *
+ * @return E_OK on success or if compression isn't supported, E_SOCK, E_SETUP
+ *         or E_CMD on error
+ */
+static int imap_compress(connection_data_t *conn, std::string &capability)
+{
+    int rc;
+
+    if(capability.find("CAPABILITY") == std::string::npos &&
+       imap_exec_command(conn, "CAPABILITY", &capability) != E_OK)
+        return E_CMD;
+
+    if(capability.find(" COMPRESS=DEFLATE") == std::string::npos)
+        return E_OK;
+
+    // Server may refuse it (e.g. TLS compression is active), that's fine
+    rc = imap_exec_command(conn, "COMPRESS DEFLATE");
+    if(rc == E_CMD)
+        return E_OK;
+    if(rc != E_OK)
+        return rc;
+
+    // Anything the server sent after the response is already compressed
+    return socket_compress(conn);
+}
+
+int imap_login(connection_data_t *conn, const std::string &user,
+                const std::string &pass)
+{
+    std::string response;
+
+    if(imap_exec_command(conn, "LOGIN " + user + " " + pass,
+                         &response) != E_OK){
+        return E_CMD;
+    }
+
+    if(imap_compress(conn, response) != E_OK) {
+        std::cerr << "Couldn't enable compression" << std::endl;
+        return E_CMD;
+    }
+
+    return E_OK;
+}
+
 int imap_select_mailbox(connection_data_t *conn, const std::string &mailbox)
 {
-    unsigned int req_id = conn->cnt++;
     std::stringstream ss;
     std::string response;
     std::string line;
-    std::string req;
     int mail_count = -1;
+    int count;
+    int end;
 
-    ss << req_id << " SELECT " << mailbox << "\r\n";
-    req = ss.str();
-
-    if(imap_exec_command(conn, req, req_id, &response) != E_OK){
+    if(imap_exec_command(conn, "SELECT " + mailbox, &response) != E_OK){
         return E_CMD;
     }
 
-    ss.clear();
+    conn->uidvalidity = 0;
+    conn->uidnext = 0;
+
     ss.str(response);
     while(std::getline(ss, line)) {
-        if(sscanf(line.c_str(), "* %d EXISTS", &mail_count) == 1)
-            break;
+        // Other responses start with a number too (e.g. "* 0 RECENT")
+        end = 0;
+        if(sscanf(line.c_str(), "* %d EXISTS%n", &count, &end) == 1 &&
+           end > 0) {
+            mail_count = count;
+            continue;
+        }
+        if(sscanf(line.c_str(), "* OK [UIDVALIDITY %lu]",
+                  &conn->uidvalidity) == 1)
+            continue;
+        sscanf(line.c_str(), "* OK [UIDNEXT %lu]", &conn->uidnext);
     }
 
     if(mail_count == -1) {
@@ -178,151 +552,247 @@ int imap_select_mailbox(connection_data_t *conn, const std::string &mailbox)
     return E_OK;
 }
 
-int imap_download_mail(connection_data_t *conn, int mail_id,
-                        const std::string &dir, bool header_only)
+/**
+ * @brief Get UID from data items of a FETCH response
+ *
+ * @param items Data items without literals
+ *
+ * @return UID, 0 if there is none
+ */
+static unsigned long imap_fetch_uid(const std::string &items)
 {
-    bool end_of_body = false;
-    unsigned int req_id = conn->cnt++;
-    int rc;
-    int to_read = 0;
-    int mail_size = 0;
-    const int buf_size = 512;
-    char buf[buf_size] = { 0, };
-    std::stringstream os;
-    std::string req;
-    std::string response;
-    std::string body;
-    std::string line;
-    std::string filename;
-    std::ofstream out;
+    size_t pos = 0;
 
-    req_id = conn->cnt++;
-    os << req_id << " FETCH " << mail_id
-       << ((header_only) ? " BODY[HEADER]" : " BODY[]") << "\r\n";
-    req = os.str();
-
-    rc = socket_write(conn, (char*)req.c_str(), req.size());
-    if(rc <= 0) {
-        perror("socket_write() failed");
-        return E_SOCK;
+    while((pos = items.find("UID ", pos)) != std::string::npos) {
+        if(pos > 0 && (items[pos - 1] == '(' || items[pos - 1] == ' '))
+            return strtoul(items.c_str() + pos + 4, NULL, 10);
+        pos += 4;
     }
 
-    // Get mail size
-    while((rc = socket_read(conn, buf, 1)) > 0) {
-        response.append(buf, rc);
-        if(response.find("\r\n") != std::string::npos) {
-            if(sscanf(response.c_str(), "* %*[0-9] FETCH %*[^{] {%d}",
-                        &mail_size) != 1) {
-                std::cerr << "Couldn't get mail size" << std::endl;
-                return E_CMD;
-            }
+    return 0;
+}
 
-            break;
+/**
+ * @brief Process one untagged FETCH response and store the mail it carries
+ * @details The response is always read whole, even if the mail can't be
+ *          stored, so the following responses can still be processed.
+ *          Mail is collected in memory and handed over to the writer when
+ *          the response ends, UID may come after the body. Responses
+ *          without a BODY[...] literal are ignored.
+ *
+ * @param conn Current connection data
+ * @param line First line of the response
+ * @param fetch Download parameters, results are updated
+ *
+ * @return E_OK on success, EC from ec enum otherwise
+ */
+static int imap_store_fetched(connection_data_t *conn, std::string &line,
+                              fetch_data_t *fetch)
+{
+    int rc;
+    int mail_id;
+    long size;
+    unsigned long uid;
+    bool stored = false;
+    std::string items = line;
+    mail_t mail;
+
+    if(sscanf(line.c_str(), "* %d FETCH", &mail_id) != 1) {
+        std::cerr << "Invalid FETCH response" << std::endl;
+        return imap_read_untagged(conn, line, NULL) == E_OK ? E_CMD : E_SOCK;
+    }
+
+    // Data items may be split by literals, the response continues by
+    // another line after each of them
+    while((size = imap_literal_size(line)) >= 0) {
+        std::string *dst = NULL;
+
+        // Message itself is the literal of BODY[...] item, others are skipped
+        if(imap_is_body_literal(line)) {
+            // Size comes from the server, the buffer grows with the data
+            // beyond a sane limit
+            mail.data.clear();
+            mail.data.reserve(std::min(size, (long)WRITER_QUEUE_SIZE));
+            dst = &mail.data;
+            stored = true;
         }
+
+        rc = imap_read_literal(conn, size, dst);
+        if(rc == E_OK)
+            rc = imap_read_line(conn, line);
+        if(rc != E_OK)
+            return rc;
+
+        items += line;
     }
 
-    if(mail_size <= 0) {
-        std::cerr << "Invalid mail size" << std::endl;
+    if(line.find(')') == std::string::npos) {
+        std::cerr << "Incomplete response" << std::endl;
         return E_CMD;
     }
 
-    // Read mail content (header + body, if requested)
-    to_read = (mail_size < buf_size) ? mail_size : buf_size;
-    while((rc = socket_read(conn, buf, to_read)) > 0) {
-        body.append(buf, rc);
-        mail_size -= rc;
-        to_read = (mail_size < buf_size) ? mail_size : buf_size;
-    }
+    // Server may send FETCH responses on its own, e.g. with changed FLAGS
+    // of a mail marked as seen by the download, there's no mail to store
+    if(!stored)
+        return E_OK;
 
-    // Read mail terminator (right parenthesis) to make sure, we got everything
-    // Also, read the command status message
-    response.clear();
-    while((rc = socket_read(conn, buf, 1)) > 0) {
-        response.append(buf, rc);
-        if(response.find("\r\n") != std::string::npos) {
-            if(!end_of_body) {
-                if(response.find(")") == std::string::npos) {
-                    std::cerr << "Incomplete response" << std::endl;
-                    return E_CMD;
-                }
-                response.clear();
-                end_of_body = true;
-            } else {
-                break;
-            }
+    if(fetch->uid_names || fetch->index) {
+        uid = imap_fetch_uid(items);
+        if(uid == 0 || uid > UINT32_MAX) {
+            std::cerr << "Missing UID of mail " << mail_id << std::endl;
+            return E_CMD;
         }
-    }
-
-    if(rc < 0) {
-        perror("socket_read() failed");
-        return E_SOCK;
-    }
 
-    if(imap_status_check(req_id, response) != E_OK) {
-        std::cerr << "Couldn't download mail body" << std::endl;
-        return E_CMD;
+        mail.uid = uid;
     }
 
-    filename = "mail-" + std::to_string(mail_id);
-    out.open(dir + filename);
-    if(!out.is_open()) {
-        std::cerr << "Couldn't open file " << (dir + filename) << std::endl;
-        return E_CMD;
+    if(fetch->uid_names) {
+        mail.name = "mail-" + std::to_string(uid);
+        fetch->uids.push_back(uid);
+    } else {
+        mail.name = "mail-" + std::to_string(mail_id);
     }
 
-    out << body;
-    out.close();
+    fetch->writer->push(mail);
+    fetch->fetched++;
 
     return E_OK;
 }
 
-int imap_download_all(connection_data_t *conn, const config_data_t *config)
+int imap_fetch_mail(connection_data_t *conn, const imap_set_source_t &next_set,
+                    bool uid, fetch_data_t *fetch)
 {
+    std::deque<unsigned int> tags;
+    std::string command;
+    std::string items;
+    std::string set;
+    bool more = true;
     int ec = E_OK;
-
-    if(conn->mail_count == -1) {
-        std::cerr << "Invalid/uninitialized mail count" << std::endl;
+    int rc = E_OK;
+    unsigned int tag;
+    MailWriter own(fetch->dir);
+
+    if(fetch->writer == NULL) {
+        if(own.start() != E_OK)
+            return E_DOWNLOAD;
+        fetch->writer = &own;
     }
 
-    // First UID: 1
-    for(int i = 1; i <= conn->mail_count; i++) {
-        if(imap_download_mail(conn, i, config->out_dir, config->header_only)
-                != E_OK) {
-            std::cerr << "ERROR: Download failed" << std::endl;
+    command = (uid) ? "UID FETCH " : "FETCH ";
+    items = std::string((fetch->peek) ? "BODY.PEEK" : "BODY");
+    if(fetch->index)
+        items += "[HEADER.FIELDS (" WRITER_INDEX_FIELDS ")]";
+    else if(fetch->header_only)
+        items += "[HEADER]";
+    else
+        items += "[]";
+
+    // Index rows are identified by UIDs
+    if(fetch->uid_names || fetch->index)
+        items = "(UID " + items + ")";
+
+    // Mails are stored one by one as their responses arrive, responses
+    // without any literal (e.g. FLAGS updates) are complete and carry none
+    auto handler = [&](connection_data_t *conn, std::string &line) {
+        if(imap_literal_size(line) < 0)
+            return (int)E_OK;
+        return imap_store_fetched(conn, line, fetch);
+    };
+
+    // Next sets are requested before the previous ones are done, so the
+    // server always has some work
+    while(more || !tags.empty()) {
+        if(more && tags.size() < IMAP_PIPELINE) {
+            more = next_set(set);
+            if(!more)
+                continue;
+
+            rc = imap_send(conn, command + set + " " + items, &tag, "FETCH",
+                           handler);
+            if(rc != E_OK)
+                break;
+            tags.push_back(tag);
+            continue;
+        }
+
+        rc = imap_wait(conn, tags.front());
+        if(rc == E_SOCK)
+            break;
+        tags.pop_front();
+        if(rc != E_OK) {
+            std::cerr << "Couldn't download mail body" << std::endl;
             ec = E_DOWNLOAD;
         }
     }
 
-    if(ec == E_OK)
-        std::cerr << "Downloaded " << conn->mail_count
-                  << ((config->header_only) ? " message headers" :
-                    " messages") << " from mailbox " << config->mailbox
-                  << std::endl;
+    // Handlers of unfinished commands can't outlive this function
+    for(unsigned int t : tags)
+        conn->pending.erase(t);
 
-    return ec;
+    if(fetch->writer == &own) {
+        if(own.finish() != E_OK)
+            ec = E_DOWNLOAD;
+        fetch->writer = NULL;
+    }
+
+    return (rc == E_SOCK) ? rc : ec;
 }
 
-int imap_download_new(connection_data_t *conn, const config_data_t *config)
+int imap_fetch_mail(connection_data_t *conn,
+                    const std::vector<std::string> &sets, fetch_data_t *fetch)
+{
+    size_t next = 0;
+
+    return imap_fetch_mail(conn, [&](std::string &set) {
+                               if(next == sets.size())
+                                   return false;
+                               set = sets[next++];
+                               return true;
+                           }, false, fetch);
+}
+
+std::string imap_make_set(const std::vector<unsigned int> &ids, size_t first,
+                          size_t last)
+{
+    std::string set;
+    size_t i = first;
+
+    // Runs of consecutive numbers are joined into ranges
+    while(i < last) {
+        size_t j = i;
+        while(j + 1 < last && ids[j + 1] == ids[j] + 1)
+            j++;
+
+        if(!set.empty())
+            set += ",";
+        set += std::to_string(ids[i]);
+        if(j > i)
+            set += ":" + std::to_string(ids[j]);
+
+        i = j + 1;
+    }
+
+    return set;
+}
+
+int imap_search(connection_data_t *conn, const std::string &criteria,
+                bool uid, std::vector<unsigned int> &ids)
 {
     int ec = E_CMD;
-    int mail_id;
-    int mail_count = 0;
-    unsigned int req_id = conn->cnt++;
+    unsigned long id;
+    char *ptr;
     std::stringstream ss;
     std::string search_tag = "* SEARCH";
-    std::string req;
     std::string response;
     std::string line;
     std::string item;
 
-    ss << req_id << " SEARCH UNSEEN" << "\r\n";
-    req = ss.str();
-
-    if(imap_exec_command(conn, req, req_id, &response) != E_OK){
+    if(imap_exec_command(conn, ((uid) ? "UID SEARCH " : "SEARCH ") + criteria,
+                         &response) != E_OK){
         return E_CMD;
     }
 
-    ss.clear();
+    ids.clear();
     ss.str(response);
     while(std::getline(ss, line)) {
         if(line.compare(0, search_tag.size(), search_tag) == 0) {
@@ -331,22 +801,14 @@ int imap_download_new(connection_data_t *conn, const config_data_t *config)
             ss.str(line);
             // Skip the search tag
             ss >> item >> item;
-            // Parse mail UIDs
+            // Parse mail IDs
             while(ss >> item) {
-                try {
-                    mail_id = std::stoi(item);
-                } catch(std::exception &e) {
+                id = strtoul(item.c_str(), &ptr, 10);
+                if(*ptr != '\0' || id == 0 || id > UINT32_MAX) {
                     std::cerr << "Invalid mail ID: " << item << std::endl;
                     return E_CMD;
                 }
-
-                if(imap_download_mail(conn, mail_id, config->out_dir,
-                            config->header_only) != E_OK) {
-                    std::cerr << "ERROR: Download failed" << std::endl;
-                    ec = E_DOWNLOAD;
-                }
-
-                mail_count++;
+                ids.push_back(id);
             }
 
             break;
@@ -355,8 +817,88 @@ int imap_download_new(connection_data_t *conn, const config_data_t *config)
 
     if(ec != E_OK) {
         std::cerr << "Incorrect server's response" << std::endl;
-    } else {
-        std::cerr << "Downloaded " << mail_count
+        return ec;
+    }
+
+    std::sort(ids.begin(), ids.end());
+
+    return E_OK;
+}
+
+int imap_download_all(connection_data_t *conn, const config_data_t *config)
+{
+    int ec = E_OK;
+    int last;
+    fetch_data_t fetch;
+    std::vector<std::string> sets;
+    MailWriter writer(config);
+
+    if(conn->mail_count == -1) {
+        std::cerr << "Invalid/uninitialized mail count" << std::endl;
+    }
+
+    // Sequence numbers start at 1, messages are requested in batches
+    for(int i = 1; i <= conn->mail_count; i += IMAP_FETCH_BATCH) {
+        last = std::min(i + IMAP_FETCH_BATCH - 1, conn->mail_count);
+        sets.push_back(std::to_string(i) + ":" + std::to_string(last));
+    }
+
+    fetch.dir = config->out_dir;
+    fetch.header_only = config->header_only;
+    fetch.index = config->index;
+    fetch.writer = &writer;
+
+    if(writer.start() != E_OK)
+        return E_FILE;
+
+    if(imap_fetch_mail(conn, sets, &fetch) != E_OK ||
+       writer.finish() != E_OK) {
+        std::cerr << "ERROR: Download failed" << std::endl;
+        ec = E_DOWNLOAD;
+    }
+
+    if(ec == E_OK)
+        std::cerr << "Downloaded " << fetch.fetched
+                  << ((config->header_only) ? " message headers" :
+                    " messages") << " from mailbox " << config->mailbox
+                  << std::endl;
+
+    return ec;
+}
+
+int imap_download_new(connection_data_t *conn, const config_data_t *config)
+{
+    int ec = E_OK;
+    fetch_data_t fetch;
+    std::vector<unsigned int> ids;
+    std::vector<std::string> sets;
+    MailWriter writer(config);
+
+    if(imap_search(conn, "UNSEEN", false, ids) != E_OK)
+        return E_CMD;
+
+    // Fetching the bodies marks new mails as seen, as the single FETCH did
+    for(size_t i = 0; i < ids.size(); i += IMAP_FETCH_BATCH)
+        sets.push_back(imap_make_set(ids, i,
+                       std::min(i + IMAP_FETCH_BATCH, ids.size())));
+
+    fetch.dir = config->out_dir;
+    fetch.header_only = config->header_only;
+    fetch.index = config->index;
+    fetch.peek = config->index;
+    fetch.writer = &writer;
+
+    if(writer.start() != E_OK)
+        return E_FILE;
+
+    if(imap_fetch_mail(conn, sets, &fetch) != E_OK ||
+       writer.finish() != E_OK) {
+        std::cerr << "ERROR: Download failed" << std::endl;
+        ec = E_DOWNLOAD;
+    }
+
+    if(ec == E_OK) {
+        std::cerr << "Downloaded " << fetch.fetched
                   << ((config->header_only) ? " new message headers" :
                     " new messages") << " from mailbox " << config->mailbox
                   << std::endl;
@@ -2,11 +2,21 @@
 #define __IMAP_H_INCLUDED
 
 #include <string>
+#include <vector>
 #include "utils.hpp"
 
+class MailWriter;
+
 #define IMAP_PORT  143
 #define IMAPS_PORT 993
 
+// Number of messages requested by one FETCH command
+#define IMAP_FETCH_BATCH 1000
+// Number of FETCH commands in flight
+#define IMAP_PIPELINE 4
+// Longest IDLE command in seconds, server may log out after 30 minutes
+#define IMAP_IDLE_TIMEOUT (29 * 60)
+
 /**
  * @brief Connect to an IMAP server
  *
@@ -19,6 +29,8 @@ int imap_connect(const config_data_t *config, connection_data_t *conn);
 
 /**
  * @brief Execute LOGIN command on an IMAP server
+ * @details When the server supports COMPRESS=DEFLATE, the rest of the
+ *          session is compressed
  *
  * @param conn Current connection data
  * @param user Username to login with
@@ -29,18 +41,66 @@ int imap_connect(const config_data_t *config, connection_data_t *conn);
 int imap_login(connection_data_t *conn, const std::string &user,
                 const std::string &pass);
 
+/**
+ * @brief Send a command to an IMAP server without waiting for its response
+ * @details More commands may be in flight at once, their responses are
+ *          routed by tags. Untagged responses with given keyword are routed
+ *          to the oldest command in flight which expects them.
+ *
+ * @param conn Current connection data
+ * @param command Command without tag and CRLF
+ * @param tag Destination for the tag of the command
+ * @param keyword Keyword of expected untagged responses (e.g. "FETCH"),
+ *                empty to take any responses nobody else expects
+ * @param handler If set, it processes the untagged responses, they are
+ *                collected for imap_wait() otherwise
+ *
+ * @return E_OK on success, E_SOCK otherwise
+ */
+int imap_send(connection_data_t *conn, const std::string &command,
+              unsigned int *tag, const std::string &keyword = "",
+              imap_handler_t handler = nullptr);
+
+/**
+ * @brief Wait for completion of a command sent by imap_send()
+ * @details Responses of other commands which arrive meanwhile are routed
+ *          to them
+ *
+ * @param conn Current connection data
+ * @param tag Tag of the command
+ * @param response If not NULL, it will contain collected untagged responses
+ *                 followed by the tagged one
+ *
+ * @return E_OK on success, E_SOCK on connection error, E_CMD if the command
+ *         failed, error of the response handler otherwise
+ */
+int imap_wait(connection_data_t *conn, unsigned int tag,
+              std::string *response = NULL);
+
 /**
  * @brief Execute given command on an IMAP server
  *
  * @param conn Current connection data
- * @param command Command to execute
- * @param req_id Request ID
+ * @param command Command without tag and CRLF
  * @param response If not NULL, it will contain server response
  *
  * @return E_OK on success, EC from ec enum otherwise
  */
 int imap_exec_command(connection_data_t *conn, const std::string &command,
-                        unsigned int req_id, std::string *response = NULL);
+                      std::string *response = NULL);
+
+/**
+ * @brief Wait for new mail in the active mailbox with the IDLE command
+ *
+ * @param conn Current connection data
+ * @param timeout Longest time to wait in seconds
+ * @param exists Set to true if the mailbox got new mail, the new mail count
+ *               is stored into the connection data then
+ *
+ * @return E_OK when new mail arrived or the timeout passed, E_CMD if the
+ *         server doesn't support IDLE, E_SOCK on connection error
+ */
+int imap_idle(connection_data_t *conn, int timeout, bool *exists);
 
 /**
  * @brief Check status of executed command
@@ -63,16 +123,75 @@ int imap_status_check(unsigned int req_id, std::string &response);
 int imap_select_mailbox(connection_data_t *conn, const std::string &mailbox);
 
 /**
- * @brief Download a mail with given UID from an IMAP server
+ * @brief Parameters and results of a mail download
+ */
+typedef struct {
+    std::string dir;            /**< Directory for downloaded mails */
+    bool header_only = false;   /**< Download only mail headers */
+    bool index = false;         /**< Download only fields of the index */
+    bool peek = true;           /**< Don't set the \\Seen flag of the mails */
+    bool uid_names = false;     /**< Name files by UIDs, not sequence numbers */
+    MailWriter *writer = NULL;  /**< Writer of the mails, shared by parallel
+                                     connections, NULL for a private one */
+    int fetched = 0;            /**< Number of stored mails */
+    std::vector<unsigned int> uids; /**< UIDs of stored mails (by UIDs only) */
+} fetch_data_t;
+
+/**
+ * @brief Source of message sets, it stores the next set into its argument
+ *        and returns false when there are no more sets
+ */
+typedef std::function<bool(std::string &)> imap_set_source_t;
+
+/**
+ * @brief Download all mails of given message sets, single FETCH per set
+ * @details Server responses are parsed as they arrive and every mail is
+ *          handed over to the writer as soon as its response is complete.
+ *          Up to IMAP_PIPELINE commands are in flight, so the sets don't
+ *          wait for round trips.
  *
- * @param conn Currecnt connection data
- * @param mail_id UID of requested mail
- * @param dir Directory where the downloaded mail will be stored in
+ * @param conn Current connection data
+ * @param next_set Source of message sets (e.g. "1:1000" or "3,5:7"), next
+ *                 set is taken when a FETCH command can be sent
+ * @param uid Sets contain UIDs instead of sequence numbers
+ * @param fetch Download parameters, results are added to it
  *
  * @return E_OK on success, EC from ec enum otherwise
  */
-int imap_download_mail(connection_data_t *conn, int mail_id,
-                        const std::string &dir, bool header_only = false);
+int imap_fetch_mail(connection_data_t *conn, const imap_set_source_t &next_set,
+                    bool uid, fetch_data_t *fetch);
+
+/**
+ * @brief Download all mails of given list of sequence number sets
+ * @see imap_fetch_mail()
+ */
+int imap_fetch_mail(connection_data_t *conn,
+                    const std::vector<std::string> &sets, fetch_data_t *fetch);
+
+/**
+ * @brief Make message set from a part of given sorted list of mail IDs
+ *
+ * @param ids Sorted mail IDs
+ * @param first Index of the first ID in the set
+ * @param last Index behind the last ID in the set
+ *
+ * @return Message set with consecutive IDs joined into ranges
+ */
+std::string imap_make_set(const std::vector<unsigned int> &ids, size_t first,
+                          size_t last);
+
+/**
+ * @brief Search mails in the active mailbox
+ *
+ * @param conn Current connection data
+ * @param criteria Search criteria (e.g. "UNSEEN")
+ * @param uid Search for UIDs instead of sequence numbers
+ * @param ids Destination for sorted IDs of found mails
+ *
+ * @return E_OK on success, E_CMD otherwise
+ */
+int imap_search(connection_data_t *conn, const std::string &criteria,
+                bool uid, std::vector<unsigned int> &ids);
 
 /**
  * @brief Download all mail according to the current configuration
@@ -8,6 +8,8 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include "imap.hpp"
+#include "parallel.hpp"
+#include "state.hpp"
 #include "tls.hpp"
 #include "utils.hpp"
 
@@ -42,7 +44,8 @@ int main(int argc, char *argv[])
 
     if(argc == 1) {
         cout << "Usage: " << argv[0] << " server [-p port] [-T [-c certfile] "
-             << "[-C certdir]] [-n] [-h] [-a auth_file] [-b MAILBOX] "
+             << "[-C certdir] [-k cachedir]] [-n] [-h] [-i] [-s] [-d] "
+             << "[-j jobs] [-m mbox] [-f fsync] [-a auth_file] [-b MAILBOX] "
              << "-o out_dir" << endl << endl
              << "  server\t\tserver IP/domain name" << endl
              << "  -p port\t\tserver port (default: " << IMAP_PORT << "/"
@@ -51,8 +54,22 @@ int main(int argc, char *argv[])
              << "  -c certfile\t\tfile with SSL/TLS certificate(s)" << endl
              << "  -C certdir\t\tdirectory with SSL/TLS certificates "
                 << "(default: /etc/ssl/certs)" << endl
+             << "  -k cachedir\t\tdirectory for TLS sessions and verified "
+                << "certificates" << endl
              << "  -n\t\t\tread only new/unread messages" << endl
              << "  -h\t\t\tdownload only email headers" << endl
+             << "  -i\t\t\twrite index of the headers to "
+                << "out_dir/MAILBOX.csv" << endl
+             << "  -s\t\t\tdownload only messages missing from previous "
+                << "runs" << endl
+             << "  -d\t\t\tstay connected and download new messages as "
+                << "they arrive (implies -s)" << endl
+             << "  -j jobs\t\tnumber of parallel connections (default: 1)"
+                << endl
+             << "  -m mbox\t\tappend messages to an mbox file instead of "
+                << "separate files" << endl
+             << "  -f fsync\t\tsync messages to the disk: none, mail (each "
+                << "one) or end (default: none)" << endl
              << "  -a auth_file\t\tfile with user credentials" << endl
              << "  -b MAILBOX\t\ttarget mailbox name (default: INBOX)" << endl
              << "  -o out_dir\t\toutput directory for downloaded messsages"
@@ -89,7 +106,13 @@ int main(int argc, char *argv[])
         goto end;
     }
 
-    if(config.new_only)
+    if(config.daemon)
+        rc = sync_daemon(&conn, &config, username, password);
+    else if(config.sync)
+        rc = sync_mailbox(&conn, &config, username, password);
+    else if(config.jobs > 1)
+        rc = parallel_download(&conn, &config, username, password);
+    else if(config.new_only)
         rc = imap_download_new(&conn, &config);
     else
         rc = imap_download_all(&conn, &config);
@@ -113,7 +136,7 @@ int parse_arguments(int argc, char *argv[], config_data_t *config)
 {
     int c;
 
-    while((c = getopt(argc, argv, ":a:b:c:C:hno:p:T")) != -1) {
+    while((c = getopt(argc, argv, ":a:b:c:C:df:hij:k:m:no:p:sT")) != -1) {
         switch(c) {
         case 'a':
             config->auth_file = optarg;
@@ -127,9 +150,54 @@ int parse_arguments(int argc, char *argv[], config_data_t *config)
         case 'C':
             config->cert_dir = optarg;
             break;
+        case 'd':
+            config->daemon = true;
+            config->sync = true;
+            break;
+        case 'f':
+            if(string(optarg) == "none") {
+                config->fsync = FSYNC_NONE;
+            } else if(string(optarg) == "mail") {
+                config->fsync = FSYNC_MAIL;
+            } else if(string(optarg) == "end") {
+                config->fsync = FSYNC_END;
+            } else {
+                cerr << "Invalid fsync policy: " << optarg << endl;
+                return E_PARAM;
+            }
+            break;
         case 'h':
             config->header_only = true;
             break;
+        case 'i':
+            config->index = true;
+            config->header_only = true;
+            break;
+        case 'j':
+            try {
+                char *ptr;
+                config->jobs = strtol(optarg, &ptr, 10);
+
+                if(ptr == nullptr || *ptr != '\0') {
+                    throw invalid_argument("not a number");
+                } else if(config->jobs < 1 || config->jobs > PARALLEL_MAX) {
+                    throw range_error("out of range");
+                }
+
+            } catch(const exception &e) {
+                cerr << "Invalid number of jobs: " << e.what() << endl;
+                return E_PARAM;
+            }
+            break;
+        case 'k':
+            config->tls_cache = optarg;
+            if(config->tls_cache.find_last_of("/") !=
+                    config->tls_cache.size() - 1)
+                config->tls_cache.append("/");
+            break;
+        case 'm':
+            config->archive = optarg;
+            break;
         case 'n':
             config->new_only = true;
             break;
@@ -154,6 +222,9 @@ int parse_arguments(int argc, char *argv[], config_data_t *config)
                 return E_PARAM;
             }
             break;
+        case 's':
+            config->sync = true;
+            break;
         case 'T':
             config->tls = true;
             break;
@@ -209,11 +280,18 @@ void dump_config(const config_data_t *config)
     cout << "TLS\t\t" << ((config->tls) ? "yes" : "no") << endl
          << "New only:\t" << ((config->new_only) ? "yes" : "no") << endl
          << "Header only:\t" << ((config->header_only) ? "yes" : "no") << endl
+         << "Index:\t\t" << ((config->index) ? "yes" : "no") << endl
+         << "Sync:\t\t" << ((config->sync) ? "yes" : "no") << endl
+         << "Daemon:\t\t" << ((config->daemon) ? "yes" : "no") << endl
          << "Port:\t\t" << config->port << endl
+         << "Jobs:\t\t" << config->jobs << endl
          << "Server addr:\t" << config->server_addr << endl
          << "Cert dir:\t" << config->cert_dir << endl
          << "Cert file:\t" << config->cert_file << endl
+         << "TLS cache:\t" << config->tls_cache << endl
          << "Auth file:\t" << config->auth_file << endl
          << "Mailbox:\t" << config->mailbox << endl
-         << "Out dir:\t" << config->out_dir << endl;
+         << "Out dir:\t" << config->out_dir << endl
+         << "Archive:\t" << config->archive << endl
+         << "Fsync:\t\t" << config->fsync << endl;
 }
@@ -0,0 +1,175 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
+
+#include "parallel.hpp"
+#include "imap.hpp"
+#include "tls.hpp"
+#include "writer.hpp"
+
+WorkQueue::WorkQueue(const std::vector<unsigned int> &uids, int workers)
+    : queues(workers)
+{
+    size_t chunk = uids.size() / (workers * PARALLEL_SPLIT);
+    size_t chunks;
+    size_t last;
+
+    chunk = std::max<size_t>(1, std::min<size_t>(chunk, IMAP_FETCH_BATCH));
+    chunks = (uids.size() + chunk - 1) / chunk;
+
+    for(size_t i = 0, c = 0; i < uids.size(); i += chunk, c++) {
+        last = std::min(i + chunk, uids.size());
+        queues[c * workers / chunks].push_back(imap_make_set(uids, i, last));
+    }
+}
+
+bool WorkQueue::take(int worker, std::string &set)
+{
+    std::lock_guard<std::mutex> lock(m);
+    std::deque<std::string> *q = &queues[worker];
+
+    if(!q->empty()) {
+        set = q->front();
+        q->pop_front();
+        return true;
+    }
+
+    // Steal from the end of the longest queue, far from where its owner is
+    q = &*std::max_element(queues.begin(), queues.end(),
+                           [](const std::deque<std::string> &a,
+                              const std::deque<std::string> &b) {
+                               return a.size() < b.size();
+                           });
+    if(q->empty())
+        return false;
+
+    set = q->back();
+    q->pop_back();
+    return true;
+}
+
+/**
+ * @brief Download mails taken from the queue over one connection
+ *
+ * @param queue Shared work queue
+ * @param id Index of the connection
+ * @param conn Ready connection, NULL to open a new one
+ * @param config Current configuration
+ * @param user Username to login with
+ * @param pass Password to login with
+ * @param fetch Download parameters and results of this connection
+ * @param ec Set to E_DOWNLOAD if some mails weren't downloaded
+ */
+static void parallel_worker(WorkQueue *queue, int id, connection_data_t *conn,
+                            const config_data_t *config,
+                            const std::string *user, const std::string *pass,
+                            fetch_data_t *fetch, int *ec)
+{
+    connection_data_t own;
+    int rc = E_OK;
+
+    if(conn == NULL) {
+        conn = &own;
+        rc = imap_connect(config, conn);
+        if(rc == E_OK)
+            rc = imap_login(conn, *user, *pass);
+        if(rc == E_OK)
+            rc = imap_select_mailbox(conn, config->mailbox);
+
+        // Mails of this connection will be stolen by the others
+        if(rc != E_OK)
+            std::cerr << "Connection " << id << " failed" << std::endl;
+    }
+
+    if(rc == E_OK) {
+        rc = imap_fetch_mail(conn, [&](std::string &set) {
+                                 return queue->take(id, set);
+                             }, true, fetch);
+        if(rc != E_OK)
+            *ec = E_DOWNLOAD;
+    }
+
+    if(conn == &own) {
+        if(own.tls)
+            tls_shutdown(own.tlsd);
+        if(own.sd >= 0)
+            close(own.sd);
+    }
+}
+
+int parallel_fetch(connection_data_t *conn, const config_data_t *config,
+                   const std::string &user, const std::string &pass,
+                   const std::vector<unsigned int> &uids, fetch_data_t *fetch)
+{
+    int ec = E_OK;
+    int fetched = fetch->fetched;
+    size_t known = fetch->uids.size();
+    std::vector<fetch_data_t> results(config->jobs, *fetch);
+    std::vector<int> errors(config->jobs, E_OK);
+    std::vector<std::thread> threads;
+    WorkQueue queue(uids, config->jobs);
+
+    for(int i = 1; i < config->jobs; i++)
+        threads.emplace_back(parallel_worker, &queue, i,
+                             (connection_data_t *)NULL, config, &user, &pass,
+                             &results[i], &errors[i]);
+
+    parallel_worker(&queue, 0, conn, config, &user, &pass, &results[0],
+                    &errors[0]);
+
+    for(auto &t : threads)
+        t.join();
+
+    for(int i = 0; i < config->jobs; i++) {
+        fetch->fetched += results[i].fetched - fetched;
+        fetch->uids.insert(fetch->uids.end(),
+                           results[i].uids.begin() + known,
+                           results[i].uids.end());
+        if(errors[i] != E_OK)
+            ec = E_DOWNLOAD;
+    }
+
+    // Sets of failed commands were not returned to the queue
+    if(fetch->fetched - fetched != (int)uids.size())
+        ec = E_DOWNLOAD;
+
+    return ec;
+}
+
+int parallel_download(connection_data_t *conn, const config_data_t *config,
+                      const std::string &user, const std::string &pass)
+{
+    int ec;
+    fetch_data_t fetch;
+    std::vector<unsigned int> uids;
+    MailWriter writer(config);
+
+    if(imap_search(conn, (config->new_only) ? "UNSEEN" : "ALL", true, uids)
+            != E_OK)
+        return E_CMD;
+
+    fetch.dir = config->out_dir;
+    fetch.header_only = config->header_only;
+    fetch.index = config->index;
+    fetch.peek = !config->new_only || config->index;
+    fetch.writer = &writer;
+
+    if(writer.start() != E_OK)
+        return E_FILE;
+
+    ec = parallel_fetch(conn, config, user, pass, uids, &fetch);
+    if(writer.finish() != E_OK)
+        ec = E_FILE;
+    if(ec != E_OK) {
+        std::cerr << "ERROR: Download failed" << std::endl;
+    } else {
+        std::cerr << "Downloaded " << fetch.fetched
+                  << ((config->new_only) ? " new" : "")
+                  << ((config->header_only) ? " message headers" :
+                    " messages") << " from mailbox " << config->mailbox
+                  << std::endl;
+    }
+
+    return ec;
+}
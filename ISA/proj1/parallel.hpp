@@ -0,0 +1,83 @@
+#ifndef __PARALLEL_H_INCLUDED
+#define __PARALLEL_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include "utils.hpp"
+#include "imap.hpp"
+
+// Largest number of parallel connections
+#define PARALLEL_MAX 16
+// Number of chunks every connection gets at the beginning
+#define PARALLEL_SPLIT 16
+
+/**
+ * @brief Work-stealing queue of UID sets
+ * @details Every connection has its own queue with a contiguous range of
+ *          UIDs and takes sets from its front. Connection with an empty
+ *          queue steals a set from the back of the longest queue, so slow
+ *          connections are relieved by the fast ones.
+ */
+class WorkQueue {
+public:
+    /**
+     * @brief Split given UIDs into sets for given number of connections
+     *
+     * @param uids Sorted UIDs
+     * @param workers Number of connections
+     */
+    WorkQueue(const std::vector<unsigned int> &uids, int workers);
+
+    /**
+     * @brief Take next set for given connection
+     *
+     * @param worker Index of the connection
+     * @param set Destination for the set
+     *
+     * @return false if there is no work left
+     */
+    bool take(int worker, std::string &set);
+
+private:
+    std::mutex m;
+    std::vector<std::deque<std::string>> queues;
+};
+
+/**
+ * @brief Download mails with given UIDs over multiple connections
+ * @details Given connection takes part in the download, config->jobs - 1
+ *          others are opened, logged in and switched to the same mailbox.
+ *          Every mail is downloaded by a single connection only, into its
+ *          own file.
+ *
+ * @param conn Connection with selected mailbox
+ * @param config Current configuration
+ * @param user Username to login with
+ * @param pass Password to login with
+ * @param uids Sorted UIDs of the mails
+ * @param fetch Download parameters, results of all connections are added
+ *              to it
+ *
+ * @return E_OK on success, E_DOWNLOAD otherwise
+ */
+int parallel_fetch(connection_data_t *conn, const config_data_t *config,
+                   const std::string &user, const std::string &pass,
+                   const std::vector<unsigned int> &uids, fetch_data_t *fetch);
+
+/**
+ * @brief Download mail of the selected mailbox over multiple connections
+ * @details Mails are requested by UIDs, @see parallel_fetch()
+ *
+ * @param conn Connection with selected mailbox
+ * @param config Current configuration
+ * @param user Username to login with
+ * @param pass Password to login with
+ *
+ * @return E_OK on success, EC from ec enum otherwise
+ */
+int parallel_download(connection_data_t *conn, const config_data_t *config,
+                      const std::string &user, const std::string &pass);
+
+#endif
@@ -0,0 +1,291 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+
+#include "state.hpp"
+#include "imap.hpp"
+#include "parallel.hpp"
+#include "writer.hpp"
+
+std::string state_file(const config_data_t *config)
+{
+    std::string mode;
+
+    // Each kind of download has its own set of downloaded mails
+    if(config->index)
+        mode = ".index";
+    else if(config->header_only)
+        mode = ".headers";
+
+    return config->out_dir + ".imapcl-" + mailbox_file_name(config->mailbox) +
+           mode + ".state";
+}
+
+/**
+ * @brief Parse set of UIDs
+ *
+ * @param set Set of UIDs, e.g. "1:3,7"
+ * @param uids Destination for the UIDs
+ *
+ * @return true on success
+ */
+static bool state_parse_set(const std::string &set,
+                            std::vector<unsigned int> &uids)
+{
+    std::istringstream iss(set);
+    std::string item;
+    unsigned long first;
+    unsigned long last;
+    char *ptr;
+
+    while(std::getline(iss, item, ',')) {
+        first = strtoul(item.c_str(), &ptr, 10);
+        last = first;
+        if(*ptr == ':')
+            last = strtoul(ptr + 1, &ptr, 10);
+
+        if(*ptr != '\0' || first == 0 || last < first || last > UINT32_MAX)
+            return false;
+
+        for(unsigned long uid = first; uid <= last; uid++)
+            uids.push_back(uid);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Make set of UIDs which are not in given sorted list
+ * @details The set ends with all UIDs above the last one, e.g. "1:2,5:*"
+ *          for UIDs 3 and 4
+ *
+ * @param uids Sorted UIDs
+ *
+ * @return Set of the remaining UIDs
+ */
+static std::string state_missing_set(const std::vector<unsigned int> &uids)
+{
+    std::string set;
+    unsigned long next = 1;
+
+    for(unsigned int uid : uids) {
+        if(uid > next) {
+            set += std::to_string(next);
+            if(uid - 1 > next)
+                set += ":" + std::to_string(uid - 1);
+            set += ",";
+        }
+        next = uid + 1UL;
+    }
+
+    if(next > UINT32_MAX) {
+        if(!set.empty())
+            set.pop_back();
+        return set;
+    }
+
+    return set + std::to_string(next) + ":*";
+}
+
+int state_load(const std::string &file, mailbox_state_t *state)
+{
+    std::ifstream in(file.c_str());
+    std::string key;
+    std::string value;
+    bool valid = true;
+
+    *state = mailbox_state_t();
+
+    // First run
+    if(!in.is_open())
+        return E_OK;
+
+    while(valid && in >> key) {
+        if(key == "UIDS") {
+            std::getline(in, value);
+            value.erase(0, value.find_first_not_of(' '));
+            valid = state_parse_set(value, state->uids);
+        } else if(key == "UIDVALIDITY") {
+            valid = !!(in >> state->uidvalidity);
+        } else if(key == "UIDNEXT") {
+            valid = !!(in >> state->uidnext);
+        } else {
+            valid = false;
+        }
+    }
+
+    if(!valid) {
+        std::cerr << "Invalid state file " << file << std::endl;
+        *state = mailbox_state_t();
+        return E_FILE;
+    }
+
+    std::sort(state->uids.begin(), state->uids.end());
+    state->uids.erase(std::unique(state->uids.begin(), state->uids.end()),
+                      state->uids.end());
+
+    return E_OK;
+}
+
+int state_save(const std::string &file, const mailbox_state_t *state)
+{
+    std::string tmp = file + ".tmp";
+    std::ofstream out(tmp.c_str());
+
+    if(!out.is_open()) {
+        std::cerr << "Couldn't open file " << tmp << std::endl;
+        return E_FILE;
+    }
+
+    out << "UIDVALIDITY " << state->uidvalidity << std::endl
+        << "UIDNEXT " << state->uidnext << std::endl
+        << "UIDS " << imap_make_set(state->uids, 0, state->uids.size())
+        << std::endl;
+    out.close();
+
+    if(out.fail() || rename(tmp.c_str(), file.c_str()) != 0) {
+        std::cerr << "Couldn't write file " << file << std::endl;
+        remove(tmp.c_str());
+        return E_FILE;
+    }
+
+    return E_OK;
+}
+
+int sync_mailbox(connection_data_t *conn, const config_data_t *config,
+                 const std::string &user, const std::string &pass)
+{
+    int ec = E_OK;
+    mailbox_state_t state;
+    fetch_data_t fetch;
+    std::string file = state_file(config);
+    std::string criteria;
+    std::string known;
+    std::string gaps;
+    std::vector<unsigned int> found;
+    std::vector<unsigned int> missing;
+    MailWriter writer(config);
+
+    if(conn->uidvalidity == 0) {
+        std::cerr << "Server doesn't report UIDVALIDITY" << std::endl;
+        return E_CMD;
+    }
+
+    // Broken state only costs a full download
+    state_load(file, &state);
+
+    if(state.uidvalidity != conn->uidvalidity) {
+        if(state.uidvalidity != 0)
+            std::cerr << "UIDVALIDITY of mailbox " << config->mailbox
+                      << " changed, downloading it again" << std::endl;
+        state = mailbox_state_t();
+        state.uidvalidity = conn->uidvalidity;
+        // Whole mailbox is written again, old rows would be duplicated
+        writer.rewrite_index();
+    }
+
+    fetch.dir = config->out_dir;
+    fetch.header_only = config->header_only;
+    fetch.index = config->index;
+    fetch.peek = !config->new_only || config->index;
+    fetch.uid_names = true;
+    fetch.writer = &writer;
+
+    // No mail was added since everything was downloaded
+    if(config->new_only || conn->uidnext == 0 ||
+       conn->uidnext != state.uidnext) {
+        criteria = (config->new_only) ? "UNSEEN" : "ALL";
+        if(state.uidnext != 0) {
+            // Everything older was downloaded, only new mail is searched
+            criteria += " UID " + std::to_string(state.uidnext) + ":*";
+        } else if(!state.uids.empty()) {
+            // Mails left out by a failed run are the gaps in the downloaded
+            // UIDs, unless they were expunged meanwhile
+            gaps = state_missing_set(state.uids);
+            known = imap_make_set(state.uids, 0, state.uids.size());
+            if(!gaps.empty() && gaps.size() <= STATE_SET_MAX)
+                criteria += " UID " + gaps;
+            else if(known.size() <= STATE_SET_MAX)
+                criteria += " NOT UID " + known;
+        }
+
+        if(imap_search(conn, criteria, true, found) != E_OK)
+            return E_CMD;
+
+        std::set_difference(found.begin(), found.end(), state.uids.begin(),
+                            state.uids.end(), std::back_inserter(missing));
+
+        if(writer.start() != E_OK)
+            return E_FILE;
+
+        ec = parallel_fetch(conn, config, user, pass, missing, &fetch);
+
+        // It isn't known which mails weren't written, they are all
+        // downloaded again next time
+        if(writer.finish() != E_OK) {
+            fetch.uids.clear();
+            ec = E_FILE;
+        }
+
+        state.uids.insert(state.uids.end(), fetch.uids.begin(),
+                          fetch.uids.end());
+        std::sort(state.uids.begin(), state.uids.end());
+        state.uidnext = (ec == E_OK && !config->new_only) ? conn->uidnext : 0;
+
+        if(state_save(file, &state) != E_OK && ec == E_OK)
+            ec = E_FILE;
+    }
+
+    if(ec != E_OK) {
+        std::cerr << "ERROR: Download failed" << std::endl;
+    } else {
+        std::cerr << "Downloaded " << fetch.fetched
+                  << ((config->new_only) ? " new" : "")
+                  << ((config->header_only) ? " message headers" :
+                    " messages") << " from mailbox " << config->mailbox
+                  << std::endl;
+    }
+
+    return ec;
+}
+
+int sync_daemon(connection_data_t *conn, const config_data_t *config,
+                const std::string &user, const std::string &pass)
+{
+    config_data_t single = *config;
+    bool exists;
+    int rc;
+
+    rc = sync_mailbox(conn, config, user, pass);
+    if(rc != E_OK && rc != E_DOWNLOAD)
+        return rc;
+
+    // New mail comes in small amounts, more connections would only cost
+    // more handshakes
+    single.jobs = 1;
+
+    while(true) {
+        rc = imap_idle(conn, IMAP_IDLE_TIMEOUT, &exists);
+        if(rc == E_CMD)
+            std::cerr << "Server doesn't support IDLE" << std::endl;
+        if(rc != E_OK)
+            return rc;
+
+        if(!exists)
+            continue;
+
+        // Selecting the mailbox again refreshes UIDNEXT and UIDVALIDITY
+        rc = imap_select_mailbox(conn, config->mailbox);
+        if(rc != E_OK)
+            return rc;
+
+        rc = sync_mailbox(conn, &single, user, pass);
+        if(rc != E_OK && rc != E_DOWNLOAD)
+            return rc;
+    }
+}
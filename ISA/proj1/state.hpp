@@ -0,0 +1,88 @@
+#ifndef __STATE_H_INCLUDED
+#define __STATE_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include "utils.hpp"
+
+// Longest UID set sent to the server in a SEARCH command
+#define STATE_SET_MAX 4096
+
+/**
+ * @brief Synchronization state of one mailbox
+ * @details Stored in the output directory as a text file:
+ *          UIDVALIDITY <uidvalidity>
+ *          UIDNEXT <uidnext>
+ *          UIDS <set of downloaded UIDs>
+ */
+typedef struct {
+    unsigned long uidvalidity = 0;  /**< UIDVALIDITY the UIDs belong to */
+    unsigned long uidnext = 0;      /**< UIDNEXT when everything older was
+                                         downloaded, 0 if unknown */
+    std::vector<unsigned int> uids; /**< Sorted UIDs of downloaded mails */
+} mailbox_state_t;
+
+/**
+ * @brief Get name of the state file for the current configuration
+ *
+ * @param config Current configuration
+ *
+ * @return Path of the state file in the output directory
+ */
+std::string state_file(const config_data_t *config);
+
+/**
+ * @brief Load mailbox state from given file
+ *
+ * @param file State file name, missing file means empty state
+ * @param state Destination for the state
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int state_load(const std::string &file, mailbox_state_t *state);
+
+/**
+ * @brief Save mailbox state into given file
+ * @details The file is replaced atomically
+ *
+ * @param file State file name
+ * @param state Mailbox state
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int state_save(const std::string &file, const mailbox_state_t *state);
+
+/**
+ * @brief Download mails of the selected mailbox which were not downloaded
+ *        by previous runs
+ * @details Mails are named by their UIDs. When UIDVALIDITY of the mailbox
+ *          changes, the whole mailbox is downloaded again.
+ *
+ * @param conn Connection with selected mailbox
+ * @param config Current configuration
+ * @param user Username to login with (for parallel connections)
+ * @param pass Password to login with (for parallel connections)
+ *
+ * @return E_OK on success, EC from ec enum otherwise
+ */
+int sync_mailbox(connection_data_t *conn, const config_data_t *config,
+                 const std::string &user, const std::string &pass);
+
+/**
+ * @brief Synchronize the selected mailbox and keep it synchronized
+ * @details After the first synchronization, the connection waits for new
+ *          mail with the IDLE command and every new mail is downloaded as
+ *          soon as the server reports it. The function returns only on
+ *          error.
+ *
+ * @param conn Connection with selected mailbox
+ * @param config Current configuration
+ * @param user Username to login with (for parallel connections)
+ * @param pass Password to login with (for parallel connections)
+ *
+ * @return EC from ec enum
+ */
+int sync_daemon(connection_data_t *conn, const config_data_t *config,
+                const std::string &user, const std::string &pass);
+
+#endif
@@ -0,0 +1,117 @@
+#!/bin/bash
+# Measure download throughput of imapcl against the local test server
+#
+# Usage: test/bench.sh [-n count] [-s size] [-l latency] [-r rate] [-z] [-T]
+#                      [-m] [-- imapcl options]
+#
+# Every mode (all, new only, headers only, header index) downloads the
+# mailbox into an empty directory (or an mbox file with -m), the result is
+# printed in messages/s and MB/s of the downloaded data.
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+IMAPCL="${IMAPCL:-$DIR/../imapcl}"
+# Unused port picked by the system, unless given
+PORT="${PORT:-$(python3 -c 'import socket; s = socket.socket()
+s.bind(("127.0.0.1", 0)); print(s.getsockname()[1])')}"
+COUNT=10000
+SIZE=4096
+SERVER=()
+CLIENT=()
+
+while getopts ":n:s:l:r:zTm" opt; do
+    case $opt in
+        n) COUNT="$OPTARG" ;;
+        s) SIZE="$OPTARG" ;;
+        l) SERVER+=(-l "$OPTARG") ;;
+        r) SERVER+=(-r "$OPTARG") ;;
+        z) SERVER+=(-z) ;;
+        T) TLS=1 ;;
+        m) MBOX=1 ;;
+        *) sed -n '3,4s/^# //p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+CLIENT+=("$@")
+
+if [ ! -x "$IMAPCL" ]; then
+    echo "$IMAPCL not found, run make first" >&2
+    exit 1
+fi
+
+TMP="$(mktemp -d)"
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$TMP"' EXIT
+
+# A tenth of the mailbox is unseen, -n downloads just that
+SERVER+=(-p "$PORT" -n "$COUNT" -s "$SIZE" -u $((COUNT / 10)))
+CLIENT+=(localhost -p "$PORT" -a "$DIR/auth.conf")
+if [ -n "$TLS" ]; then
+    SERVER+=(-T --cert "$TMP/imapd.pem")
+    CLIENT+=(-T -c "$TMP/imapd.pem")
+fi
+
+listening() {
+    (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null
+}
+
+# Someone else's server would be measured instead
+if listening; then
+    echo "Port $PORT is already in use" >&2
+    exit 1
+fi
+
+python3 "$DIR/imapd.py" "${SERVER[@]}" &
+SERVER_PID=$!
+
+# Certificate generation may take a while
+for i in $(seq 50); do
+    kill -0 $SERVER_PID 2>/dev/null && listening && break
+    sleep 0.1
+done
+
+if ! kill -0 $SERVER_PID 2>/dev/null || ! listening; then
+    echo "Test server failed to start" >&2
+    exit 1
+fi
+
+printf "%-8s %9s %9s %8s %10s %8s\n" mode messages MB seconds msgs/s MB/s
+
+for mode in all new header index; do
+    case $mode in
+        all)    opts=() ;;
+        new)    opts=(-n) ;;
+        header) opts=(-h) ;;
+        index)  opts=(-i) ;;
+    esac
+
+    out="$TMP/$mode"
+    mkdir "$out"
+    if [ -n "$MBOX" ] && [ $mode != index ]; then
+        opts+=(-m "$out/mbox")
+    fi
+
+    start=$(date +%s.%N)
+    if ! "$IMAPCL" "${CLIENT[@]}" "${opts[@]}" -o "$out" 2>"$TMP/log"; then
+        cat "$TMP/log" >&2
+        exit 1
+    fi
+    end=$(date +%s.%N)
+
+    # Sizes of mail files, of mails in the mbox or of index rows
+    if [ $mode = index ]; then
+        awk 'NR > 1 { print length($0) + 1 }' "$out"/*.csv
+    elif [ -n "$MBOX" ]; then
+        awk '/^From imapcl / { if(n++) print bytes; bytes = 0; next }
+             { bytes += length($0) + 1 }
+             END { if(n) print bytes }' "$out/mbox"
+    else
+        find "$out" -type f -printf '%s\n'
+    fi |
+        awk -v mode=$mode -v start="$start" -v end="$end" '
+            { n++; bytes += $1 }
+            END {
+                t = end - start
+                mb = bytes / 1e6
+                printf "%-8s %9d %9.1f %8.3f %10.0f %8.1f\n",
+                       mode, n, mb, t, n / t, mb / t
+            }'
+done
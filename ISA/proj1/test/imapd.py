@@ -0,0 +1,384 @@
+#!/usr/bin/env python3
+"""Small IMAP4rev1 server with synthetic mailboxes for testing imapcl.
+
+Every mailbox holds COUNT generated messages of SIZE bytes, the last UNSEEN
+of them are unseen. UIDs are UIDSTART, UIDSTART + 2, ... so they are not
+the same as sequence numbers. Flags are per connection, every client sees
+the mailbox in its initial state.
+
+Supported commands: CAPABILITY, LOGIN, SELECT, EXAMINE, SEARCH, FETCH (with
+UID variants), COMPRESS DEFLATE, IDLE, NOOP and LOGOUT. Only the parts of
+them which imapcl uses are implemented.
+"""
+
+import argparse
+import os
+import re
+import select
+import socketserver
+import ssl
+import subprocess
+import sys
+import threading
+import time
+import zlib
+
+args = None
+lock = threading.Lock()
+
+
+def message(i):
+    """Generate message number i."""
+    hdr = ("From: Sender %d <sender%d@example.org>\r\n"
+           "To: Recipient <rcpt@example.org>\r\n"
+           "Subject: Test message %d\r\n"
+           "Date: Mon, 1 Jan 2018 00:%02d:%02d +0000\r\n"
+           "Message-ID: <%d@example.org>\r\n\r\n"
+           % (i, i, i, i // 60 % 60, i % 60, i))
+    line = "Lorem ipsum dolor sit amet %d.\r\n" % i
+    body = (line * (args.size // len(line) + 1))[:max(args.size - len(hdr), 0)]
+    return (hdr + body).encode()
+
+
+def quote(s):
+    return b'"' + s.replace(b"\\", b"\\\\").replace(b'"', b'\\"') + b'"'
+
+
+def address(value):
+    """ENVELOPE address list of a "Name <mailbox@host>" header value."""
+    m = re.match(rb"\s*(?:(.*?)\s*)?<([^@>]*)@([^>]*)>", value)
+    if not m:
+        return b"NIL"
+    name = quote(m.group(1)) if m.group(1) else b"NIL"
+    return b"((" + name + b" NIL " + quote(m.group(2)) + b" " + \
+        quote(m.group(3)) + b"))"
+
+
+def envelope(hdr):
+    fields = {}
+    for l in hdr.split(b"\r\n"):
+        name, _, value = l.partition(b":")
+        fields[name.upper()] = value.strip()
+    get = lambda f: quote(fields[f]) if f in fields else b"NIL"
+    sender = address(fields.get(b"FROM", b""))
+    return b"(" + b" ".join([get(b"DATE"), get(b"SUBJECT"), sender, sender,
+                             sender, address(fields.get(b"TO", b"")),
+                             b"NIL NIL NIL", get(b"MESSAGE-ID")]) + b")"
+
+
+class Handler(socketserver.StreamRequestHandler):
+
+    def setup(self):
+        super().setup()
+        self.z = self.inflate = None
+        self.pending = b""
+        self.wire = 0
+        self.start = time.time()
+        self.count = args.count
+        self.mailbox = None
+        self.sets = {}
+        self.seen = set(range(1, args.count + 1 - args.unseen))
+
+    def log(self, text):
+        if args.verbose:
+            sys.stderr.write("%s:%d %s\n" % (self.client_address + (text,)))
+            sys.stderr.flush()
+
+    def send(self, data):
+        if isinstance(data, str):
+            data = data.encode()
+        if self.z:
+            data = self.z.compress(data) + self.z.flush(zlib.Z_SYNC_FLUSH)
+        self.wfile.write(data)
+        self.wire += len(data)
+        # Sleep whenever the data get ahead of the rate limit
+        if args.rate:
+            ahead = self.wire / (args.rate * 1024.0) - \
+                (time.time() - self.start)
+            if ahead > 0:
+                time.sleep(ahead)
+
+    def readline(self):
+        if not self.inflate:
+            return self.rfile.readline()
+        while b"\n" not in self.pending:
+            data = self.request.recv(65536)
+            if not data:
+                return b""
+            self.pending += self.inflate.decompress(data)
+        i = self.pending.index(b"\n") + 1
+        line, self.pending = self.pending[:i], self.pending[i:]
+        return line
+
+    def handle(self):
+        self.log("connected")
+        try:
+            self.session()
+        except (ConnectionError, ssl.SSLError) as e:
+            self.log("connection failed: %s" % e)
+        self.log("closed, %d bytes sent" % self.wire)
+
+    def session(self):
+        self.send("* OK imapd.py ready\r\n")
+        while True:
+            line = self.readline()
+            if not line:
+                return
+            if args.latency:
+                time.sleep(args.latency / 1000.0)
+            m = re.match(rb"(\S+) (UID )?(\S+) ?(.*?)\r?\n", line, re.I)
+            if not m:
+                self.send("* BAD invalid command\r\n")
+                continue
+            tag, uid, cmd, rest = m.group(1).decode(), bool(m.group(2)), \
+                m.group(3).decode().upper(), m.group(4).decode()
+            if cmd == "LOGOUT":
+                self.send("* BYE logging out\r\n%s OK LOGOUT completed\r\n"
+                          % tag)
+                return
+            getattr(self, "cmd_" + cmd.lower(), self.cmd_bad)(tag, uid, rest)
+
+    def cmd_bad(self, tag, uid, rest):
+        self.send("%s BAD unknown command\r\n" % tag)
+
+    def cmd_noop(self, tag, uid, rest):
+        self.send("%s OK NOOP completed\r\n" % tag)
+
+    def cmd_capability(self, tag, uid, rest):
+        self.send("* CAPABILITY IMAP4rev1 IDLE%s\r\n%s OK CAPABILITY "
+                  "completed\r\n" %
+                  (" COMPRESS=DEFLATE" if args.compress else "", tag))
+
+    def cmd_login(self, tag, uid, rest):
+        creds = rest.split()
+        if args.user and creds != [args.user, args.password]:
+            self.send("%s NO invalid credentials\r\n" % tag)
+        else:
+            self.send("%s OK LOGIN completed\r\n" % tag)
+
+    def cmd_select(self, tag, uid, rest):
+        name = rest.strip('"')
+        if name.upper() == "INBOX":
+            name = "INBOX"
+        if name not in args.mailboxes:
+            self.send("%s NO no such mailbox\r\n" % tag)
+            return
+        self.mailbox = name
+        self.send("* FLAGS (\\Seen)\r\n* %d EXISTS\r\n* 0 RECENT\r\n"
+                  "* OK [UIDVALIDITY %d] UIDs valid\r\n"
+                  "* OK [UIDNEXT %d] predicted next UID\r\n"
+                  "%s OK [READ-WRITE] SELECT completed\r\n"
+                  % (self.count, args.uidvalidity, self.uid(self.count + 1),
+                     tag))
+
+    cmd_examine = cmd_select
+
+    def cmd_compress(self, tag, uid, rest):
+        if not args.compress or self.z or rest.upper() != "DEFLATE":
+            self.send("%s NO compression not available\r\n" % tag)
+            return
+        self.send("%s OK DEFLATE active\r\n" % tag)
+        self.z = zlib.compressobj(6, zlib.DEFLATED, -15)
+        self.inflate = zlib.decompressobj(-15)
+
+    def uid(self, seq):
+        return args.uidstart + (seq - 1) * 2
+
+    def seq_of_uid(self, u):
+        if u < args.uidstart or (u - args.uidstart) % 2:
+            return None
+        s = (u - args.uidstart) // 2 + 1
+        return s if s <= self.count else None
+
+    def parse_list(self, s, uid):
+        """Sequence numbers of messages in a message set."""
+        top = self.uid(self.count) if uid else self.count
+        out = []
+        for part in s.split(","):
+            a, _, b = part.partition(":")
+            a = top if a == "*" else int(a)
+            b = a if not b else (top if b == "*" else int(b))
+            if a > b:
+                a, b = b, a
+            if uid:
+                out += [q for q in (self.seq_of_uid(u) for u in
+                        range(max(a, args.uidstart), b + 1)) if q]
+            else:
+                out += range(max(a, 1), min(b, self.count) + 1)
+        return out
+
+    def parse_set(self, s, uid):
+        key = (s, uid)
+        if key not in self.sets:
+            self.sets[key] = set(self.parse_list(s, uid))
+        return self.sets[key]
+
+    def match(self, keys, s):
+        key = keys.pop(0)
+        if key == "NOT":
+            return not self.match(keys, s)
+        if key == "UNSEEN":
+            return s not in self.seen
+        if key == "SEEN":
+            return s in self.seen
+        if key == "UID":
+            return s in self.parse_set(keys.pop(0), True)
+        return True
+
+    def cmd_search(self, tag, uid, rest):
+        if self.mailbox is None:
+            self.send("%s BAD no mailbox selected\r\n" % tag)
+            return
+        keys = rest.upper().split()
+        ids = []
+        for s in range(1, self.count + 1):
+            k = list(keys)
+            ok = True
+            while k and ok:
+                ok = self.match(k, s)
+            if ok:
+                ids.append(self.uid(s) if uid else s)
+        self.send("* SEARCH%s\r\n%s OK SEARCH completed\r\n" %
+                  ("".join(" %d" % i for i in ids), tag))
+
+    def cmd_fetch(self, tag, uid, rest):
+        if self.mailbox is None:
+            self.send("%s BAD no mailbox selected\r\n" % tag)
+            return
+        sset, _, items = rest.partition(" ")
+        items = items.strip("()").upper()
+        section = re.search(r"BODY(\.PEEK)?\[([^\]]*)\]", items)
+        for s in self.parse_list(sset, uid):
+            msg = message(s)
+            hdr = msg[:msg.index(b"\r\n\r\n") + 4]
+            parts = []
+            flags = False
+            if uid or re.search(r"\bUID\b", items):
+                parts.append(b"UID %d" % self.uid(s))
+            if "RFC822.SIZE" in items:
+                parts.append(b"RFC822.SIZE %d" % len(msg))
+            if "ENVELOPE" in items:
+                parts.append(b"ENVELOPE " + envelope(hdr))
+            if section:
+                name = section.group(2)
+                if name == "":
+                    data = msg
+                elif name == "HEADER":
+                    data = hdr
+                elif name.startswith("HEADER.FIELDS"):
+                    fields = re.findall(r"[\w-]+", name)[2:]
+                    data = b"".join(l + b"\r\n" for l in hdr.split(b"\r\n")
+                                    if l.split(b":")[0].upper().decode()
+                                    in fields) + b"\r\n"
+                elif name == "TEXT":
+                    data = msg[len(hdr):]
+                else:
+                    data = b""
+                if not section.group(1) and s not in self.seen:
+                    self.seen.add(s)
+                    flags = True
+                parts.append(b"BODY[%s] {%d}\r\n" % (name.encode(), len(data))
+                             + data)
+            self.send(b"* %d FETCH (" % s + b" ".join(parts) + b")\r\n")
+            # Changed flags come in a response of their own, like some
+            # servers send them
+            if flags:
+                self.send(b"* %d FETCH (FLAGS (\\Seen))\r\n" % s)
+        self.send("%s OK FETCH completed\r\n" % tag)
+
+    def cmd_idle(self, tag, uid, rest):
+        self.send("+ idling\r\n")
+        # New message arrives every ARRIVE seconds until the client is done
+        while args.arrive and not self.pending:
+            r, _, _ = select.select([self.request], [], [], args.arrive)
+            if r:
+                break
+            self.count += 1
+            self.sets = {}
+            self.send("* %d EXISTS\r\n" % self.count)
+        line = self.readline()
+        if line.strip().upper() != b"DONE":
+            self.send("%s BAD expected DONE\r\n" % tag)
+            return
+        self.send("%s OK IDLE terminated\r\n" % tag)
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def make_cert(path):
+    """Generate self-signed certificate for localhost with its key."""
+    with lock:
+        if os.path.exists(path):
+            return
+        subprocess.check_call(
+            ["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+             "-days", "30", "-subj", "/CN=localhost",
+             "-keyout", path, "-out", path + ".crt"],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(path, "a") as out, open(path + ".crt") as crt:
+            out.write(crt.read())
+        os.unlink(path + ".crt")
+
+
+def main():
+    global args
+
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    p.add_argument("-p", "--port", type=int, default=1143,
+                   help="port to listen on (default: %(default)s)")
+    p.add_argument("-n", "--count", type=int, default=100,
+                   help="messages in every mailbox (default: %(default)s)")
+    p.add_argument("-s", "--size", type=int, default=4096,
+                   help="size of a message in bytes (default: %(default)s)")
+    p.add_argument("-u", "--unseen", type=int, default=10,
+                   help="unseen messages at the end of every mailbox "
+                        "(default: %(default)s)")
+    p.add_argument("-b", "--mailboxes", default="INBOX",
+                   help="comma separated mailbox names (default: "
+                        "%(default)s)")
+    p.add_argument("-l", "--latency", type=float, default=0,
+                   help="delay of every command in ms")
+    p.add_argument("-r", "--rate", type=float, default=0,
+                   help="limit of every connection in kB/s")
+    p.add_argument("-a", "--arrive", type=float, default=0,
+                   help="during IDLE, new message arrives every ARRIVE s")
+    p.add_argument("--uidstart", type=int, default=1000,
+                   help="UID of the first message (default: %(default)s)")
+    p.add_argument("--uidvalidity", type=int, default=42,
+                   help="UIDVALIDITY of the mailboxes (default: "
+                        "%(default)s)")
+    p.add_argument("--user", help="accept only this username")
+    p.add_argument("--password", help="password of the user")
+    p.add_argument("-z", "--compress", action="store_true",
+                   help="support COMPRESS=DEFLATE")
+    p.add_argument("-T", "--tls", action="store_true",
+                   help="use TLS (IMAPS)")
+    p.add_argument("--cert", default="imapd.pem",
+                   help="PEM file with key and certificate, self-signed one "
+                        "is generated if it doesn't exist (default: "
+                        "%(default)s)")
+    p.add_argument("-v", "--verbose", action="store_true",
+                   help="log connections and bytes sent to stderr")
+    args = p.parse_args()
+    args.mailboxes = args.mailboxes.split(",")
+
+    # Certificate is ready before the port accepts connections
+    if args.tls:
+        make_cert(args.cert)
+    srv = Server(("127.0.0.1", args.port), Handler)
+    if args.tls:
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        ctx.load_cert_chain(args.cert)
+        srv.socket = ctx.wrap_socket(srv.socket, server_side=True)
+
+    try:
+        srv.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -1,6 +1,17 @@
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <mutex>
+#include <functional>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
 #include "tls.hpp"
 
+// Cached files are written by parallel connections
+static std::mutex tls_cache_mutex;
+
 void tls_init()
 {
     OpenSSL_add_all_algorithms();
@@ -39,11 +50,157 @@ static int tls_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
     return preverify_ok;
 }
 
+/**
+ * @brief Atomically replace given cache file, readable by the owner only
+ *
+ * @param file Name of the file
+ * @param write Function writing the new content
+ *
+ * @return true on success
+ */
+static bool tls_cache_write(const std::string &file,
+                            const std::function<bool(FILE *)> &write)
+{
+    std::lock_guard<std::mutex> lock(tls_cache_mutex);
+    std::string tmp = file + ".tmp";
+    bool ok;
+    FILE *f;
+    int fd;
+
+    fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0)
+        return false;
+
+    f = fdopen(fd, "w");
+    if(f == NULL) {
+        close(fd);
+        return false;
+    }
+
+    ok = write(f);
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp.c_str(), file.c_str()) == 0;
+    if(!ok)
+        remove(tmp.c_str());
+
+    return ok;
+}
+
+/**
+ * @brief Save session given by the server for the next run
+ */
+static int tls_new_session(SSL *tls, SSL_SESSION *session)
+{
+    connection_data_t *conn = (connection_data_t *)SSL_get_app_data(tls);
+    std::string file = conn->tls_cache + TLS_SESSION_SUFFIX;
+
+    if(!tls_cache_write(file, [&](FILE *f) {
+                            return PEM_write_SSL_SESSION(f, session) == 1;
+                        }))
+        std::cerr << "Couldn't write file " << file << std::endl;
+
+    // Session is not kept in memory
+    return 0;
+}
+
+/**
+ * @brief Load session saved by the previous run
+ *
+ * @return Session or NULL if there is none
+ */
+static SSL_SESSION *tls_load_session(const std::string &cache)
+{
+    SSL_SESSION *session;
+    FILE *f;
+
+    f = fopen((cache + TLS_SESSION_SUFFIX).c_str(), "r");
+    if(f == NULL)
+        return NULL;
+
+    session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+    fclose(f);
+
+    return session;
+}
+
+/**
+ * @brief Get key of a certificate in the cache of verified certificates
+ * @details Key consists of SHA-256 of the certificate and of trusted
+ *          certificate locations, so a change of the locations makes the
+ *          cached certificates unverified
+ */
+static std::string tls_verified_key(X509 *cert, const std::string &certfile,
+                                    const std::string &certdir)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    char hex[3];
+    std::string key;
+
+    if(X509_digest(cert, EVP_sha256(), md, &len) != 1)
+        return "";
+
+    for(unsigned int i = 0; i < len; i++) {
+        snprintf(hex, sizeof(hex), "%02x", md[i]);
+        key += hex;
+    }
+
+    return key + "\t" + certfile + "\t" + certdir;
+}
+
+/**
+ * @brief Verify certificate chain of the server
+ * @details Chain with a leaf certificate which was verified by a previous
+ *          run and which is still valid is accepted without verification
+ */
+static int tls_verify_chain(X509_STORE_CTX *ctx, void *arg)
+{
+    SSL *tls = (SSL *)X509_STORE_CTX_get_ex_data(ctx,
+                    SSL_get_ex_data_X509_STORE_CTX_idx());
+    connection_data_t *conn = (connection_data_t *)SSL_get_app_data(tls);
+    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
+    std::string file = conn->tls_cache + TLS_VERIFIED_SUFFIX;
+    std::string key;
+    std::string line;
+    std::string cached;
+
+    (void)arg;
+
+    if(conn->tls_cache.empty() || cert == NULL)
+        return X509_verify_cert(ctx);
+
+    key = tls_verified_key(cert, conn->cert_file, conn->cert_dir);
+    if(!key.empty() && X509_cmp_current_time(X509_get0_notBefore(cert)) < 0 &&
+       X509_cmp_current_time(X509_get0_notAfter(cert)) > 0) {
+        std::ifstream in(file.c_str());
+        while(std::getline(in, line)) {
+            if(line == key) {
+                X509_STORE_CTX_set_error(ctx, X509_V_OK);
+                return 1;
+            }
+            cached += line + "\n";
+        }
+    }
+
+    if(X509_verify_cert(ctx) != 1)
+        return 0;
+
+    if(!key.empty())
+        tls_cache_write(file, [&](FILE *f) {
+                            return fputs((cached + key + "\n").c_str(), f)
+                                   >= 0;
+                        });
+
+    return 1;
+}
+
 int tls_upgrade_connection(connection_data_t *conn,
                            const std::string &certfile,
-                           const std::string &certdir)
+                           const std::string &certdir,
+                           const std::string &cache)
 {
     SSL_CTX *ctx;
+    SSL_SESSION *session;
     const char *cafile = NULL;
     const char *capath = NULL;
     int rc = E_TLS;
@@ -73,8 +230,29 @@ int tls_upgrade_connection(connection_data_t *conn,
     }
 
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, tls_verify_callback);
+    SSL_CTX_set_cert_verify_callback(ctx, tls_verify_chain, NULL);
+    conn->cert_file = certfile;
+    conn->cert_dir = certdir;
+    conn->tls_cache = cache;
+
+    // Sessions are resumed from the cache, new ones are stored there
+    if(!cache.empty()) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+    }
+
     conn->tlsd = SSL_new(ctx);
+    SSL_set_app_data(conn->tlsd, conn);
     SSL_set_fd(conn->tlsd, conn->sd);
+
+    if(!cache.empty()) {
+        session = tls_load_session(cache);
+        if(session != NULL) {
+            SSL_set_session(conn->tlsd, session);
+            SSL_SESSION_free(session);
+        }
+    }
     if(SSL_connect(conn->tlsd) != 1) {
         std::cerr << "Couldn't upgrade given connection to TLS" << std::endl;
         goto end;
@@ -10,6 +10,10 @@
 #include <openssl/x509v3.h>
 #include "utils.hpp"
 
+// Suffixes of TLS cache files
+#define TLS_SESSION_SUFFIX ".session"
+#define TLS_VERIFIED_SUFFIX ".verified"
+
 /**
  * @brief Initialize internal OpenSSL library structures
  */
@@ -35,11 +39,14 @@ void tls_shutdown(SSL *tls);
  *                 verification
  * @param certdir Path to a directory with certificates for a peer certificate
  *                verification
+ * @param cache Path prefix of files with TLS session for resumption and
+ *              with verified server certificates, empty to disable the cache
  *
  * @return E_OK on success, E_TLS otherwise
  */
 int tls_upgrade_connection(connection_data_t *conn,
                            const std::string &certfile,
-                           const std::string &certdir);
+                           const std::string &certdir,
+                           const std::string &cache = "");
 
 #endif
@@ -2,7 +2,12 @@
 #include <string>
 #include <fstream>
 #include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include "utils.hpp"
 
 int read_creds_file(const std::string &file, std::string &user,
@@ -44,6 +49,24 @@ end:
     return ec;
 }
 
+std::string mailbox_file_name(const std::string &mailbox)
+{
+    std::string name;
+
+    // Mailbox names may contain hierarchy separators
+    for(char c : mailbox) {
+        if(c == '/' || c == '%') {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", c);
+            name += hex;
+        } else {
+            name += c;
+        }
+    }
+
+    return name;
+}
+
 ssize_t socket_read(connection_data_t *conn, void *buf, size_t nbyte)
 {
     if(conn->tls) {
@@ -53,7 +76,13 @@ ssize_t socket_read(connection_data_t *conn, void *buf, size_t nbyte)
     }
 }
 
-ssize_t socket_write(connection_data_t *conn, void *buf, size_t nbyte)
+/**
+ * @brief Write data to the socket as they are
+ *
+ * @return Return value of write() or SSL_write()
+ */
+static ssize_t socket_write_raw(connection_data_t *conn, const void *buf,
+                                size_t nbyte)
 {
     if(conn->tls) {
         return SSL_write(conn->tlsd, buf, nbyte);
@@ -61,3 +90,239 @@ ssize_t socket_write(connection_data_t *conn, void *buf, size_t nbyte)
         return write(conn->sd, buf, nbyte);
     }
 }
+
+/**
+ * @brief Deflate data and write all of the compressed output
+ *
+ * @return -1 on error, @p nbyte otherwise
+ */
+static ssize_t socket_write_deflate(connection_data_t *conn, void *buf,
+                                    size_t nbyte)
+{
+    z_stream *zs = conn->zout.get();
+    char out[SOCKET_ZBUF_SIZE];
+    size_t len;
+    size_t done;
+    ssize_t rc;
+
+    zs->next_in = (Bytef *)buf;
+    zs->avail_in = nbyte;
+
+    // Sync flush makes the server see the whole command right away
+    do {
+        zs->next_out = (Bytef *)out;
+        zs->avail_out = sizeof(out);
+        if(deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+            errno = EIO;
+            return -1;
+        }
+
+        len = sizeof(out) - zs->avail_out;
+        for(done = 0; done < len; done += rc) {
+            rc = socket_write_raw(conn, out + done, len - done);
+            if(rc <= 0)
+                return -1;
+        }
+    } while(zs->avail_out == 0);
+
+    return nbyte;
+}
+
+ssize_t socket_write(connection_data_t *conn, void *buf, size_t nbyte)
+{
+    if(conn->zout)
+        return socket_write_deflate(conn, buf, nbyte);
+
+    return socket_write_raw(conn, buf, nbyte);
+}
+
+int socket_compress(connection_data_t *conn)
+{
+    std::shared_ptr<z_stream> zin(new z_stream(), [](z_stream *zs) {
+                                      inflateEnd(zs);
+                                      delete zs;
+                                  });
+    std::shared_ptr<z_stream> zout(new z_stream(), [](z_stream *zs) {
+                                       deflateEnd(zs);
+                                       delete zs;
+                                   });
+    size_t first;
+
+    // Raw deflate without zlib header, as required by RFC 4978
+    if(inflateInit2(zin.get(), -MAX_WBITS) != Z_OK)
+        return E_SETUP;
+    if(deflateInit2(zout.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                    8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        inflateEnd(zin.get());
+        return E_SETUP;
+    }
+
+    conn->zbuf.resize(std::max((size_t)SOCKET_ZBUF_SIZE, conn->rlen));
+    conn->zhead = 0;
+    conn->zlen = conn->rlen;
+
+    // Unread data become compressed input
+    if(conn->rlen > 0) {
+        first = std::min(conn->rlen, conn->rbuf.size() - conn->rhead);
+        memcpy(&conn->zbuf[0], &conn->rbuf[conn->rhead], first);
+        memcpy(&conn->zbuf[first], &conn->rbuf[0], conn->rlen - first);
+        conn->rlen = 0;
+    }
+
+    conn->zin = zin;
+    conn->zout = zout;
+
+    return E_OK;
+}
+
+/**
+ * @brief Read compressed data from the socket and inflate them
+ *
+ * @param conn Connection data with compression enabled
+ * @param buf Destination for the inflated data
+ * @param nbyte Size of the destination, greater than 0
+ *
+ * @return -1 on error, 0 on EOF, number of inflated bytes otherwise
+ */
+static ssize_t socket_read_inflate(connection_data_t *conn, char *buf,
+                                   size_t nbyte)
+{
+    z_stream *zs = conn->zin.get();
+    ssize_t rc;
+    int zrc;
+
+    // A block may be split between reads, so loop until there is output
+    do {
+        if(conn->zlen == 0) {
+            rc = socket_read(conn, &conn->zbuf[0], conn->zbuf.size());
+            if(rc <= 0)
+                return rc;
+
+            conn->zhead = 0;
+            conn->zlen = rc;
+        }
+
+        zs->next_in = (Bytef *)&conn->zbuf[conn->zhead];
+        zs->avail_in = conn->zlen;
+        zs->next_out = (Bytef *)buf;
+        zs->avail_out = nbyte;
+
+        zrc = inflate(zs, Z_SYNC_FLUSH);
+        if(zrc != Z_OK && zrc != Z_BUF_ERROR && zrc != Z_STREAM_END) {
+            std::cerr << "Invalid compressed data: "
+                      << ((zs->msg != NULL) ? zs->msg : "unknown error")
+                      << std::endl;
+            errno = EPROTO;
+            return -1;
+        }
+
+        conn->zhead += conn->zlen - zs->avail_in;
+        conn->zlen = zs->avail_in;
+        rc = nbyte - zs->avail_out;
+
+        if(rc == 0 && zrc == Z_STREAM_END)
+            return 0;
+    } while(rc == 0);
+
+    return rc;
+}
+
+/**
+ * @brief Read data from the socket into free space of the receive buffer
+ *
+ * @param conn Connection data with a buffer which isn't full
+ *
+ * @return Return value of socket_read()
+ */
+static ssize_t socket_fill(connection_data_t *conn)
+{
+    size_t cap;
+    size_t tail;
+    size_t room;
+    ssize_t rc;
+
+    if(conn->rbuf.empty())
+        conn->rbuf.resize(SOCKET_BUF_SIZE);
+
+    // Empty buffer starts from the beginning to get the largest read
+    if(conn->rlen == 0)
+        conn->rhead = 0;
+
+    cap = conn->rbuf.size();
+    tail = (conn->rhead + conn->rlen) % cap;
+    room = (tail >= conn->rhead) ? cap - tail : conn->rhead - tail;
+
+    if(conn->zin)
+        rc = socket_read_inflate(conn, &conn->rbuf[tail], room);
+    else
+        rc = socket_read(conn, &conn->rbuf[tail], room);
+    if(rc > 0)
+        conn->rlen += rc;
+
+    return rc;
+}
+
+ssize_t socket_read_buffered(connection_data_t *conn, const char **data)
+{
+    ssize_t rc;
+
+    if(conn->rlen == 0) {
+        rc = socket_fill(conn);
+        if(rc <= 0)
+            return rc;
+    }
+
+    *data = &conn->rbuf[conn->rhead];
+
+    return std::min(conn->rlen, conn->rbuf.size() - conn->rhead);
+}
+
+void socket_consume(connection_data_t *conn, size_t nbyte)
+{
+    conn->rhead = (conn->rhead + nbyte) % conn->rbuf.size();
+    conn->rlen -= nbyte;
+}
+
+ssize_t socket_read_line(connection_data_t *conn, std::string &line)
+{
+    const char *data;
+    const char *end;
+    ssize_t rc;
+    size_t len;
+
+    line.clear();
+
+    // Every byte is scanned once, the part without LF goes to the line
+    while((rc = socket_read_buffered(conn, &data)) > 0) {
+        end = (const char *)memchr(data, '\n', rc);
+        len = (end != NULL) ? end - data + 1 : rc;
+
+        line.append(data, len);
+        socket_consume(conn, len);
+
+        if(end != NULL)
+            return line.size();
+    }
+
+    return rc;
+}
+
+int socket_wait(connection_data_t *conn, int timeout)
+{
+    struct pollfd pfd;
+    int rc;
+
+    // Data may wait in the receive buffer, in OpenSSL or to be inflated
+    if(conn->rlen > 0 || conn->zlen > 0 ||
+       (conn->tls && SSL_pending(conn->tlsd) > 0))
+        return 1;
+
+    pfd.fd = conn->sd;
+    pfd.events = POLLIN;
+
+    do {
+        rc = poll(&pfd, 1, timeout);
+    } while(rc < 0 && errno == EINTR);
+
+    return rc;
+}
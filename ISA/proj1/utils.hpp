@@ -2,7 +2,26 @@
 #define __UTILS_H_INCLUDED
 
 #include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <memory>
 #include <openssl/ssl.h>
+#include <zlib.h>
+
+// Size of the receive buffer of a connection
+#define SOCKET_BUF_SIZE (256 << 10)
+// Size of the buffer of compressed data (both directions)
+#define SOCKET_ZBUF_SIZE (64 << 10)
+
+/**
+ * @brief When downloaded mails are synced to the disk
+ */
+enum fsync_policy {
+    FSYNC_NONE = 0, /**< Leave it to the system */
+    FSYNC_MAIL,     /**< Every mail before the next one is written */
+    FSYNC_END       /**< All mails at once when the download is finished */
+};
 
 /**
  * @brief Current configuration
@@ -11,25 +30,67 @@ typedef struct {
     bool            tls = false;            /**< Enable TLS/SSL */
     bool            new_only = false;       /**< Download only new messages */
     bool            header_only = false;    /**< Download only headers */
+    bool            sync = false;           /**< Download only missing mail */
+    bool            daemon = false;         /**< Wait for new mail (IDLE) */
+    bool            index = false;          /**< Write header index only */
     int             port = -1;              /**< Connection port */
+    int             jobs = 1;               /**< Parallel connections */
+    int             fsync = FSYNC_NONE;     /**< Sync policy of the mails */
     std::string     server_addr;            /**< Server address */
     std::string     cert_dir = "/etc/ssl/certs";    /**< Cert directory */
     std::string     cert_file;              /**< Cert file */
+    std::string     tls_cache;              /**< TLS session cache dir */
     std::string     auth_file;              /**< Credentials file */
     std::string     mailbox = "INBOX";      /**< Mailbox name */
     std::string     out_dir;                /**< Output directory */
+    std::string     archive;                /**< Mbox file for all mails */
 } config_data_t;
 
+typedef struct connection_data connection_data_t;
+
 /**
- * @brief Connection data
+ * @brief Handler of untagged responses
+ * @details It gets the first line of the response and has to read the rest
+ *          of it (literals and lines following them) from the connection
+ */
+typedef std::function<int(connection_data_t *, std::string &)> imap_handler_t;
+
+/**
+ * @brief Command sent to the server and waiting for its tagged response
  */
 typedef struct {
+    std::string keyword;    /**< Untagged responses routed to the command */
+    imap_handler_t handler; /**< If set, it processes the untagged responses */
+    std::string response;   /**< Untagged responses collected without handler */
+    std::string status;     /**< Tagged status response */
+    int ec = 0;             /**< First error reported by the handler */
+    bool done = false;      /**< Tagged response was received */
+} imap_command_t;
+
+/**
+ * @brief Connection data
+ */
+struct connection_data {
     bool tls = false;       /**< TLS state (enabled/disabled) */
     unsigned int cnt = 0;   /**< Request number */
     int mail_count = -1;    /**< Mail count for currently selected mailbox */
+    unsigned long uidvalidity = 0;  /**< UIDVALIDITY, 0 if unknown */
+    unsigned long uidnext = 0;      /**< UIDNEXT, 0 if unknown */
     int sd = -1;            /**< Socket descriptor */
     SSL *tlsd = NULL;       /**< OpenSSL socket descriptor */
-} connection_data_t;
+    std::string cert_file;  /**< Cert file of the TLS connection */
+    std::string cert_dir;   /**< Cert directory of the TLS connection */
+    std::string tls_cache;  /**< Prefix of TLS cache files, empty if none */
+    std::map<unsigned int, imap_command_t> pending; /**< Commands in flight */
+    std::vector<char> rbuf; /**< Ring buffer of received data */
+    size_t rhead = 0;       /**< Position of the first unread byte */
+    size_t rlen = 0;        /**< Number of unread bytes */
+    std::shared_ptr<z_stream> zin;  /**< Inflate stream, NULL if disabled */
+    std::shared_ptr<z_stream> zout; /**< Deflate stream, NULL if disabled */
+    std::vector<char> zbuf; /**< Compressed data received, not inflated yet */
+    size_t zhead = 0;       /**< Position of the first compressed byte */
+    size_t zlen = 0;        /**< Number of compressed bytes */
+};
 
 enum ec {
     E_OK = 0,       /**< Everything is ok */
@@ -54,6 +115,16 @@ enum ec {
 int read_creds_file(const std::string &file, std::string &user,
                     std::string &password);
 
+/**
+ * @brief Make file name part from a mailbox name
+ * @details Hierarchy separators '/' and '%' are escaped as %XX
+ *
+ * @param mailbox Mailbox name
+ *
+ * @return Mailbox name usable in a file name
+ */
+std::string mailbox_file_name(const std::string &mailbox);
+
 /**
  * @brief Read data from specified (non)-SSL/TLS socket
  * @details This function serves as a wrapper around read() and SSL_read()
@@ -66,9 +137,53 @@ int read_creds_file(const std::string &file, std::string &user,
  */
 ssize_t socket_read(connection_data_t *conn, void *buf, size_t nbyte);
 
+/**
+ * @brief Get buffered data received from specified socket
+ * @details Data stay in the buffer until they are released by
+ *          socket_consume(), the buffer is refilled only when it's empty
+ *
+ * @param conn Valid pointer to the structure with current connection data
+ * @param data Set to the first unread byte
+ *
+ * @return -1 on error, 0 on EOF, number of contiguous bytes at @p data
+ *         otherwise
+ */
+ssize_t socket_read_buffered(connection_data_t *conn, const char **data);
+
+/**
+ * @brief Release given number of bytes from the receive buffer
+ *
+ * @param conn Valid pointer to the structure with current connection data
+ * @param nbyte Number of bytes, at most the size returned by
+ *              socket_read_buffered()
+ */
+void socket_consume(connection_data_t *conn, size_t nbyte);
+
+/**
+ * @brief Read one line from specified socket through the receive buffer
+ *
+ * @param conn Valid pointer to the structure with current connection data
+ * @param line Destination for the line, including the LF terminator
+ *
+ * @return -1 on error, 0 on EOF, length of the line otherwise
+ */
+ssize_t socket_read_line(connection_data_t *conn, std::string &line);
+
+/**
+ * @brief Wait until data can be read from specified socket
+ *
+ * @param conn Valid pointer to the structure with current connection data
+ * @param timeout Timeout in milliseconds, -1 for no timeout
+ *
+ * @return -1 on error, 0 on timeout, 1 if data are ready
+ */
+int socket_wait(connection_data_t *conn, int timeout);
+
 /**
  * @brief Write data to specified (non)-SSL/TLS socket
- * @details This function serves as a wrapper around write() and SSL_write()
+ * @details This function serves as a wrapper around write() and SSL_write(),
+ *          with compression enabled, the data are deflated and all of them
+ *          are written
  *
  * @param conn Valid pointer to the structure with current connection data
  * @param buf Data to write
@@ -78,4 +193,15 @@ ssize_t socket_read(connection_data_t *conn, void *buf, size_t nbyte);
  */
 ssize_t socket_write(connection_data_t *conn, void *buf, size_t nbyte);
 
+/**
+ * @brief Compress all following data in both directions (RFC 4978)
+ * @details Data already in the receive buffer are treated as compressed,
+ *          they were sent by the server after the compression was started
+ *
+ * @param conn Valid pointer to the structure with current connection data
+ *
+ * @return E_OK on success, E_SETUP otherwise
+ */
+int socket_compress(connection_data_t *conn);
+
 #endif
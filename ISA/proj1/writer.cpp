@@ -0,0 +1,420 @@
+#include <iostream>
+#include <cstring>
+#include <strings.h>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "writer.hpp"
+
+MailWriter::MailWriter(const std::string &dir)
+    : dir(dir)
+{
+}
+
+MailWriter::MailWriter(const config_data_t *config)
+    : dir(config->out_dir), archive(config->archive),
+      fsync_policy(config->fsync)
+{
+    if(config->index) {
+        archive = dir + mailbox_file_name(config->mailbox) + ".csv";
+        index = true;
+        append = config->sync;
+    }
+}
+
+void MailWriter::rewrite_index()
+{
+    if(index)
+        append = false;
+}
+
+MailWriter::~MailWriter()
+{
+    finish();
+}
+
+int MailWriter::start()
+{
+    struct stat st;
+
+    if(!archive.empty()) {
+        fd = open(archive.c_str(), O_WRONLY | O_CREAT |
+                  ((append) ? O_APPEND : O_TRUNC), 0666);
+        if(fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "Couldn't open file " << archive << ": "
+                      << strerror(errno) << std::endl;
+            return E_FILE;
+        }
+
+        buf.reserve(WRITER_BUF_SIZE);
+
+        // Columns are named in the first row of a new index
+        if(index && st.st_size == 0)
+            buf += "uid,date,from,to,subject,message_id\n";
+    }
+
+    writer = std::thread(&MailWriter::run, this);
+
+    return E_OK;
+}
+
+void MailWriter::push(mail_t &mail)
+{
+    std::unique_lock<std::mutex> lock(m);
+
+    // A single mail larger than the queue still gets through
+    cv.wait(lock, [this] { return queued < WRITER_QUEUE_SIZE; });
+
+    queued += mail.data.size();
+    queue.push_back(std::move(mail));
+    cv.notify_all();
+}
+
+int MailWriter::finish()
+{
+    if(writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            closed = true;
+            cv.notify_all();
+        }
+        writer.join();
+
+        if(sync() != E_OK && ec == E_OK)
+            ec = E_FILE;
+    }
+
+    if(fd >= 0) {
+        if(close(fd) != 0 && ec == E_OK) {
+            std::cerr << "Couldn't write file " << archive << ": "
+                      << strerror(errno) << std::endl;
+            ec = E_FILE;
+        }
+        fd = -1;
+    }
+
+    return ec;
+}
+
+/**
+ * @brief Writer thread, it writes queued mails until the queue is closed
+ */
+void MailWriter::run()
+{
+    std::deque<mail_t> batch;
+    size_t size;
+    int rc;
+
+    while(true) {
+        std::unique_lock<std::mutex> lock(m);
+
+        // Buffered data don't wait for more mail which may come much later
+        if(queue.empty() && !closed) {
+            lock.unlock();
+            rc = flush_archive();
+            if(rc != E_OK && ec == E_OK)
+                ec = rc;
+            lock.lock();
+        }
+
+        cv.wait(lock, [this] { return !queue.empty() || closed; });
+        if(queue.empty())
+            break;
+
+        // Whole queue is taken at once, producers wait for the lock less
+        batch.swap(queue);
+        lock.unlock();
+
+        size = 0;
+        for(auto &mail : batch) {
+            if(fd < 0)
+                rc = write_file(mail);
+            else
+                rc = (index) ? write_index(mail) : write_archive(mail);
+            if(rc != E_OK && ec == E_OK)
+                ec = rc;
+            size += mail.data.size();
+        }
+        batch.clear();
+
+        lock.lock();
+        queued -= size;
+        cv.notify_all();
+    }
+
+    rc = flush_archive();
+    if(rc != E_OK && ec == E_OK)
+        ec = rc;
+}
+
+/**
+ * @brief Write all data to a file descriptor
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int write_all(int fd, const char *data, size_t len)
+{
+    ssize_t rc;
+
+    while(len > 0) {
+        rc = write(fd, data, len);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0)
+            return -1;
+
+        data += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write mail into its own file
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int MailWriter::write_file(const mail_t &mail)
+{
+    std::string filename = dir + mail.name;
+    int out;
+    int rc;
+
+    out = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(out < 0) {
+        std::cerr << "Couldn't open file " << filename << ": "
+                  << strerror(errno) << std::endl;
+        return E_FILE;
+    }
+
+    rc = write_all(out, mail.data.data(), mail.data.size());
+    if(rc == 0 && fsync_policy == FSYNC_MAIL)
+        rc = fsync(out);
+    if(close(out) != 0)
+        rc = -1;
+
+    if(rc != 0) {
+        std::cerr << "Couldn't write file " << filename << ": "
+                  << strerror(errno) << std::endl;
+        return E_FILE;
+    }
+
+    return E_OK;
+}
+
+/**
+ * @brief Append mail to the archive buffer in mboxrd format
+ * @details Mail is preceded by a "From " line, its lines starting with
+ *          any number of '>' followed by "From " get one more '>' and CRLF
+ *          line endings are converted to LF.
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int MailWriter::write_archive(const mail_t &mail)
+{
+    const std::string &data = mail.data;
+    time_t now = time(NULL);
+    char date[32];
+    size_t pos = 0;
+    size_t next;
+    size_t text;
+    int rc = E_OK;
+
+    // ctime_r() ends the date with LF
+    buf += "From imapcl ";
+    buf += ctime_r(&now, date);
+
+    while(pos < data.size()) {
+        next = data.find('\n', pos);
+        next = (next == std::string::npos) ? data.size() : next + 1;
+
+        text = data.find_first_not_of('>', pos);
+        if(text != std::string::npos && text < next &&
+           data.compare(text, 5, "From ") == 0)
+            buf += '>';
+
+        text = next - pos;
+        if(text > 0 && data[next - 1] == '\n')
+            text -= (text > 1 && data[next - 2] == '\r') ? 2 : 1;
+        buf.append(data, pos, text);
+        buf += '\n';
+
+        pos = next;
+    }
+
+    // Mails are separated by an empty line
+    buf += '\n';
+
+    if(buf.size() >= WRITER_BUF_SIZE || fsync_policy == FSYNC_MAIL)
+        rc = flush_archive();
+    if(rc == E_OK && fsync_policy == FSYNC_MAIL && fsync(fd) != 0) {
+        std::cerr << "Couldn't sync file " << archive << ": "
+                  << strerror(errno) << std::endl;
+        rc = E_FILE;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Append field to a CSV row
+ * @details Field with a separator, quote or line break is quoted (RFC 4180)
+ */
+static void csv_field(std::string &row, const std::string &field)
+{
+    if(field.find_first_of(",\"\r\n") == std::string::npos) {
+        row += field;
+        return;
+    }
+
+    row += '"';
+    for(char c : field) {
+        if(c == '"')
+            row += '"';
+        row += c;
+    }
+    row += '"';
+}
+
+/**
+ * @brief Append row of the header index for the mail
+ * @details Mail data are the header fields of WRITER_INDEX_FIELDS, they are
+ *          unfolded and the first occurrence of each is used. Values are
+ *          kept as they are, encoded words aren't decoded.
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int MailWriter::write_index(const mail_t &mail)
+{
+    static const char *names[] = { "date", "from", "to", "subject",
+                                   "message-id" };
+    const size_t count = sizeof(names) / sizeof(names[0]);
+    const std::string &data = mail.data;
+    std::string values[count];
+    std::string *value = NULL;
+    size_t pos = 0;
+    size_t next;
+    size_t colon;
+    size_t end;
+    int rc = E_OK;
+
+    while(pos < data.size()) {
+        next = data.find('\n', pos);
+        next = (next == std::string::npos) ? data.size() : next + 1;
+        end = data.find_last_not_of("\r\n", next - 1);
+        end = (end == std::string::npos || end < pos) ? pos : end + 1;
+
+        // Folded line continues the previous field
+        if(data[pos] == ' ' || data[pos] == '\t') {
+            if(value != NULL)
+                value->append(data, pos, end - pos);
+            pos = next;
+            continue;
+        }
+
+        value = NULL;
+        colon = data.find(':', pos);
+        if(colon < end) {
+            for(size_t i = 0; i < count; i++) {
+                if(colon - pos == strlen(names[i]) &&
+                   strncasecmp(&data[pos], names[i], colon - pos) == 0 &&
+                   values[i].empty()) {
+                    value = &values[i];
+                    value->assign(data, colon + 1, end - colon - 1);
+                    break;
+                }
+            }
+        }
+
+        pos = next;
+    }
+
+    buf += std::to_string(mail.uid);
+    for(size_t i = 0; i < count; i++) {
+        size_t first = values[i].find_first_not_of(" \t");
+        size_t last = values[i].find_last_not_of(" \t");
+
+        buf += ',';
+        if(first != std::string::npos)
+            csv_field(buf, values[i].substr(first, last - first + 1));
+    }
+    buf += '\n';
+
+    if(buf.size() >= WRITER_BUF_SIZE || fsync_policy == FSYNC_MAIL)
+        rc = flush_archive();
+    if(rc == E_OK && fsync_policy == FSYNC_MAIL && fsync(fd) != 0) {
+        std::cerr << "Couldn't sync file " << archive << ": "
+                  << strerror(errno) << std::endl;
+        rc = E_FILE;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Write buffered archive data
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int MailWriter::flush_archive()
+{
+    int rc = E_OK;
+
+    if(fd < 0 || buf.empty())
+        return E_OK;
+
+    if(write_all(fd, buf.data(), buf.size()) != 0) {
+        std::cerr << "Couldn't write file " << archive << ": "
+                  << strerror(errno) << std::endl;
+        rc = E_FILE;
+    }
+
+    buf.clear();
+
+    return rc;
+}
+
+/**
+ * @brief Sync written data at the end as required by the fsync policy
+ * @details Mail files are synced by syncfs() of the output directory, which
+ *          is much cheaper than fsync() of every file. Directory is synced
+ *          with every policy which syncs data, so the file names persist.
+ *
+ * @return E_OK on success, E_FILE otherwise
+ */
+int MailWriter::sync()
+{
+    int dirfd;
+    int rc = 0;
+
+    if(fsync_policy == FSYNC_NONE)
+        return E_OK;
+
+    if(fd >= 0) {
+        if(fsync_policy == FSYNC_END)
+            rc = fsync(fd);
+    } else {
+        dirfd = open((dir.empty()) ? "." : dir.c_str(), O_RDONLY);
+        if(dirfd < 0) {
+            rc = -1;
+        } else {
+            if(fsync_policy == FSYNC_END)
+                rc = syncfs(dirfd);
+            if(rc == 0)
+                rc = fsync(dirfd);
+            close(dirfd);
+        }
+    }
+
+    if(rc != 0) {
+        std::cerr << "Couldn't sync downloaded mails: " << strerror(errno)
+                  << std::endl;
+        return E_FILE;
+    }
+
+    return E_OK;
+}
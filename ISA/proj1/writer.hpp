@@ -0,0 +1,113 @@
+#ifndef __WRITER_H_INCLUDED
+#define __WRITER_H_INCLUDED
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "utils.hpp"
+
+// Bytes of mail data which may wait for the writer
+#define WRITER_QUEUE_SIZE (32 << 20)
+// Size of the output buffer of the archive
+#define WRITER_BUF_SIZE (1 << 20)
+// Header fields of the index, in the order of its columns
+#define WRITER_INDEX_FIELDS "DATE FROM TO SUBJECT MESSAGE-ID"
+
+/**
+ * @brief Downloaded mail waiting to be written
+ */
+typedef struct {
+    std::string name;       /**< File name in the output directory */
+    std::string data;       /**< Mail itself */
+    unsigned int uid = 0;   /**< UID of the mail, 0 if unknown */
+} mail_t;
+
+/**
+ * @brief Thread writing downloaded mails to the disk
+ * @details Connections hand mails over and continue with the download
+ *          while the writer creates the files. Every mail is written into
+ *          its own file, or all of them go to one archive through a large
+ *          buffer. The archive is either an mbox file, or a CSV index with
+ *          a row of header fields per mail.
+ */
+class MailWriter {
+public:
+    /**
+     * @brief Writer of mail files without sync
+     *
+     * @param dir Output directory of mail files
+     */
+    MailWriter(const std::string &dir);
+
+    /**
+     * @brief Writer of the output selected by the configuration
+     * @details The index is <out_dir>/<mailbox>.csv, it is rewritten unless
+     *          the mailbox is synchronized, an mbox archive is appended to
+     *
+     * @param config Current configuration
+     */
+    MailWriter(const config_data_t *config);
+
+    /**
+     * @brief Wait for the queued mails, @see finish()
+     */
+    ~MailWriter();
+
+    /**
+     * @brief Rewrite the index even if the mailbox is synchronized
+     * @details Rows of the old index can't be matched with a mailbox whose
+     *          synchronization state was lost. Has to be called before
+     *          start(), other archives are left as they are.
+     */
+    void rewrite_index();
+
+    /**
+     * @brief Open the archive and start the writer thread
+     *
+     * @return E_OK on success, E_FILE otherwise
+     */
+    int start();
+
+    /**
+     * @brief Queue given mail, wait while the queue is full
+     * @details Data are moved from the mail, it is left empty
+     *
+     * @param mail Mail with its file name
+     */
+    void push(mail_t &mail);
+
+    /**
+     * @brief Write all queued mails and stop the writer thread
+     *
+     * @return E_OK if all mails were written, E_FILE otherwise
+     */
+    int finish();
+
+private:
+    void run();
+    int write_file(const mail_t &mail);
+    int write_archive(const mail_t &mail);
+    int write_index(const mail_t &mail);
+    int flush_archive();
+    int sync();
+
+    std::string dir;
+    std::string archive;
+    int fsync_policy = FSYNC_NONE;
+    bool index = false;
+    bool append = true;
+    int fd = -1;
+    int ec = E_OK;
+    std::string buf;
+
+    std::thread writer;
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<mail_t> queue;
+    size_t queued = 0;
+    bool closed = false;
+};
+
+#endif